@@ -0,0 +1,593 @@
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+
+using namespace jd::memory;
+using Clock = std::chrono::high_resolution_clock;
+
+static constexpr size_t LATENCY_SAMPLE_PERIOD = 64;
+static constexpr size_t HEAP_RESERVE          = 8_GB;
+
+// The configuration of liblab4malloc; the heap is thread-safe only for the multi-threaded workloads
+struct LabHeap {
+    static constexpr const char* NAME = "lab4";
+
+    static AllocatorOptions options(bool thread_safe)
+    {
+        return {
+            .thread_safe  = thread_safe,
+            .engine       = CoalesceEngine::TLSF,
+            .lazy_carving = true,
+            .heap_reserve = HEAP_RESERVE,
+        };
+    }
+    static void setUp(bool thread_safe)
+    {
+        MemoryAllocator::allocator().init(options(thread_safe));
+    }
+    static void* alloc(size_t size)
+    {
+        return MemoryAllocator::allocator().alloc(size);
+    }
+    static void free(void* p)
+    {
+        MemoryAllocator::allocator().free(p);
+    }
+    static void* realloc(void* p, size_t size)
+    {
+        return MemoryAllocator::allocator().realloc(p, size);
+    }
+};
+
+// The same heap with the blocks freed by another thread kept in the cache of the freeing one
+struct LabLocalFreeHeap : LabHeap {
+    static constexpr const char* NAME = "lab4_local_free";
+
+    static void setUp(bool thread_safe)
+    {
+        AllocatorOptions local_free = options(thread_safe);
+        local_free.remote_frees     = false;
+        MemoryAllocator::allocator().init(local_free);
+    }
+};
+
+struct LibcHeap {
+    static constexpr const char* NAME = "malloc";
+
+    static void setUp(bool)
+    {
+    }
+    static void* alloc(size_t size)
+    {
+        return std::malloc(size);
+    }
+    static void free(void* p)
+    {
+        std::free(p);
+    }
+    static void* realloc(void* p, size_t size)
+    {
+        return std::realloc(p, size);
+    }
+};
+
+// Median cost of the two clock reads around a timed operation, taken off every latency sample
+int64_t measureClockOverhead()
+{
+    std::vector<int64_t> samples(1000);
+    for (int64_t& sample : samples) {
+        auto start = Clock::now();
+        auto end   = Clock::now();
+        sample     = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Counts the operations of one thread and times one of every LATENCY_SAMPLE_PERIOD of them,
+// so the clock reads stay off most of the measured loop
+template <typename Heap>
+class Meter
+{
+public:
+    static inline int64_t clock_overhead_ns = 0;
+
+    size_t ops{0};
+    std::vector<uint32_t> samples;
+
+    void* alloc(size_t size)
+    {
+        return touch(measure([&] { return Heap::alloc(size); }), size);
+    }
+
+    void free(void* p)
+    {
+        measure([&] {
+            Heap::free(p);
+            return p;
+        });
+    }
+
+    void* realloc(void* p, size_t size)
+    {
+        return touch(measure([&] { return Heap::realloc(p, size); }), size);
+    }
+
+private:
+    size_t countdown_{LATENCY_SAMPLE_PERIOD};
+
+    template <typename Op>
+    void* measure(Op&& op)
+    {
+        ++ops;
+        if (--countdown_ != 0) [[likely]] {
+            return op();
+        }
+        countdown_  = LATENCY_SAMPLE_PERIOD;
+        auto start  = Clock::now();
+        void* block = op();
+        auto end    = Clock::now();
+        int64_t ns  = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() - clock_overhead_ns;
+        samples.push_back(static_cast<uint32_t>(std::clamp<int64_t>(ns, 0, UINT32_MAX)));
+        return block;
+    }
+
+    // a block is written like a program would, so its pages count in the resident set
+    static void* touch(void* block, size_t size)
+    {
+        if (!block) {
+            std::cerr << Heap::NAME << " failed to allocate " << size << " bytes" << std::endl;
+            _exit(EXIT_FAILURE);
+        }
+        static_cast<char*>(block)[0]        = 1;
+        static_cast<char*>(block)[size - 1] = 1;
+        return block;
+    }
+};
+
+struct Params {
+    size_t scale;
+    size_t size; // fixed-size workloads only
+};
+
+// xorshift64, cheap enough to stay out of the measurement
+struct Random {
+    uint64_t state;
+
+    uint64_t next() noexcept
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // log-uniform in [min, max]: small blocks dominate the way they do in real programs
+    size_t size(size_t min, size_t max) noexcept
+    {
+        size_t bits = std::bit_width(max) - std::bit_width(min) + 1;
+        size_t size = min << (next() % bits);
+        return std::clamp<size_t>(size + next() % size, min, max);
+    }
+};
+
+template <typename Heap, typename Body>
+void onThreads(std::vector<Meter<Heap>>& meters, Body body)
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < meters.size(); ++i) {
+        threads.emplace_back([&, i] { body(meters[i], i); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// A window of live blocks of one size, the oldest one is replaced by every step
+template <typename Heap>
+void fixedChurn(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    Meter<Heap>& meter = meters[0];
+    std::vector<void*> window(1000);
+    for (void*& block : window) {
+        block = meter.alloc(params.size);
+    }
+    for (size_t i = 0; i < 2'000'000 * params.scale; ++i) {
+        void*& block = window[i % window.size()];
+        meter.free(block);
+        block = meter.alloc(params.size);
+    }
+    for (void* block : window) {
+        meter.free(block);
+    }
+}
+
+// Random sizes over every path of the heap, replaced at random positions
+template <typename Heap>
+void randomMix(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    Meter<Heap>& meter = meters[0];
+    Random random{42};
+    std::vector<void*> live(10000);
+    for (void*& block : live) {
+        block = meter.alloc(random.size(8, 64_KB));
+    }
+    for (size_t i = 0; i < 1'000'000 * params.scale; ++i) {
+        void*& block = live[random.next() % live.size()];
+        meter.free(block);
+        block = meter.alloc(random.size(8, 64_KB));
+    }
+    for (void* block : live) {
+        meter.free(block);
+    }
+}
+
+// Batches freed in the reverse order of their allocation (a stack) or in the same order (a queue)
+template <typename Heap, bool IS_LIFO>
+void batchOrder(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    Meter<Heap>& meter = meters[0];
+    Random random{7};
+    std::vector<void*> batch(1000);
+    for (size_t round = 0; round < 1000 * params.scale; ++round) {
+        for (void*& block : batch) {
+            block = meter.alloc(random.size(8, 1_KB));
+        }
+        if constexpr (IS_LIFO) {
+            std::for_each(batch.rbegin(), batch.rend(), [&](void* block) { meter.free(block); });
+        } else {
+            std::for_each(batch.begin(), batch.end(), [&](void* block) { meter.free(block); });
+        }
+    }
+}
+
+// Long-lived blocks replaced rarely, among short-lived ones dying within a few steps
+template <typename Heap>
+void longShortLived(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    Meter<Heap>& meter = meters[0];
+    Random random{11};
+    std::vector<void*> long_lived(50000);
+    for (void*& block : long_lived) {
+        block = meter.alloc(random.size(16, 16_KB));
+    }
+    std::vector<void*> short_lived(64);
+    for (void*& block : short_lived) {
+        block = meter.alloc(random.size(8, 4_KB));
+    }
+    for (size_t i = 0; i < 2'000'000 * params.scale; ++i) {
+        void*& block = short_lived[random.next() % short_lived.size()];
+        meter.free(block);
+        block = meter.alloc(random.size(8, 4_KB));
+        if (i % 100 == 0) {
+            void*& old = long_lived[random.next() % long_lived.size()];
+            meter.free(old);
+            old = meter.alloc(random.size(16, 16_KB));
+        }
+    }
+    for (void* block : short_lived) {
+        meter.free(block);
+    }
+    for (void* block : long_lived) {
+        meter.free(block);
+    }
+}
+
+// Buffers growing by half their size, interleaved so that a neighbour often sits right behind a buffer
+template <typename Heap>
+void reallocGrowth(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    Meter<Heap>& meter = meters[0];
+    std::vector<void*> buffers(64);
+    std::vector<size_t> sizes(buffers.size());
+    for (size_t round = 0; round < 20 * params.scale; ++round) {
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            sizes[i]   = 16;
+            buffers[i] = meter.alloc(sizes[i]);
+        }
+        while (sizes[0] < 2_MB) {
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                sizes[i] += sizes[i] / 2;
+                buffers[i] = meter.realloc(buffers[i], sizes[i]);
+            }
+        }
+        for (void* buffer : buffers) {
+            meter.free(buffer);
+        }
+    }
+}
+
+// Larson: every thread replaces random blocks of its set, and every round the sets move on to the next thread,
+// so most blocks are freed by another thread than the one that allocated them
+template <typename Heap>
+void larson(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    const size_t threads = meters.size();
+    const size_t rounds  = 20;
+    std::vector<std::vector<void*>> sets(threads, std::vector<void*>(1000));
+    std::barrier sync{static_cast<ptrdiff_t>(threads)};
+
+    onThreads(meters, [&](Meter<Heap>& meter, size_t index) {
+        Random random{index * 31 + 1};
+        for (void*& block : sets[index]) {
+            block = meter.alloc(random.size(16, 1_KB));
+        }
+        for (size_t round = 0; round < rounds; ++round) {
+            sync.arrive_and_wait();
+            std::vector<void*>& set = sets[(index + round) % threads];
+            for (size_t i = 0; i < 100'000 * params.scale; ++i) {
+                void*& block = set[random.next() % set.size()];
+                meter.free(block);
+                block = meter.alloc(random.size(16, 1_KB));
+            }
+        }
+        sync.arrive_and_wait();
+        for (void* block : sets[index]) {
+            meter.free(block);
+        }
+    });
+}
+
+// Threadtest: every thread allocates a batch of small blocks and frees it, nothing is shared
+template <typename Heap>
+void threadTest(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    onThreads(meters, [&](Meter<Heap>& meter, size_t) {
+        std::vector<void*> batch(10000);
+        for (size_t round = 0; round < 100 * params.scale; ++round) {
+            for (void*& block : batch) {
+                block = meter.alloc(64);
+            }
+            for (void* block : batch) {
+                meter.free(block);
+            }
+        }
+    });
+}
+
+// Half of the threads allocate batches and hand them over a queue, the other half frees them
+template <typename Heap>
+void producerConsumer(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    const size_t producers = std::max<size_t>(meters.size() / 2, 1);
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::vector<void*>> queue;
+    size_t producing = producers;
+
+    onThreads(meters, [&](Meter<Heap>& meter, size_t index) {
+        if (index < producers) {
+            Random random{index + 1};
+            for (size_t round = 0; round < 2000 * params.scale; ++round) {
+                std::vector<void*> batch(256);
+                for (void*& block : batch) {
+                    block = meter.alloc(random.size(16, 1_KB));
+                }
+                std::lock_guard lock{mutex};
+                queue.push_back(std::move(batch));
+                ready.notify_one();
+            }
+            std::lock_guard lock{mutex};
+            producing--;
+            ready.notify_all();
+            return;
+        }
+
+        for (;;) {
+            std::vector<void*> batch;
+            {
+                std::unique_lock lock{mutex};
+                ready.wait(lock, [&] { return !queue.empty() || producing == 0; });
+                if (queue.empty()) {
+                    return;
+                }
+                batch = std::move(queue.front());
+                queue.pop_front();
+            }
+            for (void* block : batch) {
+                meter.free(block);
+            }
+        }
+    });
+}
+
+// Single-producer single-consumer queue of messages
+struct Ring {
+    static constexpr size_t SIZE = 1024;
+    alignas(64) std::atomic<size_t> head{0}; // messages freed, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // messages sent, written by the producer
+    void* slots[SIZE];
+};
+
+// Pairs of threads pass messages over a ring: one side allocates every message and the other frees it.
+// The ring is lock-free, so the cross-thread free is what costs; an odd thread out stays idle
+template <typename Heap>
+void pipeline(std::vector<Meter<Heap>>& meters, const Params& params)
+{
+    std::vector<Ring> rings(meters.size() / 2);
+    const size_t messages = 1'000'000 * params.scale;
+
+    onThreads(meters, [&](Meter<Heap>& meter, size_t index) {
+        if (index / 2 >= rings.size()) {
+            return;
+        }
+        Ring& ring = rings[index / 2];
+        if (index % 2 == 0) {
+            Random random{index + 1};
+            for (size_t i = 0; i < messages; ++i) {
+                void* message = meter.alloc(random.size(16, 512));
+                while (i - ring.head.load(std::memory_order_acquire) >= Ring::SIZE) {
+                    std::this_thread::yield();
+                }
+                ring.slots[i % Ring::SIZE] = message;
+                ring.tail.store(i + 1, std::memory_order_release);
+            }
+            return;
+        }
+        for (size_t i = 0; i < messages; ++i) {
+            while (ring.tail.load(std::memory_order_acquire) == i) {
+                std::this_thread::yield();
+            }
+            meter.free(ring.slots[i % Ring::SIZE]);
+            ring.head.store(i + 1, std::memory_order_release);
+        }
+    });
+}
+
+template <typename Heap>
+using WorkloadFn = void (*)(std::vector<Meter<Heap>>&, const Params&);
+
+struct Workload {
+    std::string name;
+    bool is_multi_threaded;
+    size_t size;
+    WorkloadFn<LabHeap> lab;
+    WorkloadFn<LibcHeap> libc;
+    WorkloadFn<LabLocalFreeHeap> lab_local_free{nullptr}; // cross-thread workloads, against the heap without remote frees
+};
+
+// Sent by the child running one measurement to the parent
+struct Result {
+    bool is_valid;
+    double mops_per_s;
+    uint32_t p50_ns;
+    uint32_t p99_ns;
+    uint32_t p999_ns;
+    uint32_t max_ns;
+    long peak_rss_kb;
+};
+
+template <typename Heap>
+Result measure(WorkloadFn<Heap> workload, size_t threads, const Params& params)
+{
+    Heap::setUp(threads > 1);
+    Meter<Heap>::clock_overhead_ns = measureClockOverhead();
+    std::vector<Meter<Heap>> meters(threads);
+
+    auto start = Clock::now();
+    workload(meters, params);
+    auto end = Clock::now();
+
+    size_t ops = 0;
+    std::vector<uint32_t> samples;
+    for (Meter<Heap>& meter : meters) {
+        ops += meter.ops;
+        samples.insert(samples.end(), meter.samples.begin(), meter.samples.end());
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double share) { return samples.empty() ? 0 : samples[static_cast<size_t>(share * (samples.size() - 1))]; };
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    Result result{};
+    result.is_valid    = true;
+    result.mops_per_s  = ops / std::chrono::duration<double, std::micro>(end - start).count();
+    result.p50_ns      = percentile(0.5);
+    result.p99_ns      = percentile(0.99);
+    result.p999_ns     = percentile(0.999);
+    result.max_ns      = samples.empty() ? 0 : samples.back();
+    result.peak_rss_kb = usage.ru_maxrss;
+    return result;
+}
+
+// Every measurement runs in a child of its own: the peak RSS belongs to that run alone,
+// and neither heap inherits the memory the previous run left behind
+template <typename Heap>
+Result measureInChild(WorkloadFn<Heap> workload, size_t threads, const Params& params)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return {};
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Result result = measure(workload, threads, params);
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+
+    Result result{};
+    if (pid < 0 || read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        result = {};
+    }
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+    }
+    return result;
+}
+
+void printResult(const Workload& workload, const char* heap, size_t threads, const Result& result)
+{
+    if (!result.is_valid) {
+        std::cout << workload.name << "," << heap << "," << threads << ",failed,,,,,\n" << std::flush;
+        return;
+    }
+    std::printf("%s,%s,%zu,%.2f,%u,%u,%u,%u,%.1f\n", workload.name.c_str(), heap, threads, result.mops_per_s, result.p50_ns, result.p99_ns, result.p999_ns,
+                result.max_ns, result.peak_rss_kb / 1024.0);
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " [scale] [threads] [workload_prefix]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const size_t scale       = argc > 1 ? std::stoul(argv[1]) : 1;
+    const size_t threads     = argc > 2 ? std::stoul(argv[2]) : std::clamp<size_t>(std::thread::hardware_concurrency(), 2, 8);
+    const std::string filter = argc > 3 ? argv[3] : "";
+
+    std::vector<Workload> workloads;
+    for (size_t size : {16, 32, 64, 128, 256, 512, 1024, 2048, 4096}) {
+        workloads.push_back({"fixed_" + std::to_string(size), false, size, fixedChurn<LabHeap>, fixedChurn<LibcHeap>});
+    }
+    workloads.push_back({"random_mix", false, 0, randomMix<LabHeap>, randomMix<LibcHeap>});
+    workloads.push_back({"lifo", false, 0, batchOrder<LabHeap, true>, batchOrder<LibcHeap, true>});
+    workloads.push_back({"fifo", false, 0, batchOrder<LabHeap, false>, batchOrder<LibcHeap, false>});
+    workloads.push_back({"long_short_lived", false, 0, longShortLived<LabHeap>, longShortLived<LibcHeap>});
+    workloads.push_back({"realloc_growth", false, 0, reallocGrowth<LabHeap>, reallocGrowth<LibcHeap>});
+    workloads.push_back({"larson", true, 0, larson<LabHeap>, larson<LibcHeap>});
+    workloads.push_back({"threadtest", true, 0, threadTest<LabHeap>, threadTest<LibcHeap>});
+    workloads.push_back({"producer_consumer", true, 0, producerConsumer<LabHeap>, producerConsumer<LibcHeap>, producerConsumer<LabLocalFreeHeap>});
+    workloads.push_back({"pipeline", true, 0, pipeline<LabHeap>, pipeline<LibcHeap>, pipeline<LabLocalFreeHeap>});
+
+    std::cout << "workload,heap,threads,mops_per_s,p50_ns,p99_ns,p999_ns,max_ns,peak_rss_mb\n";
+    for (const Workload& workload : workloads) {
+        if (!workload.name.starts_with(filter)) {
+            continue;
+        }
+        const size_t workload_threads = workload.is_multi_threaded ? threads : 1;
+        const Params params{.scale = scale, .size = workload.size};
+        printResult(workload, LabHeap::NAME, workload_threads, measureInChild(workload.lab, workload_threads, params));
+        printResult(workload, LibcHeap::NAME, workload_threads, measureInChild(workload.libc, workload_threads, params));
+        if (workload.lab_local_free) {
+            printResult(workload, LabLocalFreeHeap::NAME, workload_threads, measureInChild(workload.lab_local_free, workload_threads, params));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+
+using namespace jd::memory;
+
+static constexpr size_t HOLES_PER_STEP = 500;
+
+// Fills the coalesce heap step by step, leaving a small free hole after every kept block,
+// and measures the alloc/free latency at every fill level. The holes are too small for the
+// measured requests, so they pile up in the free lists the way fragmentation does.
+std::vector<double> benchmarkEngine(CoalesceEngine engine, size_t steps, size_t ops)
+{
+    auto& allocator = MemoryAllocator::allocator();
+    allocator.init({.engine = engine});
+
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<size_t> size_dist(30_KB, 60_KB);
+    std::uniform_int_distribution<size_t> hole_dist(11_KB, 12_KB);
+    std::vector<void*> kept;
+    std::vector<double> latencies;
+
+    for (size_t step = 0; step < steps; ++step) {
+        for (size_t i = 0; i < HOLES_PER_STEP; ++i) {
+            void* hole = allocator.alloc(hole_dist(gen));
+            void* keep = allocator.alloc(size_dist(gen));
+            if (keep) {
+                kept.push_back(keep);
+            }
+            allocator.free(hole);
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < ops; ++i) {
+            void* block = allocator.alloc(size_dist(gen));
+            if (!block) {
+                std::cerr << "Heap is exhausted at step " << step << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            allocator.free(block);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        latencies.push_back(std::chrono::duration<double, std::nano>(end - start).count() / ops);
+    }
+
+    for (void* block : kept) {
+        allocator.free(block);
+    }
+    allocator.destroy();
+
+    return latencies;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [steps] [ops_per_step]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const size_t steps = argc > 1 ? std::stoul(argv[1]) : 8;
+    const size_t ops   = argc > 2 ? std::stoul(argv[2]) : 20000;
+
+    const auto lists = benchmarkEngine(CoalesceEngine::SegregatedLists, steps, ops);
+    const auto tlsf  = benchmarkEngine(CoalesceEngine::TLSF, steps, ops);
+
+    std::cout << "holes,lists_ns_per_op,tlsf_ns_per_op\n";
+    for (size_t step = 0; step < steps; ++step) {
+        std::cout << (step + 1) * HOLES_PER_STEP << "," << lists[step] << "," << tlsf[step] << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+#include "stl_allocator.hpp"
+
+using namespace jd::memory;
+
+template <typename T>
+using Alloc = StlAllocator<T>;
+
+// Keeps about `live` nodes in the container and replaces a random one per operation,
+// so every operation is one node allocation and one node free
+template <typename Map>
+double churnMap(Map& map, size_t live, size_t ops)
+{
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<int> key_dist(0, static_cast<int>(live * 2));
+    for (size_t i = 0; i < live; ++i) {
+        map.emplace(key_dist(gen), static_cast<int>(i));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        map.erase(key_dist(gen));
+        map.emplace(key_dist(gen), static_cast<int>(i));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+template <typename List>
+double churnList(List& list, size_t live, size_t ops)
+{
+    for (size_t i = 0; i < live; ++i) {
+        list.push_back(static_cast<int>(i));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        list.pop_front();
+        list.push_back(static_cast<int>(i));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+// Every measurement runs on a fresh heap, so one container never inherits the fragmentation of another
+double onFreshHeap(const std::function<double()>& run)
+{
+    auto& allocator = MemoryAllocator::allocator();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+    double result = run();
+    allocator.destroy();
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [live_nodes] [ops]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const size_t live = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const size_t ops  = argc > 2 ? std::stoul(argv[2]) : 1000000;
+
+    std::cout << "container,std_allocator_ns_per_op,stl_allocator_ns_per_op,pmr_resource_ns_per_op\n";
+
+    {
+        std::map<int, int> heap;
+        double heap_ns = churnMap(heap, live, ops);
+        double stl_ns  = onFreshHeap([&] {
+            std::map<int, int, std::less<>, Alloc<std::pair<const int, int>>> map;
+            return churnMap(map, live, ops);
+        });
+        double pmr_ns  = onFreshHeap([&] {
+            std::pmr::map<int, int> map{allocatorResource()};
+            return churnMap(map, live, ops);
+        });
+        std::cout << "map," << heap_ns << "," << stl_ns << "," << pmr_ns << "\n";
+    }
+    {
+        std::unordered_map<int, int> heap;
+        double heap_ns = churnMap(heap, live, ops);
+        double stl_ns  = onFreshHeap([&] {
+            std::unordered_map<int, int, std::hash<int>, std::equal_to<>, Alloc<std::pair<const int, int>>> map;
+            return churnMap(map, live, ops);
+        });
+        double pmr_ns  = onFreshHeap([&] {
+            std::pmr::unordered_map<int, int> map{allocatorResource()};
+            return churnMap(map, live, ops);
+        });
+        std::cout << "unordered_map," << heap_ns << "," << stl_ns << "," << pmr_ns << "\n";
+    }
+    {
+        std::list<int> heap;
+        double heap_ns = churnList(heap, live, ops);
+        double stl_ns  = onFreshHeap([&] {
+            std::list<int, Alloc<int>> list;
+            return churnList(list, live, ops);
+        });
+        double pmr_ns  = onFreshHeap([&] {
+            std::pmr::list<int> list{allocatorResource()};
+            return churnList(list, live, ops);
+        });
+        std::cout << "list," << heap_ns << "," << stl_ns << "," << pmr_ns << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+#include "object_pool.hpp"
+
+using namespace jd::memory;
+using Clock = std::chrono::high_resolution_clock;
+
+// Left uninitialized like a block of alloc(): a value-initialized aggregate would clear every cache line of it
+template <size_t SIZE>
+struct Object {
+    char bytes[SIZE];
+
+    Object() noexcept
+    {
+    }
+};
+
+struct Result {
+    size_t block_size;
+    size_t slabs; // in use once the live objects are in place
+    double ns_per_op;
+};
+
+// Keeps `live` objects and replaces a random one per operation, through alloc() and free()
+template <size_t SIZE>
+Result churnAllocator(size_t live, size_t ops)
+{
+    auto& allocator = MemoryAllocator::allocator();
+    std::mt19937 gen{42};
+    std::vector<void*> objects(live);
+    for (void*& object : objects) {
+        object                        = allocator.alloc(SIZE);
+        static_cast<char*>(object)[0] = 1;
+    }
+
+    Result result{allocator.usableSize(objects[0]), allocator.stats().fsa_slabs_used, 0.0};
+    auto start = Clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        void*& object = objects[gen() % live];
+        allocator.free(object);
+        object                        = allocator.alloc(SIZE);
+        static_cast<char*>(object)[0] = 1;
+    }
+    auto end         = Clock::now();
+    result.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / ops;
+
+    for (void* object : objects) {
+        allocator.free(object);
+    }
+    return result;
+}
+
+// The same churn through an ObjectPool
+template <size_t SIZE>
+Result churnPool(size_t live, size_t ops)
+{
+    ObjectPool<Object<SIZE>> pool;
+    std::mt19937 gen{42};
+    std::vector<Object<SIZE>*> objects(live);
+    for (auto*& object : objects) {
+        object           = pool.create();
+        object->bytes[0] = 1;
+    }
+
+    Result result{ObjectPool<Object<SIZE>>::BLOCK_SIZE, pool.slabsCount(), 0.0};
+    auto start = Clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        auto*& object = objects[gen() % live];
+        pool.destroy(object);
+        object           = pool.create();
+        object->bytes[0] = 1;
+    }
+    auto end         = Clock::now();
+    result.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / ops;
+
+    pool.destroyBatch(objects);
+    return result;
+}
+
+// Every measurement runs on a fresh heap
+template <size_t SIZE>
+void compare(size_t live, size_t ops)
+{
+    auto& allocator = MemoryAllocator::allocator();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+    Result fsa = churnAllocator<SIZE>(live, ops);
+    allocator.destroy();
+
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+    Result pool = churnPool<SIZE>(live, ops);
+    allocator.destroy();
+
+    std::printf("%zu,%zu,%zu,%.2f,%.2f,%zu,%zu\n", SIZE, fsa.block_size, pool.block_size, fsa.ns_per_op, pool.ns_per_op, fsa.slabs, pool.slabs);
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [live_objects] [ops]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // the pools share the 24MB small-object arena, which the biggest objects would outgrow past that many
+    const size_t live = argc > 1 ? std::stoul(argv[1]) : 20000;
+    const size_t ops  = argc > 2 ? std::stoul(argv[2]) : 2000000;
+
+    std::cout << "object_size,fsa_block_size,pool_block_size,alloc_ns_per_op,pool_ns_per_op,alloc_slabs,pool_slabs\n";
+    compare<24>(live, ops);
+    compare<40>(live, ops);
+    compare<72>(live, ops);
+    compare<136>(live, ops);
+    compare<200>(live, ops);
+    compare<520>(live, ops);
+
+    return EXIT_SUCCESS;
+}
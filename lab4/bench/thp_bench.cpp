@@ -0,0 +1,121 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+
+using namespace jd::memory;
+
+static constexpr size_t BLOCK_SIZE = 8_MB;
+
+struct Result {
+    double ns_per_access;
+    long long dtlb_misses; // -1 when the PMU is not available
+    HugePageStats pages;
+};
+
+// Counts the data TLB read misses of this thread, -1 when perf events are not permitted
+int openDTLBCounter()
+{
+    perf_event_attr attr{};
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+// Chases random cache lines of a working set spread over the allocator regions
+Result benchmarkMode(HugePages mode, size_t working_set, size_t accesses)
+{
+    auto& allocator = MemoryAllocator::allocator();
+    allocator.init({.huge_pages = mode});
+
+    std::vector<char*> blocks;
+    for (size_t allocated = 0; allocated < working_set; allocated += BLOCK_SIZE) {
+        char* block = static_cast<char*>(allocator.alloc(BLOCK_SIZE));
+        if (!block) {
+            std::cerr << "Heap is exhausted after " << allocated / 1_MB << " MB" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::memset(block, 1, BLOCK_SIZE);
+        blocks.push_back(block);
+    }
+
+    int counter   = openDTLBCounter();
+    uint64_t seed = 88172645463325252ull;
+    uint64_t sum  = 0;
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < accesses; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        char* block = blocks[seed % blocks.size()];
+        char value  = block[(seed >> 20) % BLOCK_SIZE];
+        // the next address depends on the loaded byte, so the misses cannot overlap
+        seed += static_cast<uint64_t>(value) - 1;
+        sum += value;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    long long misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+
+    Result result{
+        .ns_per_access = std::chrono::duration<double, std::nano>(end - start).count() / accesses,
+        .dtlb_misses   = misses,
+        .pages         = allocator.hugePageStats(),
+    };
+
+    if (sum == 0) {
+        std::cerr << "Unexpected checksum" << std::endl;
+    }
+    for (char* block : blocks) {
+        allocator.free(block);
+    }
+    allocator.destroy();
+
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " [working_set_mb] [accesses]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const size_t working_set = (argc > 1 ? std::stoul(argv[1]) : 192) * 1_MB;
+    const size_t accesses    = argc > 2 ? std::stoul(argv[2]) : 20'000'000;
+
+    const Result small = benchmarkMode(HugePages::None, working_set, accesses);
+    const Result huge  = benchmarkMode(HugePages::Transparent, working_set, accesses);
+
+    std::cout << "pages,ns_per_access,dtlb_misses,huge_mb,resident_mb\n";
+    for (auto [name, result] : {std::pair{"4KB", small}, std::pair{"THP", huge}}) {
+        std::cout << name << "," << result.ns_per_access << "," << result.dtlb_misses << "," << result.pages.huge_bytes / 1_MB << ","
+                  << result.pages.resident_bytes / 1_MB << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
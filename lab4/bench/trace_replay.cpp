@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <malloc.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "allocator.hpp"
+#include "allocator_trace.hpp"
+#include "memory.hpp"
+
+using namespace jd::memory;
+using Clock = std::chrono::high_resolution_clock;
+
+static constexpr size_t HEAP_RESERVE = 64_GB;
+static constexpr size_t PAGE_SIZE    = 4_KB;
+
+// The configuration of liblab4malloc on a single thread, the replay runs the events one after another
+struct LabHeap {
+    static constexpr const char* NAME = "lab4";
+
+    static void setUp()
+    {
+        MemoryAllocator::allocator().init({
+            .engine        = CoalesceEngine::TLSF,
+            .lazy_carving  = true,
+            .heap_reserve  = HEAP_RESERVE,
+            .min_alignment = alignof(std::max_align_t),
+        });
+    }
+    static void* alloc(size_t size)
+    {
+        return MemoryAllocator::allocator().alloc(size);
+    }
+    static void* calloc(size_t size)
+    {
+        return MemoryAllocator::allocator().calloc(1, size);
+    }
+    static void* allocAligned(size_t size, size_t alignment)
+    {
+        return MemoryAllocator::allocator().allocAligned(size, alignment);
+    }
+    static void* realloc(void* p, size_t size)
+    {
+        return MemoryAllocator::allocator().realloc(p, size);
+    }
+    static void free(void* p)
+    {
+        MemoryAllocator::allocator().free(p);
+    }
+    static double externalFragmentation()
+    {
+        return MemoryAllocator::allocator().fragmentation().external_fragmentation;
+    }
+};
+
+struct LibcHeap {
+    static constexpr const char* NAME = "malloc";
+
+    static void setUp()
+    {
+    }
+    static void* alloc(size_t size)
+    {
+        return std::malloc(size);
+    }
+    static void* calloc(size_t size)
+    {
+        return std::calloc(1, size);
+    }
+    static void* allocAligned(size_t size, size_t alignment)
+    {
+        void* p = nullptr;
+        return posix_memalign(&p, std::max(alignment, sizeof(void*)), size) == 0 ? p : nullptr;
+    }
+    static void* realloc(void* p, size_t size)
+    {
+        return std::realloc(p, size);
+    }
+    static void free(void* p)
+    {
+        std::free(p);
+    }
+    // glibc does not tell its largest free chunk
+    static double externalFragmentation()
+    {
+        return -1.0;
+    }
+};
+
+// An event with the recorded address replaced by a dense slot number, so the replay loop only indexes an array
+struct ReplayOp {
+    TraceOp op;
+    uint32_t slot;
+    uint64_t size;
+    uint64_t alignment;
+};
+
+struct Replay {
+    std::vector<ReplayOp> ops;
+    size_t slots{0};
+    size_t threads{0};
+    size_t dropped{0};    // frees of blocks allocated before the recording started, events racing a reuse of their block
+    size_t peak_index{0}; // the event after which the requested bytes peak
+    size_t peak_live_bytes{0};
+};
+
+Replay prepareReplay(const std::vector<TraceEvent>& events)
+{
+    Replay replay;
+    replay.ops.reserve(events.size());
+    std::unordered_map<uint64_t, uint32_t> live;
+    std::vector<uint32_t> free_slots;
+    std::vector<uint64_t> slot_sizes;
+    size_t live_bytes = 0;
+
+    auto newSlot = [&](uint64_t ptr, uint64_t size) {
+        uint32_t slot = 0;
+        if (!free_slots.empty()) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(slot_sizes.size());
+            slot_sizes.push_back(0);
+        }
+        live[ptr]        = slot;
+        slot_sizes[slot] = size;
+        live_bytes += size;
+        return slot;
+    };
+
+    for (const TraceEvent& event : events) {
+        replay.threads = std::max<size_t>(replay.threads, event.thread + 1);
+        switch (event.op) {
+            case TraceOp::Alloc:
+            case TraceOp::Calloc:
+            case TraceOp::AllocAligned:
+                if (live.contains(event.ptr)) {
+                    replay.dropped++;
+                    continue;
+                }
+                replay.ops.push_back({event.op, newSlot(event.ptr, event.size), event.size, event.alignment});
+                break;
+            case TraceOp::Realloc: {
+                auto old = live.find(event.old_ptr);
+                if (old == live.end()) {
+                    // the block predates the trace, its new incarnation is an allocation as far as the replay goes
+                    replay.ops.push_back({TraceOp::Alloc, newSlot(event.ptr, event.size), event.size, 0});
+                    break;
+                }
+                uint32_t slot = old->second;
+                live.erase(old);
+                live[event.ptr]  = slot;
+                live_bytes       = live_bytes - slot_sizes[slot] + event.size;
+                slot_sizes[slot] = event.size;
+                replay.ops.push_back({TraceOp::Realloc, slot, event.size, 0});
+                break;
+            }
+            case TraceOp::Free: {
+                auto block = live.find(event.ptr);
+                if (block == live.end()) {
+                    replay.dropped++;
+                    continue;
+                }
+                uint32_t slot = block->second;
+                live.erase(block);
+                live_bytes -= slot_sizes[slot];
+                free_slots.push_back(slot);
+                replay.ops.push_back({TraceOp::Free, slot, 0, 0});
+                break;
+            }
+        }
+        if (live_bytes > replay.peak_live_bytes) {
+            replay.peak_live_bytes = live_bytes;
+            replay.peak_index      = replay.ops.size() - 1;
+        }
+    }
+    replay.slots = slot_sizes.size();
+    return replay;
+}
+
+// Sent by the child running one replay to the parent
+struct Result {
+    bool is_valid;
+    double seconds;
+    size_t peak_rss;    // both above the resident set the child starts with, which holds the replay itself
+    size_t rss_at_peak;
+    double external_fragmentation; // at the peak, negative when the heap cannot tell
+};
+
+size_t residentBytes()
+{
+    std::ifstream statm{"/proc/self/statm"};
+    size_t pages    = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+template <typename Heap>
+bool runOps(const Replay& replay, std::vector<void*>& slots, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        const ReplayOp& op = replay.ops[i];
+        void*& block       = slots[op.slot];
+        switch (op.op) {
+            case TraceOp::Alloc:
+                block = Heap::alloc(op.size);
+                break;
+            case TraceOp::Calloc:
+                block = Heap::calloc(op.size);
+                break;
+            case TraceOp::AllocAligned:
+                block = Heap::allocAligned(op.size, op.alignment);
+                break;
+            case TraceOp::Realloc:
+                block = Heap::realloc(block, op.size);
+                break;
+            case TraceOp::Free:
+                Heap::free(block);
+                block = nullptr;
+                continue;
+        }
+        if (!block) {
+            std::cerr << Heap::NAME << " failed to allocate " << op.size << " bytes at event " << i << std::endl;
+            return false;
+        }
+        // the program wrote its blocks, so their pages count in the resident set
+        for (size_t offset = 0; offset < op.size; offset += PAGE_SIZE) {
+            static_cast<char*>(block)[offset] = 1;
+        }
+    }
+    return true;
+}
+
+// The clock stops at the peak while the footprint is taken
+template <typename Heap>
+Result runReplay(const Replay& replay)
+{
+    const size_t baseline = residentBytes();
+    Heap::setUp();
+    std::vector<void*> slots(replay.slots);
+    const size_t split = replay.ops.empty() ? 0 : replay.peak_index + 1;
+
+    Result result{};
+    auto start = Clock::now();
+    if (!runOps<Heap>(replay, slots, 0, split)) {
+        return result;
+    }
+    auto peak = Clock::now();
+
+    result.rss_at_peak            = residentBytes() - baseline;
+    result.external_fragmentation = Heap::externalFragmentation();
+
+    auto resume = Clock::now();
+    if (!runOps<Heap>(replay, slots, split, replay.ops.size())) {
+        return result;
+    }
+    auto end = Clock::now();
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    result.is_valid = true;
+    result.seconds  = std::chrono::duration<double>(peak - start).count() + std::chrono::duration<double>(end - resume).count();
+    result.peak_rss = static_cast<size_t>(usage.ru_maxrss) * 1_KB - baseline;
+    return result;
+}
+
+// Each heap replays in a child of its own, so the peak RSS is that of the replay alone
+template <typename Heap>
+Result runInChild(const Replay& replay)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return {};
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Result result = runReplay<Heap>(replay);
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+
+    Result result{};
+    if (pid < 0 || read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        result = {};
+    }
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+    }
+    return result;
+}
+
+void printResult(const char* heap, const Replay& replay, const Result& result)
+{
+    if (!result.is_valid) {
+        std::cout << heap << "," << replay.ops.size() << ",failed,,,,,\n";
+        return;
+    }
+    // overhead: share of the resident memory at the peak that does not hold requested bytes
+    double overhead = result.rss_at_peak ? 1.0 - static_cast<double>(replay.peak_live_bytes) / result.rss_at_peak : 0.0;
+    std::printf("%s,%zu,%.3f,%.2f,%.1f,%.1f,%.1f,%.4f,", heap, replay.ops.size(), result.seconds, replay.ops.size() / result.seconds / 1e6,
+                result.peak_rss / 1048576.0, replay.peak_live_bytes / 1048576.0, result.rss_at_peak / 1048576.0, overhead);
+    if (result.external_fragmentation >= 0.0) {
+        std::printf("%.4f", result.external_fragmentation);
+    }
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " <trace> [lab4|malloc]" << std::endl;
+        std::cerr << "Record a trace with AllocatorOptions::trace_path, or LAB4MALLOC_TRACE=<path> under liblab4malloc.so" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string heap = argc > 2 ? argv[2] : "";
+
+    std::vector<TraceEvent> events;
+    if (!readTrace(argv[1], events)) {
+        std::cerr << "Failed to read the trace " << argv[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+    Replay replay            = prepareReplay(events);
+    const size_t event_count = events.size();
+    events                   = {};
+    // the pages glibc keeps from the parsing would otherwise be reused by the malloc replay below its baseline
+    malloc_trim(0);
+    std::cerr << event_count << " events of " << replay.threads << " threads, " << replay.dropped << " dropped, peak of "
+              << replay.peak_live_bytes / 1_KB << " KB requested" << std::endl;
+
+    std::cout << "heap,events,seconds,mops_per_s,peak_rss_mb,live_at_peak_mb,rss_at_peak_mb,overhead_at_peak,external_fragmentation\n";
+    if (heap.empty() || heap == LabHeap::NAME) {
+        printResult(LabHeap::NAME, replay, runInChild<LabHeap>(replay));
+    }
+    if (heap.empty() || heap == LibcHeap::NAME) {
+        printResult(LibcHeap::NAME, replay, runInChild<LibcHeap>(replay));
+    }
+
+    return EXIT_SUCCESS;
+}
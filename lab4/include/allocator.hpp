@@ -1,15 +1,71 @@
+#pragma once
+
 #include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "allocator_stats.hpp"
 
 #ifndef NDEBUG
 #define ALLOCATOR_DEBUG 1
-#include "allocator_stats.hpp"
-#include <unordered_map>
 #else
 #define ALLOCATOR_DEBUG 0
 #endif
 
 namespace jd::memory
 {
+enum class CoalesceEngine : uint8_t {
+    SegregatedLists, // three size-sorted lists searched best-fit, O(n) per operation
+    TLSF,            // two-level segregated fit bins with bitmaps, O(1) per operation
+};
+
+enum class HugePages : uint8_t {
+    None,        // 4KB pages only
+    Transparent, // MADV_HUGEPAGE on the FSA arena and the regions, the kernel promotes them when it can
+    Explicit,    // MAP_HUGETLB from the preallocated pool, falls back to Transparent when the pool is too small
+};
+
+struct AllocatorOptions {
+    // Guards the shared state with locks and gives every thread its own cache of FSA blocks,
+    // so the small-object path stays lock-free. init() and destroy() are still single-threaded.
+    bool thread_safe{false};
+    // A small block freed by another thread than the one whose cache it came from goes back to that thread
+    // over a lock-free queue, drained on its every allocation of the class. A queue holds at most a cache bin worth
+    // of blocks, the rest go to the pool. Off, the block stays in the cache of the freeing thread
+    bool remote_frees{true};
+    // Number of independent coalesce arenas threads are spread over round-robin,
+    // 0 picks one per hardware thread (up to 4) in thread-safe mode and a single arena otherwise
+    size_t arenas_count{0};
+    CoalesceEngine engine{CoalesceEngine::SegregatedLists};
+    // Free memory idle for this long is given back to the OS with madvise(),
+    // 0 gives it back as soon as it is freed and a negative value only on trim()
+    int64_t purge_decay_ms{10'000};
+    // MADV_FREE instead of MADV_DONTNEED: the kernel reclaims the pages only under memory pressure
+    bool lazy_purge{false};
+    HugePages huge_pages{HugePages::None};
+    // Carve coalesce blocks from the untouched tail of a region on demand instead of splitting
+    // every new region into thousands of indexed free blocks up front
+    bool lazy_carving{false};
+    // Address space reserved for the coalesce regions, committed one 32MB region at a time,
+    // 0 keeps the default 512MB. Tens of GB cost nothing until the regions are actually used
+    size_t heap_reserve{0};
+    // Least alignment of every block bigger than 8 bytes; a malloc replacement needs alignof(std::max_align_t)
+    size_t min_alignment{8};
+    // The static instance unmaps the heap at exit. A malloc replacement keeps it: static destructors
+    // of other libraries still free their memory after ours has run
+    bool release_at_exit{true};
+    // Heap profiler: one allocation per this many bytes on average records its call stack, 0 turns it off.
+    // Sampled blocks are served by the coalesce heap or the large path, whose headers mark them for free()
+    size_t profile_sample_bytes{0};
+    // Signal that writes the profile to "<profile_prefix>.<pid>.<n>.heap", 0 installs no handler
+    int profile_signal{0};
+    const char* profile_prefix{"lab4"};
+    // Records every alloc/free/realloc with its size, time and thread into this file, nullptr records nothing.
+    // The format is in allocator_trace.hpp, bench/trace_replay.cpp runs a trace again
+    const char* trace_path{nullptr};
+};
+
 class MemoryAllocator final
 {
 public:
@@ -26,25 +82,68 @@ public:
         return allocator;
     }
 
-    void init();
+    void init(const AllocatorOptions& options = {});
     void destroy();
 
     void* alloc(size_t size);
+    // Throws std::runtime_error on a pointer the allocator does not own, check owns() first when it may be foreign
     void free(void* p);
+    // Zeroed array of count elements, nullptr when count * size overflows.
+    // Memory straight from untouched pages is not cleared a second time.
+    void* calloc(size_t count, size_t size);
+    // posix_memalign semantics: alignment is a power of two, nullptr otherwise. The result is released by free()
+    void* allocAligned(size_t size, size_t alignment);
+    // Keeps the block in place whenever its neighbourhood allows it, moves it as a last resort.
+    // On failure returns nullptr and leaves p untouched.
+    void* realloc(void* p, size_t size);
 
-#if ALLOCATOR_DEBUG
+    static constexpr size_t SLAB_SIZE = 64 * 1024;
+
+    // A whole slab of the small-object arena, SLAB_SIZE bytes aligned to SLAB_SIZE, for pools that carve blocks
+    // of their own (ObjectPool). nullptr once the arena is full. free() refuses pointers into it, freeSlab() takes it back
+    [[nodiscard]] void* allocSlab();
+    void freeSlab(void* slab);
+
+    // pthread_atfork handlers for a heap shared by the whole process, liblab4malloc.so registers them.
+    // prepareFork() takes every lock of the allocator, so the child never inherits one held by a thread it does not have
+    void prepareFork() noexcept;
+    void afterForkParent() noexcept;
+    // Also gives the blocks queued for the threads left behind back to the pools
+    void afterForkChild() noexcept;
+
+    // Safe on any pointer, including ones from another malloc
+    [[nodiscard]] bool owns(const void* p) const noexcept;
+    // Bytes the block can hold, at least the requested size
+    [[nodiscard]] size_t usableSize(const void* p) const;
+
+    // Gives every free page the allocator can spare back to the OS right away, returns the purged bytes
+    size_t trim();
+    [[nodiscard]] PurgeStats purgeStats() const;
+    // Reads /proc/self/smaps, so it is meant for reports rather than hot paths
+    [[nodiscard]] HugePageStats hugePageStats() const;
+
+    // Per size class of the small-object path; a thread cache reports its allocations once it trades blocks with the pool
+    [[nodiscard]] std::vector<SizeClassStats> sizeClassStats() const;
+
+    // Merges the per-thread counters on every call, cheap enough to be scraped periodically
+    [[nodiscard]] AllocatorStats stats() const;
+    // Walks every block of the coalesce heap: O(blocks), meant to be sampled now and then rather than on hot paths
+    [[nodiscard]] FragmentationReport fragmentation() const;
     void dumpStat() const;
+    // Live sampled blocks in the text format of gperftools (heap_v2), readable by pprof. False when profiling is off
+    bool dumpHeapProfile(const char* path) const;
+
+#if ALLOCATOR_DEBUG
     void dumpBlocks() const;
 #else
-    void dumpStat() const {}
     void dumpBlocks() const {}
 #endif
 private:
     MemoryAllocator() = default;
     bool is_initialized_{false};
-#if ALLOCATOR_DEBUG
-    Statistics stats_;
-    std::unordered_map<void*, size_t> large_allocs_map_;
-#endif
+    bool release_at_exit_{true};
 };
+
+// The report as a single line of JSON, appending one per snapshot to a file charts the heap over time
+[[nodiscard]] std::string toJson(const FragmentationReport& report);
 } // namespace jd::memory
@@ -1,15 +1,120 @@
+#pragma once
+
 #include <cstddef>
+#include <cstdint>
+#include <vector>
 
 namespace jd::memory
 {
-struct Statistics {
-    size_t total_allocations{};
-    size_t total_frees{};
-    size_t fsa_alloc_count{};
-    size_t coalesce_alloc_count{};
-    size_t large_alloc_count{};
-    size_t current_allocated{};
-    size_t peak_allocated{};
-    size_t regions_count{};
+
+enum class HugePages : uint8_t;
+
+struct HugePageStats {
+    HugePages mode{};        // the mode actually in use after the fallbacks
+    size_t resident_bytes{}; // resident part of the allocator reservation
+    size_t huge_bytes{};     // resident bytes backed by huge pages
+};
+
+struct PurgeStats {
+    size_t purged_bytes{}; // given back to the OS since init(), pages purged twice count twice
+    size_t purge_calls{};
+};
+
+struct SizeClassStats {
+    size_t block_size{};
+    size_t allocations{};
+    size_t requested_bytes{};
+    size_t allocated_bytes{};
+    double internal_fragmentation{}; // share of the allocated bytes lost to rounding up to block_size
+};
+
+// Counters of one FSA size class, or of the coalesce or the large path as a whole
+struct AllocationCounters {
+    size_t block_size{}; // 0 for the coalesce and the large path, whose blocks vary
+    size_t allocations{};
+    size_t frees{};
+    size_t live_bytes{}; // usable bytes of the blocks still allocated
+};
+
+// Snapshot of the always-on counters, everything counts since init()
+struct AllocatorStats {
+    size_t allocations{};
+    size_t frees{};
+    size_t live_bytes{};
+    // every thread reports its live bytes in 256KB steps and its size classes whenever a 32KB cache bin trades with the pool,
+    // so the peak may miss that much per thread
+    size_t peak_live_bytes{};
+    std::vector<AllocationCounters> size_classes;
+    AllocationCounters coalesce;
+    AllocationCounters large;
+
+    size_t regions_used{};
+    size_t regions_reserved{};
+    size_t small_regions{};
+    size_t medium_regions{};
+    size_t large_regions{};
+    size_t fsa_slabs_used{};
+    size_t fsa_slabs_total{};
+    size_t large_cached_bytes{}; // freed direct mappings kept for reuse
+    PurgeStats purge;
+    size_t threads{}; // live threads that have allocated
+};
+
+// Blocks of the coalesce heap whose size, header included, falls into [min_size, 2 * min_size)
+struct SizeBucketStats {
+    size_t min_size{};
+    size_t used_blocks{};
+    size_t used_bytes{};
+    size_t free_blocks{};
+    size_t free_bytes{};
+};
+
+struct RegionFragmentation {
+    size_t index{};
+    size_t arena{};
+    size_t max_request{}; // largest request the region serves: 10KB, 1MB or 10MB
+    size_t used_blocks{};
+    size_t used_bytes{};
+    size_t free_blocks{};
+    size_t free_bytes{};
+    size_t wilderness_bytes{};       // not carved into blocks yet, lazy carving only
+    size_t largest_free_block{};     // the wilderness counts as a single free block
+    double external_fragmentation{}; // 1 - largest_free_block / (free_bytes + wilderness_bytes)
+    std::vector<SizeBucketStats> histogram; // non-empty buckets by increasing size
+};
+
+// A free list of the coalesce engine over all arenas: a size-sorted list, or a first-level range of the TLSF bins
+struct FreeListFragmentation {
+    size_t min_size{};
+    size_t blocks{};
+    size_t bytes{};
+    size_t largest_block{};
+};
+
+struct FSAPoolFragmentation {
+    size_t block_size{};
+    size_t slabs{};
+    size_t capacity_blocks{};
+    size_t used_blocks{}; // handed out of the pool, including those parked in thread caches
+    double occupancy{};
+};
+
+// Heap walk of every region and free list. Each arena and pool is locked in turn, not all of them at once,
+// so a report taken while other threads allocate mixes slightly different moments
+struct FragmentationReport {
+    std::vector<RegionFragmentation> regions;
+    std::vector<SizeBucketStats> histogram; // all the regions together
+    std::vector<FreeListFragmentation> free_lists;
+    std::vector<FSAPoolFragmentation> fsa_pools;
+
+    size_t used_bytes{};
+    size_t free_bytes{};
+    size_t wilderness_bytes{};
+    size_t largest_free_block{};
+    double external_fragmentation{};
+    size_t header_bytes{}; // block headers of the coalesce heap
+    size_t free_nodes{};   // free-list nodes in use; they live in the payload of the free blocks and take no memory of their own
+    size_t fsa_slabs_used{};
+    size_t fsa_slabs_total{};
 };
 } // namespace jd::memory
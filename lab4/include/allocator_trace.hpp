@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace jd::memory
+{
+// A trace starts with the file header and goes on with chunks, each one the buffered events of one thread:
+// a chunk header and the events, every one an op byte followed by LEB128 varints
+//     sequence delta, time delta, zigzag pointer delta, then by op: size / size alignment / size zigzag(old - pointer)
+// The deltas are taken against the previous event of the chunk, the first one against zero.
+// A free takes its sequence number before the block is released and an allocation after it is handed out,
+// so sorting by sequence gives an order in which no address is ever live twice.
+inline constexpr char TRACE_MAGIC[8]     = {'L', '4', 'T', 'R', 'A', 'C', 'E', '\0'};
+inline constexpr uint32_t TRACE_VERSION = 1;
+
+enum class TraceOp : uint8_t {
+    Alloc = 1,
+    Calloc,
+    AllocAligned,
+    Realloc,
+    Free,
+};
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct TraceChunkHeader {
+    uint32_t thread; // numbered in the order threads record their first event
+    uint32_t bytes;
+};
+
+struct TraceEvent {
+    TraceOp op{};
+    uint32_t thread{};
+    uint64_t sequence{};
+    uint64_t time_ns{}; // since init()
+    uint64_t ptr{};     // the block allocated, or the one freed
+    uint64_t old_ptr{}; // realloc only
+    uint64_t size{};    // bytes requested, count * size for calloc
+    uint64_t alignment{};
+};
+
+// Every event of a trace in the global order of their sequence numbers, false on a read error or a foreign file
+[[nodiscard]] bool readTrace(const char* path, std::vector<TraceEvent>& events);
+} // namespace jd::memory
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "allocator.hpp"
+#include "memory.hpp"
+
+namespace jd::memory
+{
+class Arena;
+
+// Lets the std::pmr containers take their memory from an arena. Deallocation does nothing,
+// the memory comes back with the rewind or the reset of the arena
+class ArenaResource final : public std::pmr::memory_resource
+{
+public:
+    explicit ArenaResource(Arena& arena) noexcept
+        : arena_{arena}
+    {
+    }
+
+private:
+    Arena& arena_;
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// Bump allocator for objects that all die together, e.g. those of one request. The chunks come from
+// MemoryAllocator::allocator(), which has to outlive the arena. Objects are never freed one by one and their
+// destructors never run. An arena belongs to one thread at a time
+class Arena
+{
+    struct Chunk {
+        Chunk* next; // the chunks form a list in the order they are bumped through
+        char* end;
+    };
+
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64_KB;
+
+    // A position of the arena: rewinding to it gives up everything allocated after it at once
+    struct Marker {
+        Chunk* chunk{nullptr};
+        char* top{nullptr};
+        size_t allocated_bytes{};
+    };
+
+    // Rewinds the arena to where it was when the scope opened; scopes nest like the blocks holding them
+    class Scope
+    {
+    public:
+        explicit Scope(Arena& arena) noexcept
+            : arena_{arena}
+            , marker_{arena.mark()}
+        {
+        }
+        ~Scope()
+        {
+            arena_.rewind(marker_);
+        }
+
+        Scope(const Scope&)            = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Arena& arena_;
+        Marker marker_;
+    };
+
+    // chunk_size includes the chunk header; a bigger request gets a chunk of its own.
+    // With keep_chunks a rewind or a reset keeps the chunks past the marker for the next allocations and costs O(1),
+    // otherwise they go back to MemoryAllocator right away (the first chunk stays until release())
+    explicit Arena(size_t chunk_size = DEFAULT_CHUNK_SIZE, bool keep_chunks = true) noexcept
+        : chunk_size_{chunk_size > sizeof(Chunk) ? chunk_size : DEFAULT_CHUNK_SIZE}
+        , keep_chunks_{keep_chunks}
+    {
+    }
+    ~Arena()
+    {
+        release();
+    }
+
+    Arena(const Arena&)            = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&)                 = delete;
+    Arena& operator=(Arena&&)      = delete;
+
+    // alignment is a power of two. Throws std::bad_alloc when MemoryAllocator runs out
+    [[nodiscard]] void* allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        // a unique pointer even for an empty request, as a memory resource has to return
+        size             = size ? size : 1;
+        uintptr_t top    = reinterpret_cast<uintptr_t>(top_);
+        uintptr_t result = (top + alignment - 1) & ~(alignment - 1);
+        uintptr_t end    = reinterpret_cast<uintptr_t>(end_);
+        if (result <= end && end - result >= size) [[likely]] {
+            top_ = reinterpret_cast<char*>(result + size);
+            allocated_bytes_ += result + size - top;
+            return reinterpret_cast<void*>(result);
+        }
+        return allocateFromNextChunk(size, alignment);
+    }
+
+    template <typename T, typename... Args>
+    [[nodiscard]] T* create(Args&&... args)
+    {
+        return ::new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Uninitialized storage for count objects
+    template <typename T>
+    [[nodiscard]] T* allocateArray(size_t count)
+    {
+        if (count > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length{};
+        }
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    [[nodiscard]] Marker mark() const noexcept
+    {
+        return {current_, top_, allocated_bytes_};
+    }
+
+    // The marker has to come from this arena and still be live: taken after the last reset() and not past an earlier rewind
+    void rewind(const Marker& marker) noexcept
+    {
+        Chunk* chunk = marker.chunk ? marker.chunk : first_;
+        if (!keep_chunks_ && chunk) {
+            releaseAfter(chunk);
+        }
+        current_         = chunk;
+        top_             = marker.chunk ? marker.top : (chunk ? data(chunk) : nullptr);
+        end_             = chunk ? chunk->end : nullptr;
+        allocated_bytes_ = marker.allocated_bytes;
+    }
+
+    void reset() noexcept
+    {
+        rewind(Marker{});
+    }
+
+    // Gives every chunk back to MemoryAllocator
+    void release() noexcept
+    {
+        while (first_) {
+            Chunk* next = first_->next;
+            MemoryAllocator::allocator().free(first_);
+            first_ = next;
+        }
+        current_         = nullptr;
+        top_             = nullptr;
+        end_             = nullptr;
+        allocated_bytes_ = 0;
+        reserved_bytes_  = 0;
+    }
+
+    [[nodiscard]] std::pmr::memory_resource* resource() noexcept
+    {
+        return &resource_;
+    }
+
+    // Handed out since the last reset(), alignment padding included
+    [[nodiscard]] size_t allocatedBytes() const noexcept
+    {
+        return allocated_bytes_;
+    }
+    // Chunks held, headers included
+    [[nodiscard]] size_t reservedBytes() const noexcept
+    {
+        return reserved_bytes_;
+    }
+
+private:
+    Chunk* first_{nullptr};
+    Chunk* current_{nullptr};
+    char* top_{nullptr};
+    char* end_{nullptr};
+    size_t allocated_bytes_{};
+    size_t reserved_bytes_{};
+    size_t chunk_size_;
+    bool keep_chunks_;
+    ArenaResource resource_{*this};
+
+    static char* data(Chunk* chunk) noexcept
+    {
+        return reinterpret_cast<char*>(chunk + 1);
+    }
+
+    static bool fits(Chunk* chunk, size_t size, size_t alignment) noexcept
+    {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(data(chunk)) + alignment - 1) & ~(alignment - 1);
+        return start <= reinterpret_cast<uintptr_t>(chunk->end) && reinterpret_cast<uintptr_t>(chunk->end) - start >= size;
+    }
+
+    // The tail of the current chunk is skipped until the next reset
+    void* allocateFromNextChunk(size_t size, size_t alignment)
+    {
+        Chunk* next = current_ ? current_->next : first_;
+        if (!next || !fits(next, size, alignment)) {
+            // a kept chunk too small for the request stays for the ones after it
+            size_t bytes = 0;
+            // a size near SIZE_MAX would wrap the chunk to a few bytes
+            if (__builtin_add_overflow(sizeof(Chunk) + alignment, size, &bytes)) {
+                throw std::bad_alloc{};
+            }
+            bytes        = bytes > chunk_size_ ? bytes : chunk_size_;
+            void* memory = MemoryAllocator::allocator().alloc(bytes);
+            if (!memory) {
+                throw std::bad_alloc{};
+            }
+            Chunk* chunk = ::new (memory) Chunk{next, static_cast<char*>(memory) + bytes};
+            (current_ ? current_->next : first_) = chunk;
+            reserved_bytes_ += bytes;
+            next = chunk;
+        }
+
+        current_ = next;
+        top_     = data(next);
+        end_     = next->end;
+        return allocate(size, alignment);
+    }
+
+    void releaseAfter(Chunk* chunk) noexcept
+    {
+        while (Chunk* next = chunk->next) {
+            chunk->next = next->next;
+            reserved_bytes_ -= static_cast<size_t>(next->end - reinterpret_cast<char*>(next));
+            MemoryAllocator::allocator().free(next);
+        }
+    }
+};
+
+inline void* ArenaResource::do_allocate(size_t bytes, size_t alignment)
+{
+    return arena_.allocate(bytes, alignment);
+}
+} // namespace jd::memory
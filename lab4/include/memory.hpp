@@ -1,3 +1,4 @@
+#pragma once
 
 namespace jd::memory
 {
@@ -9,5 +10,9 @@ constexpr auto operator"" _MB(unsigned long long x) noexcept
 {
     return x << 20;
 }
+constexpr auto operator"" _GB(unsigned long long x) noexcept
+{
+    return x << 30;
+}
 
 } // namespace jd::memory
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <span>
+#include <utility>
+
+#include "allocator.hpp"
+
+namespace jd::memory
+{
+// Pool of T on whole slabs of MemoryAllocator, carved into blocks of exactly sizeof(T): no size class to look up
+// and none of the rounding up of the FSA classes. Every slab starts with its header and keeps an intrusive free list
+// of its own, so a slab whose objects are all destroyed goes back to the allocator.
+// Not thread-safe. MemoryAllocator::allocator() has to outlive the pool, objects still alive at its end are not destroyed
+template <typename T>
+class ObjectPool
+{
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Slab {
+        FreeBlock* free_list; // blocks destroyed back to the slab
+        char* bump;           // blocks past the bump pointer have never been handed out
+        Slab* prev;           // slabs with at least one free block
+        Slab* next;
+        Slab* prev_slab;      // every slab of the pool
+        Slab* next_slab;
+        size_t used_blocks;
+    };
+
+    static constexpr size_t alignTo(size_t size, size_t alignment) noexcept
+    {
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+public:
+    static constexpr size_t BLOCK_ALIGNMENT = alignof(T) > alignof(FreeBlock) ? alignof(T) : alignof(FreeBlock);
+    static constexpr size_t BLOCK_SIZE      = alignTo(sizeof(T) > sizeof(FreeBlock) ? sizeof(T) : sizeof(FreeBlock), BLOCK_ALIGNMENT);
+    static constexpr size_t FIRST_BLOCK     = alignTo(sizeof(Slab), BLOCK_ALIGNMENT);
+    static constexpr size_t BLOCKS_PER_SLAB = FIRST_BLOCK < MemoryAllocator::SLAB_SIZE ? (MemoryAllocator::SLAB_SIZE - FIRST_BLOCK) / BLOCK_SIZE : 0;
+    static_assert(BLOCKS_PER_SLAB > 0, "T does not fit a slab, it belongs to MemoryAllocator::alloc()");
+
+    ObjectPool() noexcept = default;
+    ~ObjectPool()
+    {
+        while (slabs_) {
+            Slab* next = slabs_->next_slab;
+            MemoryAllocator::allocator().freeSlab(slabs_);
+            slabs_ = next;
+        }
+    }
+
+    ObjectPool(const ObjectPool&)            = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // Throws std::bad_alloc when the small-object arena is full, and whatever the constructor throws
+    template <typename... Args>
+    [[nodiscard]] T* create(Args&&... args)
+    {
+        void* block = takeBlock();
+        try {
+            return ::new (block) T(std::forward<Args>(args)...);
+        } catch (...) {
+            returnBlock(block);
+            throw;
+        }
+    }
+
+    void destroy(T* object) noexcept
+    {
+        if (!object) {
+            return;
+        }
+        object->~T();
+        returnBlock(object);
+    }
+
+    // Fills objects with copies constructed from the same arguments, taking the blocks a slab at a time.
+    // All or nothing: when a constructor throws, the objects built so far are destroyed
+    template <typename... Args>
+    void createBatch(std::span<T*> objects, const Args&... args)
+    {
+        size_t built = 0;
+        try {
+            while (built < objects.size()) {
+                Slab* slab = partial_ ? partial_ : acquireSlab();
+                // the slab leaves the partial list before the constructors run, so a throwing one leaves it consistent
+                size_t count = BLOCKS_PER_SLAB - slab->used_blocks;
+                count        = count < objects.size() - built ? count : objects.size() - built;
+                slab->used_blocks += count;
+                live_objects_ += count;
+                if (slab->used_blocks == BLOCKS_PER_SLAB) {
+                    unlinkPartial(slab);
+                }
+
+                size_t taken = built + count;
+                for (size_t i = built; i < taken; ++i) {
+                    objects[i] = static_cast<T*>(popBlock(slab));
+                }
+                for (; built < taken; ++built) {
+                    try {
+                        ::new (objects[built]) T(args...);
+                    } catch (...) {
+                        for (size_t i = built; i < taken; ++i) {
+                            returnBlock(objects[i]);
+                        }
+                        throw;
+                    }
+                }
+            }
+        } catch (...) {
+            destroyBatch(objects.first(built));
+            throw;
+        }
+    }
+
+    void destroyBatch(std::span<T* const> objects) noexcept
+    {
+        for (T* object : objects) {
+            destroy(object);
+        }
+    }
+
+    [[nodiscard]] size_t liveObjects() const noexcept
+    {
+        return live_objects_;
+    }
+    [[nodiscard]] size_t slabsCount() const noexcept
+    {
+        return slabs_count_;
+    }
+
+private:
+    Slab* partial_{nullptr};
+    Slab* slabs_{nullptr};
+    size_t slabs_count_{};
+    size_t live_objects_{};
+
+    static Slab* slabOf(void* block) noexcept
+    {
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(block) & ~(MemoryAllocator::SLAB_SIZE - 1));
+    }
+
+    static void* popBlock(Slab* slab) noexcept
+    {
+        if (slab->free_list) {
+            FreeBlock* block = slab->free_list;
+            slab->free_list  = block->next;
+            return block;
+        }
+        void* block = slab->bump;
+        slab->bump += BLOCK_SIZE;
+        return block;
+    }
+
+    void linkPartial(Slab* slab) noexcept
+    {
+        slab->prev = nullptr;
+        slab->next = partial_;
+        if (partial_) {
+            partial_->prev = slab;
+        }
+        partial_ = slab;
+    }
+
+    void unlinkPartial(Slab* slab) noexcept
+    {
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            partial_ = slab->next;
+        }
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+        slab->prev = slab->next = nullptr;
+    }
+
+    Slab* acquireSlab()
+    {
+        void* memory = MemoryAllocator::allocator().allocSlab();
+        if (!memory) {
+            throw std::bad_alloc{};
+        }
+        Slab* slab = ::new (memory) Slab{nullptr, static_cast<char*>(memory) + FIRST_BLOCK, nullptr, nullptr, nullptr, slabs_, 0};
+        if (slabs_) {
+            slabs_->prev_slab = slab;
+        }
+        slabs_ = slab;
+        slabs_count_++;
+        linkPartial(slab);
+        return slab;
+    }
+
+    void* takeBlock()
+    {
+        Slab* slab = partial_;
+        if (!slab) [[unlikely]] {
+            slab = acquireSlab();
+        }
+        void* block = popBlock(slab);
+        if (++slab->used_blocks == BLOCKS_PER_SLAB) {
+            unlinkPartial(slab);
+        }
+        live_objects_++;
+        return block;
+    }
+
+    void returnBlock(void* memory) noexcept
+    {
+        Slab* slab       = slabOf(memory);
+        FreeBlock* block = static_cast<FreeBlock*>(memory);
+        block->next      = slab->free_list;
+        slab->free_list  = block;
+        live_objects_--;
+
+        if (slab->used_blocks-- == BLOCKS_PER_SLAB) {
+            linkPartial(slab);
+        }
+        // an empty slab goes back to the allocator, the last partial one is kept to avoid ping-pong
+        if (slab->used_blocks == 0 && (slab->prev || slab->next)) {
+            unlinkPartial(slab);
+            releaseSlab(slab);
+        }
+    }
+
+    void releaseSlab(Slab* slab) noexcept
+    {
+        if (slab->prev_slab) {
+            slab->prev_slab->next_slab = slab->next_slab;
+        } else {
+            slabs_ = slab->next_slab;
+        }
+        if (slab->next_slab) {
+            slab->next_slab->prev_slab = slab->prev_slab;
+        }
+        slabs_count_--;
+        MemoryAllocator::allocator().freeSlab(slab);
+    }
+};
+} // namespace jd::memory
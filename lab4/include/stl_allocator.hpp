@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "allocator.hpp"
+
+namespace jd::memory
+{
+// Both adapters forward to MemoryAllocator::allocator(), which has to be initialized before the first
+// container allocates and outlive the last one. They are as thread-safe as the options it was initialized with.
+
+// Polymorphic resource for the std::pmr containers
+class AllocatorResource final : public std::pmr::memory_resource
+{
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        // the allocator refuses empty requests, a resource must still return a unique pointer
+        void* p = MemoryAllocator::allocator().allocAligned(bytes ? bytes : 1, alignment);
+        if (!p) {
+            throw std::bad_alloc{};
+        }
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t, size_t) override
+    {
+        MemoryAllocator::allocator().free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        // every instance serves the same heap
+        return dynamic_cast<const AllocatorResource*>(&other) != nullptr;
+    }
+};
+
+// Process-wide instance, in the manner of std::pmr::new_delete_resource()
+inline AllocatorResource* allocatorResource() noexcept
+{
+    static AllocatorResource resource;
+    return &resource;
+}
+
+// Stateless allocator for the regular std containers
+template <typename T>
+class StlAllocator
+{
+public:
+    using value_type = T;
+
+    StlAllocator() noexcept = default;
+    template <typename U>
+    StlAllocator(const StlAllocator<U>&) noexcept
+    {
+    }
+
+    [[nodiscard]] T* allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length{};
+        }
+        auto& allocator = MemoryAllocator::allocator();
+        size_t bytes    = n ? n * sizeof(T) : 1;
+        // the default alignment covers everything up to 8 bytes, only over-aligned types pay for allocAligned()
+        void* p = alignof(T) > alignof(uint64_t) ? allocator.allocAligned(bytes, alignof(T)) : allocator.alloc(bytes);
+        if (!p) {
+            throw std::bad_alloc{};
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) noexcept
+    {
+        MemoryAllocator::allocator().free(p);
+    }
+
+    template <typename U>
+    bool operator==(const StlAllocator<U>&) const noexcept
+    {
+        return true;
+    }
+};
+} // namespace jd::memory
@@ -1,15 +1,98 @@
 #include "allocator.hpp"
+#include "allocator_trace.hpp"
+#include "arena.hpp"
 #include "memory.hpp"
+#include "object_pool.hpp"
+#include "stl_allocator.hpp"
 
+#include <condition_variable>
 #include <cstring>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <map>
 #include <random>
+#include <set>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 
 using namespace jd::memory;
 
 namespace test
 {
 
+void randomAllocationsStress(MemoryAllocator& allocator, size_t max_size)
+{
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<size_t> size_dist(1, max_size);
+    std::uniform_int_distribution<int> op_dist(0, 1);
+
+    const int NUM_OPERATIONS = 10000;
+    struct Allocation {
+        void* block;
+        size_t size;
+        int expected_value;
+    };
+    std::vector<Allocation> allocations;
+
+    for (int i = 0; i < NUM_OPERATIONS; ++i) {
+        if (op_dist(gen) == 0 || allocations.empty()) {
+            size_t size = size_dist(gen);
+            void* block = allocator.alloc(size);
+            if (block != nullptr) {
+                int expected_value = static_cast<int>(allocations.size());
+                allocations.push_back({block, size, expected_value});
+
+                if (size >= sizeof(int)) {
+                    *static_cast<int*>(block) = expected_value;
+                }
+            }
+        } else {
+            size_t idx        = std::uniform_int_distribution<size_t>(0, allocations.size() - 1)(gen);
+            Allocation& alloc = allocations[idx];
+
+            if (alloc.size >= sizeof(int)) {
+                EXPECT_EQ(*static_cast<int*>(alloc.block), alloc.expected_value) << "Data corruption detected at operation " << i << ", block index " << idx;
+            }
+
+            allocator.free(alloc.block);
+
+            if (idx != allocations.size() - 1) {
+                Allocation& last_alloc = allocations.back();
+
+                if (last_alloc.size >= sizeof(int)) {
+                    *static_cast<int*>(last_alloc.block) = static_cast<int>(idx);
+                    last_alloc.expected_value            = static_cast<int>(idx);
+                }
+            }
+
+            allocations[idx] = allocations.back();
+            allocations.pop_back();
+        }
+    }
+
+    for (const auto& alloc : allocations) {
+        allocator.free(alloc.block);
+    }
+}
+
+bool isResident(void* ptr)
+{
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    void* page             = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(ptr) & ~(page_size - 1));
+    unsigned char vec      = 0;
+    return mincore(page, page_size, &vec) == 0 && (vec & 1);
+}
+
+bool isTransparentHugePagesEnabled()
+{
+    std::ifstream file{"/sys/kernel/mm/transparent_hugepage/enabled"};
+    std::string mode;
+    std::getline(file, mode);
+    return !mode.empty() && mode.find("[never]") == std::string::npos;
+}
+
 class MemoryAllocatorTest : public ::testing::Test
 {
 protected:
@@ -95,6 +178,85 @@ TEST_F(MemoryAllocatorTest, FSABoundaries)
     }
 }
 
+TEST_F(MemoryAllocatorTest, SizeClassesBoundInternalFragmentation)
+{
+    std::vector<void*> blocks;
+    for (size_t size = 1; size <= 4_KB; ++size) {
+        void* block = allocator.alloc(size);
+        ASSERT_NE(block, nullptr);
+        memset(block, 0xDD, size);
+        blocks.push_back(block);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+
+    auto stats = allocator.sizeClassStats();
+    ASSERT_FALSE(stats.empty());
+    EXPECT_EQ(stats.back().block_size, 4_KB);
+
+    size_t allocations = 0;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        allocations += stats[i].allocations;
+        EXPECT_EQ(stats[i].allocated_bytes, stats[i].allocations * stats[i].block_size);
+        if (i > 0) {
+            EXPECT_GT(stats[i].block_size, stats[i - 1].block_size);
+        }
+        // classes above the 8-byte steps are at most a quarter of their power of two apart
+        if (stats[i].block_size > 64) {
+            EXPECT_LE(stats[i].block_size - stats[i - 1].block_size, stats[i].block_size / 4);
+        }
+    }
+    EXPECT_EQ(allocations, 4_KB);
+}
+
+TEST_F(MemoryAllocatorTest, SizeClassStatsMeasureRequestedBytes)
+{
+    // 33 bytes used to take a 64-byte block
+    std::vector<void*> blocks(100);
+    for (void*& block : blocks) {
+        block = allocator.alloc(33);
+        ASSERT_NE(block, nullptr);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+
+    for (const SizeClassStats& stats : allocator.sizeClassStats()) {
+        if (stats.allocations == 0) {
+            continue;
+        }
+        EXPECT_EQ(stats.block_size, 40u);
+        EXPECT_EQ(stats.allocations, 100u);
+        EXPECT_EQ(stats.requested_bytes, 3300u);
+        EXPECT_EQ(stats.allocated_bytes, 4000u);
+        EXPECT_NEAR(stats.internal_fragmentation, 0.175, 1e-9);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, FSAPoolsGrowFromSharedSlabs)
+{
+    // far more 16-byte blocks than a fixed sixth of the FSA arena could hold
+    std::vector<void*> small_blocks(1'000'000);
+    for (void*& block : small_blocks) {
+        block = allocator.alloc(16);
+        ASSERT_NE(block, nullptr);
+    }
+    for (void* block : small_blocks) {
+        allocator.free(block);
+    }
+
+    // the emptied slabs went back to the reserve and now serve another size class
+    std::vector<void*> big_blocks(40'000);
+    for (void*& block : big_blocks) {
+        block = allocator.alloc(512);
+        ASSERT_NE(block, nullptr);
+    }
+    for (void* block : big_blocks) {
+        allocator.free(block);
+    }
+}
+
 TEST_F(MemoryAllocatorTest, CoalesceAllocations)
 {
     const size_t sizes[] = {1024, 8192, 32768, 65536};
@@ -130,6 +292,385 @@ TEST_F(MemoryAllocatorTest, LargeAllocations)
     allocator.free(large1);
 }
 
+TEST_F(MemoryAllocatorTest, ReallocCoalesceInPlace)
+{
+    void* block = allocator.alloc(20_KB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0xAB, 20_KB);
+
+    // the rest of the split block is free right behind the allocation
+    void* grown = allocator.realloc(block, 40_KB);
+    ASSERT_EQ(grown, block);
+    memset(static_cast<char*>(grown) + 20_KB, 0xCD, 20_KB);
+
+    void* shrunk = allocator.realloc(grown, 10_KB);
+    ASSERT_EQ(shrunk, block);
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(shrunk);
+    for (size_t i = 0; i < 10_KB; ++i) {
+        ASSERT_EQ(bytes[i], 0xAB) << "at " << i;
+    }
+
+    // the released tail is usable again
+    void* regrown = allocator.realloc(shrunk, 40_KB);
+    ASSERT_EQ(regrown, block);
+    allocator.free(regrown);
+}
+
+TEST_F(MemoryAllocatorTest, ReallocMovesWhenBlocked)
+{
+    void* block = allocator.alloc(20_KB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x5A, 20_KB);
+    std::vector<void*> neighbours;
+    for (size_t i = 0; i < 8; ++i) {
+        neighbours.push_back(allocator.alloc(20_KB));
+    }
+
+    void* moved = allocator.realloc(block, 5_MB);
+    ASSERT_NE(moved, nullptr);
+    const unsigned char* bytes = static_cast<const unsigned char*>(moved);
+    for (size_t i = 0; i < 20_KB; ++i) {
+        ASSERT_EQ(bytes[i], 0x5A) << "at " << i;
+    }
+
+    allocator.free(moved);
+    for (void* neighbour : neighbours) {
+        allocator.free(neighbour);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, ReallocAcrossPaths)
+{
+    void* block = allocator.alloc(33);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x11, 33);
+
+    // same size class keeps the block
+    EXPECT_EQ(allocator.realloc(block, 40), block);
+
+    size_t sizes[] = {100, 3_KB, 100_KB, 12_MB, 20_MB, 2_KB};
+    size_t valid   = 33;
+    for (size_t size : sizes) {
+        block = allocator.realloc(block, size);
+        ASSERT_NE(block, nullptr);
+
+        const unsigned char* bytes = static_cast<const unsigned char*>(block);
+        for (size_t i = 0; i < std::min(valid, size); ++i) {
+            ASSERT_EQ(bytes[i], 0x11) << "size " << size << " at " << i;
+        }
+        memset(block, 0x11, size);
+        valid = size;
+    }
+
+    EXPECT_EQ(allocator.realloc(block, 0), nullptr);
+    block = allocator.realloc(nullptr, 64);
+    ASSERT_NE(block, nullptr);
+    allocator.free(block);
+}
+
+TEST_F(MemoryAllocatorTest, ReallocOfAnImpossibleSizeFails)
+{
+    // one block per path: FSA, coalesce and a direct mapping
+    constexpr size_t sizes[] = {40, 100_KB, 12_MB};
+    for (size_t size : sizes) {
+        unsigned char* block = static_cast<unsigned char*>(allocator.alloc(size));
+        ASSERT_NE(block, nullptr);
+        memset(block, 0x3C, size);
+
+        for (size_t huge : {SIZE_MAX, SIZE_MAX - 2, size_t{PTRDIFF_MAX} + 1}) {
+            EXPECT_EQ(allocator.realloc(block, huge), nullptr) << "size " << size;
+        }
+        for (size_t i = 0; i < size; i += 64) {
+            ASSERT_EQ(block[i], 0x3C) << "size " << size << " at " << i;
+        }
+        allocator.free(block);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, AlignedAllocations)
+{
+    std::vector<void*> blocks;
+    for (size_t alignment : {16, 32, 64, 256, 4096, 65536}) {
+        for (size_t size : {1, 24, 100, 1000, 4000, 20000, 300000, 2000000}) {
+            void* block = allocator.allocAligned(size, alignment);
+            ASSERT_NE(block, nullptr) << "size " << size << ", alignment " << alignment;
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % alignment, 0u) << "size " << size << ", alignment " << alignment;
+            memset(block, 0xEE, size);
+            blocks.push_back(block);
+        }
+    }
+
+    void* large = allocator.allocAligned(12_MB, 1_MB);
+    ASSERT_NE(large, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(large) % 1_MB, 0u);
+    blocks.push_back(large);
+
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+
+    EXPECT_EQ(allocator.allocAligned(64, 48), nullptr);
+}
+
+TEST_F(MemoryAllocatorTest, ImpossibleSizesFail)
+{
+    // near SIZE_MAX an aligned size wraps to a tiny one, each entry point has to refuse it first
+    for (size_t size : {SIZE_MAX, SIZE_MAX - 3, size_t{PTRDIFF_MAX} + 1}) {
+        EXPECT_EQ(allocator.alloc(size), nullptr) << size;
+        EXPECT_EQ(allocator.calloc(1, size), nullptr) << size;
+        EXPECT_EQ(allocator.realloc(nullptr, size), nullptr) << size;
+        for (size_t alignment : {16, 4096, 65536}) {
+            EXPECT_EQ(allocator.allocAligned(size, alignment), nullptr) << size << ", alignment " << alignment;
+        }
+    }
+    // the mapping of a direct allocation adds its header and the alignment slack to the size
+    EXPECT_EQ(allocator.allocAligned(PTRDIFF_MAX, 64), nullptr);
+    EXPECT_EQ(allocator.allocAligned(PTRDIFF_MAX - 1_MB, 1_MB), nullptr);
+    EXPECT_EQ(allocator.allocAligned(64, size_t{1} << 63), nullptr);
+    EXPECT_EQ(allocator.allocAligned(size_t{1} << 62, size_t{1} << 62), nullptr);
+
+    allocator.destroy();
+    allocator.init({.min_alignment = 16});
+    EXPECT_EQ(allocator.alloc(SIZE_MAX - 3), nullptr);
+    EXPECT_EQ(allocator.calloc(1, SIZE_MAX - 3), nullptr);
+}
+
+TEST_F(MemoryAllocatorTest, AlignedSmallAllocationsStayInFSA)
+{
+    // the 64-byte alignment is served by the 64-byte class, not by a padded coalesce block
+    for (size_t i = 0; i < 100; ++i) {
+        allocator.free(allocator.allocAligned(40, 64));
+    }
+
+    for (const SizeClassStats& stats : allocator.sizeClassStats()) {
+        EXPECT_EQ(stats.allocations, stats.block_size == 64 ? 100u : 0u);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, CallocReturnsZeroedMemory)
+{
+    constexpr size_t sizes[] = {1, 100, 4000, 5000, 20_KB, 300_KB, 3_MB, 11_MB};
+
+    // the second round gets the blocks dirtied by the first one back
+    for (int round = 0; round < 2; ++round) {
+        for (size_t size : sizes) {
+            unsigned char* block = static_cast<unsigned char*>(allocator.calloc(1, size));
+            ASSERT_NE(block, nullptr);
+            for (size_t i = 0; i < size; ++i) {
+                ASSERT_EQ(block[i], 0) << "round " << round << ", size " << size << " at " << i;
+            }
+            memset(block, 0xFF, size);
+            allocator.free(block);
+        }
+    }
+
+    void* array = allocator.calloc(1000, sizeof(uint64_t));
+    ASSERT_NE(array, nullptr);
+    EXPECT_EQ(static_cast<uint64_t*>(array)[999], 0u);
+    allocator.free(array);
+
+    EXPECT_EQ(allocator.calloc(SIZE_MAX / 2, 4), nullptr);
+    EXPECT_EQ(allocator.calloc(1, SIZE_MAX - 3), nullptr);
+    EXPECT_EQ(allocator.calloc(SIZE_MAX - 3, 1), nullptr);
+    EXPECT_EQ(allocator.calloc(2, size_t{PTRDIFF_MAX} / 2 + 1), nullptr);
+    EXPECT_EQ(allocator.calloc(0, 16), nullptr);
+}
+
+TEST_F(MemoryAllocatorTest, TrimPurgesFreeCoalesceBlocks)
+{
+    allocator.destroy();
+    allocator.init({.purge_decay_ms = -1});
+
+    char* block  = static_cast<char*>(allocator.alloc(5_MB));
+    void* keeper = allocator.alloc(5_MB);
+    ASSERT_NE(block, nullptr);
+    ASSERT_NE(keeper, nullptr);
+    memset(block, 0x42, 5_MB);
+
+    allocator.free(block);
+    ASSERT_TRUE(isResident(block + 2_MB));
+    EXPECT_EQ(allocator.purgeStats().purged_bytes, 0u);
+
+    size_t purged = allocator.trim();
+    EXPECT_GE(purged, 4_MB);
+    EXPECT_FALSE(isResident(block + 2_MB));
+    EXPECT_EQ(allocator.purgeStats().purged_bytes, purged);
+    EXPECT_EQ(allocator.trim(), 0u);
+
+    // purged memory is simply faulted in again
+    block = static_cast<char*>(allocator.alloc(5_MB));
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x24, 5_MB);
+    allocator.free(block);
+    allocator.free(keeper);
+}
+
+TEST_F(MemoryAllocatorTest, TrimReleasesEmptySlabs)
+{
+    allocator.destroy();
+    allocator.init({.purge_decay_ms = -1});
+
+    std::vector<void*> blocks(100'000);
+    for (void*& block : blocks) {
+        block = allocator.alloc(64);
+        ASSERT_NE(block, nullptr);
+        memset(block, 0x42, 64);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+
+    EXPECT_GE(allocator.trim(), 6_MB);
+    EXPECT_GE(allocator.purgeStats().purge_calls, 1u);
+}
+
+TEST_F(MemoryAllocatorTest, DecayPurgesIdleBlocks)
+{
+    allocator.destroy();
+    allocator.init({.purge_decay_ms = 20});
+
+    char* block  = static_cast<char*>(allocator.alloc(5_MB));
+    void* keeper = allocator.alloc(5_MB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x42, 5_MB);
+    allocator.free(block);
+    EXPECT_TRUE(isResident(block + 2_MB));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // any later free drives the decay clock of the arena
+    allocator.free(allocator.alloc(20_KB));
+    EXPECT_FALSE(isResident(block + 2_MB));
+    EXPECT_GE(allocator.purgeStats().purged_bytes, 4_MB);
+    allocator.free(keeper);
+}
+
+TEST_F(MemoryAllocatorTest, ZeroDecayPurgesOnFree)
+{
+    allocator.destroy();
+    allocator.init({.purge_decay_ms = 0});
+
+    char* block = static_cast<char*>(allocator.alloc(5_MB));
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x42, 5_MB);
+    allocator.free(block);
+
+    EXPECT_FALSE(isResident(block + 2_MB));
+    EXPECT_GE(allocator.purgeStats().purged_bytes, 4_MB);
+}
+
+TEST_F(MemoryAllocatorTest, TransparentHugePagesBackRegions)
+{
+    if (!isTransparentHugePagesEnabled()) {
+        GTEST_SKIP() << "transparent huge pages are disabled on this system";
+    }
+
+    allocator.destroy();
+    allocator.init({.huge_pages = HugePages::Transparent});
+
+    void* block = allocator.alloc(8_MB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x42, 8_MB);
+
+    HugePageStats stats = allocator.hugePageStats();
+    EXPECT_EQ(stats.mode, HugePages::Transparent);
+    EXPECT_GE(stats.resident_bytes, 8_MB);
+    EXPECT_GT(stats.huge_bytes, 0u);
+    allocator.free(block);
+}
+
+TEST_F(MemoryAllocatorTest, ExplicitHugePagesFallBack)
+{
+    allocator.destroy();
+    allocator.init({.huge_pages = HugePages::Explicit});
+
+    // without a preallocated pool the reservation silently falls back to transparent huge pages
+    HugePageStats stats = allocator.hugePageStats();
+    EXPECT_NE(stats.mode, HugePages::None);
+
+    randomAllocationsStress(allocator, 64_KB);
+}
+
+TEST_F(MemoryAllocatorTest, LargeMappingsAreRecycled)
+{
+    void* block = allocator.alloc(20_MB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x42, 20_MB);
+    allocator.free(block);
+
+    // a slightly smaller request is served by the cached mapping
+    void* again = allocator.alloc(18_MB);
+    EXPECT_EQ(again, block);
+    memset(again, 0x24, 18_MB);
+    allocator.free(again);
+
+    EXPECT_GE(allocator.trim(), 20_MB);
+
+    // nothing is cached anymore, the next block gets a fresh mapping
+    void* fresh = allocator.alloc(20_MB);
+    ASSERT_NE(fresh, nullptr);
+    memset(fresh, 0x42, 20_MB);
+    allocator.free(fresh);
+}
+
+TEST_F(MemoryAllocatorTest, LargeReallocRemapsPages)
+{
+    unsigned char* block = static_cast<unsigned char*>(allocator.alloc(12_MB));
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x33, 12_MB);
+
+    block = static_cast<unsigned char*>(allocator.realloc(block, 64_MB));
+    ASSERT_NE(block, nullptr);
+    EXPECT_EQ(block[0], 0x33);
+    EXPECT_EQ(block[12_MB - 1], 0x33);
+    memset(block + 12_MB, 0x44, 52_MB);
+
+    block = static_cast<unsigned char*>(allocator.realloc(block, 11_MB));
+    ASSERT_NE(block, nullptr);
+    EXPECT_EQ(block[0], 0x33);
+    EXPECT_EQ(block[11_MB - 1], 0x33);
+
+    allocator.free(block);
+}
+
+TEST_F(MemoryAllocatorTest, LargeMappingsAreLookedUp)
+{
+    // a page-aligned foreign pointer with nothing mapped in front of it
+    char* pages = static_cast<char*>(mmap(nullptr, 2 * 4_KB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(pages, MAP_FAILED);
+    munmap(pages, 4_KB);
+    EXPECT_THROW(allocator.free(pages + 4_KB), std::runtime_error);
+    EXPECT_THROW(allocator.free(pages + 4_KB + 64), std::runtime_error);
+    munmap(pages + 4_KB, 4_KB);
+
+    // enough live mappings to grow the table a few times
+    std::vector<unsigned char*> blocks;
+    for (int i = 0; i < 1000; ++i) {
+        blocks.push_back(static_cast<unsigned char*>(allocator.alloc(11_MB)));
+        ASSERT_NE(blocks.back(), nullptr);
+        blocks.back()[0] = static_cast<unsigned char>(i);
+    }
+
+    // a mapping moved by mremap is found under its new pointer
+    blocks[0] = static_cast<unsigned char*>(allocator.realloc(blocks[0], 300_MB));
+    ASSERT_NE(blocks[0], nullptr);
+    EXPECT_EQ(blocks[0][0], 0);
+
+    for (size_t i = 0; i < blocks.size(); i += 2) {
+        allocator.free(blocks[i]);
+    }
+    for (size_t i = 1; i < blocks.size(); i += 2) {
+        blocks[i] = static_cast<unsigned char*>(allocator.realloc(blocks[i], 12_MB));
+        ASSERT_NE(blocks[i], nullptr) << "at " << i;
+        ASSERT_EQ(blocks[i][0], static_cast<unsigned char>(i)) << "at " << i;
+    }
+    for (size_t i = 1; i < blocks.size(); i += 2) {
+        allocator.free(blocks[i]);
+    }
+    EXPECT_THROW(allocator.free(blocks[1]), std::runtime_error);
+}
+
 TEST_F(MemoryAllocatorTest, FreeNullPointer)
 {
     allocator.free(nullptr);
@@ -137,6 +678,23 @@ TEST_F(MemoryAllocatorTest, FreeNullPointer)
     SUCCEED();
 }
 
+TEST_F(MemoryAllocatorTest, FreeOfAForeignPointerThrows)
+{
+    void* foreign = std::malloc(100);
+    ASSERT_NE(foreign, nullptr);
+    EXPECT_THROW(allocator.free(foreign), std::runtime_error);
+    EXPECT_THROW((void)allocator.realloc(foreign, 200), std::runtime_error);
+    std::free(foreign);
+
+    int on_stack = 0;
+    EXPECT_THROW(allocator.free(&on_stack), std::runtime_error);
+
+    // the heap is untouched by the refused frees
+    void* block = allocator.alloc(100);
+    ASSERT_NE(block, nullptr);
+    allocator.free(block);
+}
+
 TEST_F(MemoryAllocatorTest, ZeroSizeAllocation)
 {
     void* block = allocator.alloc(0);
@@ -158,56 +716,1269 @@ TEST_F(MemoryAllocatorTest, Alignment)
 
 TEST_F(MemoryAllocatorTest, RandomAllocationsStressTest)
 {
-    std::mt19937 gen(42);
-    std::uniform_int_distribution<size_t> size_dist(1, 10000);
-    std::uniform_int_distribution<int> op_dist(0, 1);
+    randomAllocationsStress(allocator, 10000);
+}
 
-    const int NUM_OPERATIONS = 10000;
-    struct Allocation {
-        void* block;
-        size_t size;
-        int expected_value;
-    };
-    std::vector<Allocation> allocations;
+class ThreadSafeAllocatorTest : public MemoryAllocatorTest
+{
+protected:
+    void SetUp() override
+    {
+        allocator.init({.thread_safe = true});
+    }
+};
 
-    for (int i = 0; i < NUM_OPERATIONS; ++i) {
-        if (op_dist(gen) == 0 || allocations.empty()) {
-            size_t size = size_dist(gen);
-            void* block = allocator.alloc(size);
-            if (block != nullptr) {
-                int expected_value = static_cast<int>(allocations.size());
-                allocations.push_back({block, size, expected_value});
+TEST_F(ThreadSafeAllocatorTest, ConcurrentMixedAllocations)
+{
+    constexpr size_t THREADS_COUNT = 8;
+    constexpr int ITERATIONS       = 20000;
 
-                if (size >= sizeof(int)) {
-                    *static_cast<int*>(block) = expected_value;
-                }
+    auto worker = [this](size_t thread_id) {
+        std::mt19937 gen(static_cast<unsigned>(thread_id));
+        std::uniform_int_distribution<size_t> size_dist(1, 4096);
+        std::vector<std::pair<unsigned char*, size_t>> live;
+
+        for (int i = 0; i < ITERATIONS; ++i) {
+            if (live.size() < 128 && (gen() & 1)) {
+                size_t size          = size_dist(gen);
+                unsigned char* block = static_cast<unsigned char*>(allocator.alloc(size));
+                ASSERT_NE(block, nullptr);
+                memset(block, static_cast<int>(thread_id), size);
+                live.emplace_back(block, size);
+            } else if (!live.empty()) {
+                auto [block, size] = live.back();
+                live.pop_back();
+                ASSERT_EQ(block[0], static_cast<unsigned char>(thread_id));
+                ASSERT_EQ(block[size - 1], static_cast<unsigned char>(thread_id));
+                allocator.free(block);
             }
-        } else {
-            size_t idx        = std::uniform_int_distribution<size_t>(0, allocations.size() - 1)(gen);
-            Allocation& alloc = allocations[idx];
+        }
 
-            if (alloc.size >= sizeof(int)) {
-                EXPECT_EQ(*static_cast<int*>(alloc.block), alloc.expected_value) << "Data corruption detected at operation " << i << ", block index " << idx;
+        for (auto [block, size] : live) {
+            allocator.free(block);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS_COUNT; ++i) {
+        threads.emplace_back(worker, i + 1);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+TEST_F(ThreadSafeAllocatorTest, CrossThreadFSAFree)
+{
+    constexpr size_t BLOCKS_COUNT = 10000;
+    std::vector<void*> blocks(BLOCKS_COUNT);
+
+    std::thread producer([&] {
+        for (auto& block : blocks) {
+            block = allocator.alloc(64);
+            ASSERT_NE(block, nullptr);
+        }
+    });
+    producer.join();
+
+    std::thread consumer([&] {
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+    });
+    consumer.join();
+
+    // every block went back to the shared pool when the threads exited
+    for (size_t i = 0; i < BLOCKS_COUNT; ++i) {
+        blocks[i] = allocator.alloc(64);
+        ASSERT_NE(blocks[i], nullptr);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+TEST_F(ThreadSafeAllocatorTest, RemoteFreesReturnToTheOwner)
+{
+    // a single refill batch of 64 byte blocks, few enough for the cache of the consumer to hold them all
+    constexpr size_t BLOCKS_COUNT = 32;
+
+    auto run = [this](bool remote_frees) {
+        allocator.destroy();
+        allocator.init({.thread_safe = true, .remote_frees = remote_frees});
+
+        std::vector<void*> blocks(BLOCKS_COUNT);
+        for (auto& block : blocks) {
+            block = allocator.alloc(64);
+        }
+        std::set<void*> freed(blocks.begin(), blocks.end());
+
+        // the consumer stays alive, so nothing it holds is flushed at its exit
+        std::mutex mutex;
+        std::condition_variable done;
+        bool is_freed = false;
+        bool is_over  = false;
+        std::thread consumer([&] {
+            for (void* block : blocks) {
+                allocator.free(block);
             }
+            std::unique_lock lock{mutex};
+            is_freed = true;
+            done.notify_all();
+            done.wait(lock, [&] { return is_over; });
+        });
+        {
+            std::unique_lock lock{mutex};
+            done.wait(lock, [&] { return is_freed; });
+        }
 
-            allocator.free(alloc.block);
+        size_t returned = 0;
+        for (auto& block : blocks) {
+            block = allocator.alloc(64);
+            returned += freed.contains(block);
+        }
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+        {
+            std::lock_guard lock{mutex};
+            is_over = true;
+            done.notify_all();
+        }
+        consumer.join();
+        return returned;
+    };
 
-            if (idx != allocations.size() - 1) {
-                Allocation& last_alloc = allocations.back();
+    EXPECT_EQ(run(true), BLOCKS_COUNT);
+    // without the queues the blocks sit in the cache of the consumer
+    EXPECT_EQ(run(false), 0u);
+}
 
-                if (last_alloc.size >= sizeof(int)) {
-                    *static_cast<int*>(last_alloc.block) = static_cast<int>(idx);
-                    last_alloc.expected_value            = static_cast<int>(idx);
+TEST_F(ThreadSafeAllocatorTest, RemoteFreesDrainIntoANonEmptyBin)
+{
+    // the 33rd block takes a second refill batch, the bin keeps the other 31
+    std::vector<void*> blocks(33);
+    for (auto& block : blocks) {
+        block = allocator.alloc(64);
+    }
+    void* kept = blocks.back();
+    blocks.pop_back();
+
+    std::set<void*> freed(blocks.begin(), blocks.end());
+    std::thread([&] {
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+    }).join();
+
+    size_t returned = 0;
+    for (auto& block : blocks) {
+        block = allocator.alloc(64);
+        returned += freed.contains(block);
+    }
+    EXPECT_EQ(returned, blocks.size());
+
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+    allocator.free(kept);
+}
+
+TEST_F(ThreadSafeAllocatorTest, RemoteQueueOverflowGoesToThePool)
+{
+    constexpr size_t BLOCKS_COUNT = 1000;
+    constexpr size_t QUEUE_LIMIT  = 64; // the cache capacity of 64 byte blocks
+
+    auto usedBlocks = [this] {
+        for (const FSAPoolFragmentation& pool : allocator.fragmentation().fsa_pools) {
+            if (pool.block_size == 64) {
+                return pool.used_blocks;
+            }
+        }
+        return size_t{0};
+    };
+
+    std::vector<void*> blocks(BLOCKS_COUNT);
+    for (auto& block : blocks) {
+        block = allocator.alloc(64);
+    }
+    const size_t used = usedBlocks();
+
+    // this thread never allocates the class again, only a queue worth of blocks may wait for it
+    std::thread([&] {
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+    }).join();
+    EXPECT_EQ(usedBlocks(), used - (BLOCKS_COUNT - QUEUE_LIMIT));
+}
+
+TEST_F(ThreadSafeAllocatorTest, StatsCountFreesSentToAnotherThread)
+{
+    constexpr size_t BLOCKS_COUNT = 1000;
+
+    std::vector<void*> blocks(BLOCKS_COUNT);
+    for (auto& block : blocks) {
+        block = allocator.alloc(64);
+    }
+    // most of them overflow the queue of this thread, the rest wait in it
+    std::thread([&] {
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+    }).join();
+
+    AllocatorStats stats = allocator.stats();
+    EXPECT_EQ(stats.allocations, BLOCKS_COUNT);
+    EXPECT_EQ(stats.frees, BLOCKS_COUNT);
+    EXPECT_EQ(stats.live_bytes, 0u);
+
+    // draining the queue into the bin is no free of its own
+    for (auto& block : blocks) {
+        block = allocator.alloc(64);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+    stats = allocator.stats();
+    EXPECT_EQ(stats.allocations, 2 * BLOCKS_COUNT);
+    EXPECT_EQ(stats.frees, 2 * BLOCKS_COUNT);
+    EXPECT_EQ(stats.live_bytes, 0u);
+}
+
+TEST_F(ThreadSafeAllocatorTest, ForkLeavesTheChildAWorkingHeap)
+{
+    constexpr size_t OWNED_COUNT = 32;
+
+    // the owner of these blocks does not exist in the children, frees to its queue would never be drained there
+    std::vector<void*> owned(OWNED_COUNT);
+    std::atomic<int> phase{0};
+    std::thread owner([&] {
+        for (auto& block : owned) {
+            block = allocator.alloc(64);
+        }
+        phase = 1;
+        while (phase != 2) {
+            std::this_thread::yield();
+        }
+    });
+    while (phase != 1) {
+        std::this_thread::yield();
+    }
+
+    // churn keeps the locks of every path busy while the process forks
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> workers;
+    for (unsigned seed = 0; seed < 4; ++seed) {
+        workers.emplace_back([&, seed] {
+            std::mt19937 gen(seed);
+            std::vector<void*> blocks(64);
+            while (!stop.load(std::memory_order_relaxed)) {
+                void*& block = blocks[gen() % blocks.size()];
+                allocator.free(block);
+                block = allocator.alloc(1 + gen() % 200_KB);
+            }
+            for (void* block : blocks) {
+                allocator.free(block);
+            }
+        });
+    }
+
+    for (int i = 0; i < 50; ++i) {
+        allocator.prepareFork();
+        pid_t pid = fork();
+        if (pid == 0) {
+            // a lock left held would hang the child, the alarm turns that into a failure
+            alarm(10);
+            allocator.afterForkChild();
+            constexpr size_t sizes[] = {24, 5000, 300_KB, 11_MB};
+            for (size_t size : sizes) {
+                void* block = allocator.alloc(size);
+                if (!block) {
+                    _exit(1);
                 }
+                memset(block, 0x2A, size);
+                allocator.free(block);
             }
 
-            allocations[idx] = allocations.back();
-            allocations.pop_back();
+            std::set<void*> freed(owned.begin(), owned.end());
+            for (void* block : owned) {
+                allocator.free(block);
+            }
+            size_t returned = 0;
+            for (size_t j = 0; j < OWNED_COUNT; ++j) {
+                returned += freed.contains(allocator.alloc(64));
+            }
+            _exit(returned == OWNED_COUNT ? 0 : 2);
         }
+        allocator.afterForkParent();
+        ASSERT_GT(pid, 0);
+
+        int status = 0;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status)) << "fork " << i << ", signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        ASSERT_EQ(WEXITSTATUS(status), 0) << "fork " << i;
     }
 
-    for (const auto& alloc : allocations) {
-        allocator.free(alloc.block);
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (void* block : owned) {
+        allocator.free(block);
+    }
+    phase = 2;
+    owner.join();
+}
+
+TEST_F(ThreadSafeAllocatorTest, SizeClassStatsFoldedAtThreadExit)
+{
+    constexpr size_t THREADS_COUNT = 4;
+    constexpr size_t BLOCKS_COUNT  = 1000;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS_COUNT; ++i) {
+        threads.emplace_back([&] {
+            for (size_t j = 0; j < BLOCKS_COUNT; ++j) {
+                allocator.free(allocator.alloc(100));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    size_t allocations     = 0;
+    size_t requested_bytes = 0;
+    for (const SizeClassStats& stats : allocator.sizeClassStats()) {
+        allocations += stats.allocations;
+        requested_bytes += stats.requested_bytes;
+    }
+    EXPECT_EQ(allocations, THREADS_COUNT * BLOCKS_COUNT);
+    EXPECT_EQ(requested_bytes, THREADS_COUNT * BLOCKS_COUNT * 100);
+}
+
+TEST_F(ThreadSafeAllocatorTest, StatsMergeLiveAndExitedThreads)
+{
+    constexpr size_t THREADS_COUNT = 4;
+    constexpr size_t BLOCKS_COUNT  = 1000;
+
+    // blocks allocated by the workers and freed by the main thread after they exited
+    std::vector<std::vector<void*>> kept(THREADS_COUNT);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS_COUNT; ++i) {
+        threads.emplace_back([&, i] {
+            for (size_t j = 0; j < BLOCKS_COUNT; ++j) {
+                allocator.free(allocator.alloc(64));
+                kept[i].push_back(allocator.alloc(64));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    AllocatorStats stats = allocator.stats();
+    EXPECT_EQ(stats.allocations, THREADS_COUNT * BLOCKS_COUNT * 2);
+    EXPECT_EQ(stats.frees, THREADS_COUNT * BLOCKS_COUNT);
+    EXPECT_EQ(stats.live_bytes, THREADS_COUNT * BLOCKS_COUNT * 64);
+    EXPECT_GE(stats.peak_live_bytes, stats.live_bytes);
+
+    for (auto& blocks : kept) {
+        for (void* block : blocks) {
+            allocator.free(block);
+        }
+    }
+    stats = allocator.stats();
+    EXPECT_EQ(stats.frees, stats.allocations);
+    EXPECT_EQ(stats.live_bytes, 0u);
+}
+
+TEST_F(ThreadSafeAllocatorTest, ArenasFreeAcrossThreads)
+{
+    allocator.destroy();
+    allocator.init({.thread_safe = true, .arenas_count = 4});
+
+    constexpr size_t THREADS_COUNT = 4;
+    constexpr size_t BLOCKS_COUNT  = 64;
+    std::vector<std::vector<void*>> blocks(THREADS_COUNT, std::vector<void*>(BLOCKS_COUNT));
+
+    auto run = [](auto&& body) {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < THREADS_COUNT; ++i) {
+            threads.emplace_back(body, i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    };
+
+    run([&](size_t thread_id) {
+        for (size_t i = 0; i < BLOCKS_COUNT; ++i) {
+            size_t size = 1_KB + (i % 8) * 16_KB;
+            void* block = allocator.alloc(size);
+            ASSERT_NE(block, nullptr);
+            memset(block, static_cast<int>(thread_id), size);
+            blocks[thread_id][i] = block;
+        }
+    });
+
+    // every thread frees the blocks of its neighbour, which live in another arena
+    run([&](size_t thread_id) {
+        for (void* block : blocks[(thread_id + 1) % THREADS_COUNT]) {
+            EXPECT_EQ(*static_cast<unsigned char*>(block), (thread_id + 1) % THREADS_COUNT);
+            allocator.free(block);
+        }
+    });
+}
+
+class TLSFAllocatorTest : public MemoryAllocatorTest
+{
+protected:
+    void SetUp() override
+    {
+        allocator.init({.engine = CoalesceEngine::TLSF});
+    }
+};
+
+TEST_F(TLSFAllocatorTest, CoalesceAllocations)
+{
+    for (size_t size : {1024, 8192, 32768, 65536, 1048576, 9437184}) {
+        void* block = allocator.alloc(size);
+        ASSERT_NE(block, nullptr);
+
+        memset(block, 0xCC, size);
+        EXPECT_EQ(static_cast<unsigned char*>(block)[size - 1], 0xCC);
+
+        allocator.free(block);
+    }
+}
+
+TEST_F(TLSFAllocatorTest, FreedNeighboursAreReused)
+{
+    std::vector<void*> blocks;
+    for (int i = 0; i < 64; ++i) {
+        blocks.push_back(allocator.alloc(2_KB));
+        ASSERT_NE(blocks.back(), nullptr);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+
+    // the 2 KB pieces merged back, so a block several times bigger fits in their place
+    void* merged = allocator.alloc(32_KB);
+    ASSERT_NE(merged, nullptr);
+    allocator.free(merged);
+}
+
+TEST_F(TLSFAllocatorTest, LongChurnKeepsFreeBlocksIndexed)
+{
+    // more frees than the old bump-allocated node pool could ever index
+    for (int i = 0; i < 2'500'000; ++i) {
+        void* block = allocator.alloc(20_KB);
+        ASSERT_NE(block, nullptr);
+        allocator.free(block);
+    }
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 256; ++i) {
+        blocks.push_back(allocator.alloc(20_KB));
+        ASSERT_NE(blocks.back(), nullptr);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+TEST_F(TLSFAllocatorTest, ReallocChurnKeepsDataAndBins)
+{
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<size_t> size_dist(5_KB, 200_KB);
+    std::uniform_int_distribution<size_t> index_dist(0, 63);
+
+    std::vector<void*> blocks(64, nullptr);
+    std::vector<size_t> sizes(64, 0);
+    for (int i = 0; i < 20000; ++i) {
+        size_t idx  = index_dist(gen);
+        size_t size = size_dist(gen);
+
+        void* block = allocator.realloc(blocks[idx], size);
+        ASSERT_NE(block, nullptr);
+        if (sizes[idx]) {
+            ASSERT_EQ(*static_cast<size_t*>(block), idx);
+        }
+        *static_cast<size_t*>(block) = idx;
+        blocks[idx]                  = block;
+        sizes[idx]                   = size;
+    }
+
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+TEST_F(TLSFAllocatorTest, AlignedChurnReusesPads)
+{
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<size_t> size_dist(5_KB, 100_KB);
+    std::uniform_int_distribution<size_t> shift_dist(4, 16);
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 50000; ++i) {
+        size_t alignment = size_t{1} << shift_dist(gen);
+        void* block      = allocator.allocAligned(size_dist(gen), alignment);
+        ASSERT_NE(block, nullptr);
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % alignment, 0u);
+        blocks.push_back(block);
+
+        if (blocks.size() > 32) {
+            size_t idx = gen() % blocks.size();
+            allocator.free(blocks[idx]);
+            blocks[idx] = blocks.back();
+            blocks.pop_back();
+        }
+    }
+
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+TEST_F(TLSFAllocatorTest, RandomAllocationsStressTest)
+{
+    randomAllocationsStress(allocator, 200000);
+}
+
+TEST_F(MemoryAllocatorTest, OwnsAndUsableSize)
+{
+    const size_t sizes[] = {24, 5000, 11_MB};
+    for (size_t size : sizes) {
+        void* block = allocator.alloc(size);
+        ASSERT_NE(block, nullptr);
+        EXPECT_TRUE(allocator.owns(block));
+        EXPECT_GE(allocator.usableSize(block), size);
+        allocator.free(block);
+    }
+
+    void* foreign = std::malloc(100);
+    EXPECT_FALSE(allocator.owns(foreign));
+    EXPECT_THROW((void)allocator.usableSize(foreign), std::runtime_error);
+    std::free(foreign);
+    EXPECT_FALSE(allocator.owns(nullptr));
+
+    // owns() must not touch the memory in front of a foreign pointer
+    char* pages = static_cast<char*>(mmap(nullptr, 2 * 4_KB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_NE(pages, MAP_FAILED);
+    munmap(pages, 4_KB);
+    EXPECT_FALSE(allocator.owns(pages + 4_KB));
+    munmap(pages + 4_KB, 4_KB);
+}
+
+TEST_F(MemoryAllocatorTest, MinAlignmentCoversEveryPath)
+{
+    allocator.destroy();
+    allocator.init({.min_alignment = 16});
+
+    const size_t sizes[] = {9, 24, 40, 1000, 5000, 100_KB, 11_MB};
+    std::vector<void*> blocks;
+    for (size_t size : sizes) {
+        blocks.push_back(allocator.alloc(size));
+        blocks.push_back(allocator.calloc(1, size));
+        blocks.push_back(allocator.realloc(allocator.alloc(size), size * 3));
+    }
+    for (void* block : blocks) {
+        ASSERT_NE(block, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % 16, 0u);
+        allocator.free(block);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, StlAllocatorBacksContainers)
+{
+    std::vector<int, StlAllocator<int>> vec;
+    for (int i = 0; i < 10000; ++i) {
+        vec.push_back(i);
+    }
+    EXPECT_TRUE(allocator.owns(vec.data()));
+    EXPECT_EQ(vec[9999], 9999);
+
+    std::map<int, std::string, std::less<>, StlAllocator<std::pair<const int, std::string>>> map;
+    for (int i = 0; i < 1000; ++i) {
+        map.emplace(i, std::to_string(i));
+    }
+    EXPECT_TRUE(allocator.owns(&*map.begin()));
+    EXPECT_EQ(map.at(777), "777");
+
+    struct alignas(64) Line {
+        char bytes[64];
+    };
+    std::vector<Line, StlAllocator<Line>> lines(100);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(lines.data()) % 64, 0u);
+}
+
+TEST_F(MemoryAllocatorTest, MemoryResourceBacksPmrContainers)
+{
+    std::pmr::vector<int> vec{allocatorResource()};
+    vec.resize(5000, 7);
+    EXPECT_TRUE(allocator.owns(vec.data()));
+
+    void* aligned = allocatorResource()->allocate(100, 256);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(aligned) % 256, 0u);
+    allocatorResource()->deallocate(aligned, 100, 256);
+
+    AllocatorResource other;
+    EXPECT_TRUE(allocatorResource()->is_equal(other));
+    EXPECT_FALSE(allocatorResource()->is_equal(*std::pmr::new_delete_resource()));
+}
+
+TEST_F(MemoryAllocatorTest, ArenaScopesRewindNestedAllocations)
+{
+    Arena arena{4_KB};
+    int* first = arena.create<int>(1);
+    ASSERT_NE(first, nullptr);
+    EXPECT_TRUE(allocator.owns(first));
+
+    void* inner = nullptr;
+    {
+        Arena::Scope outer{arena};
+        inner = arena.allocate(100);
+        {
+            Arena::Scope nested{arena};
+            for (int i = 0; i < 1000; ++i) {
+                *arena.create<uint64_t>() = i;
+            }
+            EXPECT_GT(arena.reservedBytes(), 4_KB);
+        }
+        // the nested scope gave up its chunks, the next allocation follows the inner block again
+        EXPECT_EQ(arena.allocate(100), static_cast<char*>(inner) + 112);
+    }
+    EXPECT_EQ(arena.allocate(100), inner);
+
+    struct alignas(64) Line {
+        char bytes[64];
+    };
+    Line* lines = arena.allocateArray<Line>(10);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(lines) % 64, 0u);
+    EXPECT_EQ(*first, 1);
+
+    // the kept chunks are bumped through again after a reset, nothing new is reserved
+    size_t reserved = arena.reservedBytes();
+    arena.reset();
+    EXPECT_EQ(arena.allocatedBytes(), 0u);
+    EXPECT_EQ(arena.create<int>(2), first);
+    for (int i = 0; i < 1000; ++i) {
+        *arena.create<uint64_t>() = i;
+    }
+    EXPECT_EQ(arena.reservedBytes(), reserved);
+
+    arena.release();
+    EXPECT_EQ(arena.reservedBytes(), 0u);
+    EXPECT_EQ(allocator.stats().live_bytes, 0u);
+}
+
+TEST_F(MemoryAllocatorTest, ArenaLargeRequestsAndReleasedChunks)
+{
+    Arena arena{4_KB, false};
+    void* small = arena.allocate(1_KB);
+    void* big   = arena.allocate(100_KB);
+    ASSERT_NE(big, nullptr);
+    memset(big, 0x3C, 100_KB);
+    EXPECT_GE(arena.reservedBytes(), 104_KB);
+
+    // without kept chunks a reset returns everything but the first chunk
+    arena.reset();
+    EXPECT_EQ(arena.reservedBytes(), 4_KB);
+    EXPECT_EQ(arena.allocate(1_KB), small);
+}
+
+TEST_F(MemoryAllocatorTest, ArenaImpossibleSizesThrow)
+{
+    Arena arena{4_KB};
+    void* small = arena.allocate(64);
+
+    const size_t sizes[] = {SIZE_MAX / 2, SIZE_MAX - 8, SIZE_MAX};
+    for (size_t size : sizes) {
+        EXPECT_THROW((void)arena.allocate(size), std::bad_alloc) << size;
+        EXPECT_THROW((void)arena.allocate(size, 4_KB), std::bad_alloc) << size;
+        EXPECT_THROW((void)arena.resource()->allocate(size), std::bad_alloc) << size;
+    }
+    EXPECT_THROW((void)arena.allocateArray<char>(SIZE_MAX), std::bad_alloc);
+
+    // nothing was reserved for the failed requests
+    EXPECT_EQ(arena.reservedBytes(), 4_KB);
+    arena.reset();
+    EXPECT_EQ(arena.allocate(64), small);
+}
+
+TEST_F(MemoryAllocatorTest, ArenaResourceBacksPmrContainers)
+{
+    Arena arena;
+    {
+        std::pmr::vector<int> vec{arena.resource()};
+        vec.resize(50000, 7);
+        std::pmr::map<int, std::pmr::string> map{arena.resource()};
+        for (int i = 0; i < 1000; ++i) {
+            map.emplace(i, "a string too long for the small buffer");
+        }
+        EXPECT_EQ(vec[49999], 7);
+        EXPECT_EQ(map.at(999).size(), 38u);
+        EXPECT_TRUE(allocator.owns(vec.data()));
+    }
+    EXPECT_TRUE(arena.resource()->is_equal(*arena.resource()));
+    EXPECT_FALSE(arena.resource()->is_equal(*allocatorResource()));
+}
+
+TEST_F(MemoryAllocatorTest, ObjectPoolPacksOddSizedObjects)
+{
+    struct Odd {
+        char bytes[72];
+        explicit Odd(char fill) noexcept
+        {
+            memset(bytes, fill, sizeof(bytes));
+        }
+    };
+    using Pool = ObjectPool<Odd>;
+    // the FSA class of 80 bytes would hold 819 of them per slab
+    static_assert(Pool::BLOCK_SIZE == 72);
+    EXPECT_GT(Pool::BLOCKS_PER_SLAB, 900u);
+
+    Pool pool;
+    std::vector<Odd*> objects;
+    for (int i = 0; i < 10000; ++i) {
+        objects.push_back(pool.create(static_cast<char>(i)));
+    }
+    EXPECT_EQ(pool.liveObjects(), 10000u);
+    EXPECT_EQ(pool.slabsCount(), (10000 + Pool::BLOCKS_PER_SLAB - 1) / Pool::BLOCKS_PER_SLAB);
+    EXPECT_EQ(std::set<Odd*>(objects.begin(), objects.end()).size(), objects.size());
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(objects[i]->bytes[71], static_cast<char>(i));
+    }
+
+    // pool objects never go through free()
+    EXPECT_TRUE(allocator.owns(objects[0]));
+    EXPECT_THROW(allocator.free(objects[0]), std::runtime_error);
+
+    size_t slabs_used = allocator.stats().fsa_slabs_used;
+    for (Odd* object : objects) {
+        pool.destroy(object);
+    }
+    EXPECT_EQ(pool.liveObjects(), 0u);
+    EXPECT_EQ(pool.slabsCount(), 1u);
+    EXPECT_EQ(allocator.stats().fsa_slabs_used, slabs_used - (10000 + Pool::BLOCKS_PER_SLAB - 1) / Pool::BLOCKS_PER_SLAB + 1);
+
+    // the destroyed blocks are handed out again, most recent first
+    Odd* last = objects.back();
+    EXPECT_EQ(pool.create('x'), last);
+}
+
+TEST_F(MemoryAllocatorTest, ObjectPoolBatchesAreAllOrNothing)
+{
+    struct alignas(32) Counted {
+        int value;
+        int* alive;
+        Counted(int v, int* alive_count)
+            : value{v}
+            , alive{alive_count}
+        {
+            if (*alive == 2500) {
+                throw std::runtime_error{"full"};
+            }
+            ++*alive;
+        }
+        ~Counted()
+        {
+            --*alive;
+        }
+    };
+
+    int alive = 0;
+    ObjectPool<Counted> pool;
+    std::vector<Counted*> batch(2000);
+    pool.createBatch(std::span{batch}, 7, &alive);
+    EXPECT_EQ(alive, 2000);
+    EXPECT_EQ(pool.liveObjects(), 2000u);
+    for (Counted* object : batch) {
+        ASSERT_EQ(object->value, 7);
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(object) % 32, 0u);
+    }
+
+    // the 501st constructor throws: the second batch leaves nothing behind
+    std::vector<Counted*> failed(1000);
+    EXPECT_THROW(pool.createBatch(std::span{failed}, 8, &alive), std::runtime_error);
+    EXPECT_EQ(alive, 2000);
+    EXPECT_EQ(pool.liveObjects(), 2000u);
+
+    pool.destroyBatch(batch);
+    EXPECT_EQ(alive, 0);
+    EXPECT_EQ(pool.liveObjects(), 0u);
+    EXPECT_EQ(pool.slabsCount(), 1u);
+}
+
+TEST_F(MemoryAllocatorTest, StatsCountEveryPath)
+{
+    std::vector<void*> small;
+    for (int i = 0; i < 100; ++i) {
+        small.push_back(allocator.alloc(32));
+    }
+    void* coalesce = allocator.alloc(20_KB);
+    void* large    = allocator.alloc(11_MB);
+
+    AllocatorStats stats = allocator.stats();
+    EXPECT_EQ(stats.allocations, 102u);
+    EXPECT_EQ(stats.frees, 0u);
+    ASSERT_EQ(stats.size_classes.size(), 32u);
+    EXPECT_EQ(stats.size_classes[3].block_size, 32u);
+    EXPECT_EQ(stats.size_classes[3].allocations, 100u);
+    EXPECT_EQ(stats.size_classes[3].live_bytes, 3200u);
+    EXPECT_EQ(stats.coalesce.allocations, 1u);
+    EXPECT_GE(stats.coalesce.live_bytes, 20_KB);
+    EXPECT_EQ(stats.large.live_bytes, 11_MB);
+    EXPECT_EQ(stats.live_bytes, 3200 + stats.coalesce.live_bytes + 11_MB);
+    EXPECT_GE(stats.regions_used, 3u);
+    EXPECT_EQ(stats.regions_reserved, 16u);
+    EXPECT_GE(stats.fsa_slabs_used, 1u);
+    EXPECT_EQ(stats.threads, 1u);
+
+    // resizing in place moves the live bytes without counting an allocation
+    coalesce = allocator.realloc(coalesce, 8_KB);
+    stats    = allocator.stats();
+    EXPECT_EQ(stats.coalesce.allocations, 1u);
+    EXPECT_LT(stats.coalesce.live_bytes, 9_KB);
+
+    for (void* block : small) {
+        allocator.free(block);
+    }
+    allocator.free(coalesce);
+    allocator.free(large);
+
+    stats = allocator.stats();
+    EXPECT_EQ(stats.frees, stats.allocations);
+    EXPECT_EQ(stats.live_bytes, 0u);
+    EXPECT_GE(stats.peak_live_bytes, 11_MB);
+    EXPECT_GE(stats.large_cached_bytes, 11_MB);
+}
+
+TEST_F(MemoryAllocatorTest, FragmentationReportWalksTheHeap)
+{
+    std::vector<void*> small;
+    for (int i = 0; i < 100; ++i) {
+        small.push_back(allocator.alloc(64));
+    }
+    std::vector<void*> medium;
+    for (int i = 0; i < 200; ++i) {
+        medium.push_back(allocator.alloc(20_KB));
+    }
+    for (size_t i = 1; i < medium.size(); i += 2) {
+        allocator.free(medium[i]);
+    }
+
+    FragmentationReport report = allocator.fragmentation();
+    ASSERT_FALSE(report.regions.empty());
+    size_t free_blocks = 0;
+    for (const RegionFragmentation& region : report.regions) {
+        EXPECT_LE(region.used_bytes + region.free_bytes + region.wilderness_bytes, 32_MB);
+        EXPECT_LE(region.largest_free_block, region.free_bytes + region.wilderness_bytes);
+        EXPECT_GE(region.external_fragmentation, 0.0);
+        EXPECT_LT(region.external_fragmentation, 1.0);
+
+        size_t histogram_blocks = 0;
+        for (const SizeBucketStats& bucket : region.histogram) {
+            histogram_blocks += bucket.used_blocks + bucket.free_blocks;
+        }
+        EXPECT_EQ(histogram_blocks, region.used_blocks + region.free_blocks);
+        free_blocks += region.free_blocks;
+    }
+    // every free block is indexed exactly once
+    EXPECT_EQ(report.free_nodes, free_blocks);
+
+    auto kept = std::find_if(report.histogram.begin(), report.histogram.end(), [](const SizeBucketStats& bucket) { return bucket.min_size == 16_KB; });
+    ASSERT_NE(kept, report.histogram.end());
+    EXPECT_EQ(kept->used_blocks, 100u);
+
+    auto pool = std::find_if(report.fsa_pools.begin(), report.fsa_pools.end(), [](const FSAPoolFragmentation& pool) { return pool.block_size == 64; });
+    ASSERT_NE(pool, report.fsa_pools.end());
+    EXPECT_EQ(pool->used_blocks, 100u);
+    EXPECT_GT(pool->occupancy, 0.0);
+    EXPECT_GE(report.fsa_slabs_used, 1u);
+
+    const std::string json = toJson(report);
+    EXPECT_EQ(json.front(), '{');
+    EXPECT_EQ(json.back(), '}');
+    EXPECT_EQ(json.find('\n'), std::string::npos);
+    EXPECT_NE(json.find("\"regions\":[{\"index\":0,"), std::string::npos);
+    EXPECT_NE(json.find("{\"block_size\":64,"), std::string::npos);
+    EXPECT_EQ(std::count(json.begin(), json.end(), '{'), std::count(json.begin(), json.end(), '}'));
+    EXPECT_EQ(std::count(json.begin(), json.end(), '['), std::count(json.begin(), json.end(), ']'));
+
+    for (void* block : small) {
+        allocator.free(block);
+    }
+    for (size_t i = 0; i < medium.size(); i += 2) {
+        allocator.free(medium[i]);
+    }
+    report = allocator.fragmentation();
+    EXPECT_EQ(report.used_bytes, 0u);
+    EXPECT_GT(report.free_bytes, 0u);
+}
+
+std::vector<std::string> readHeapProfile(MemoryAllocator& allocator)
+{
+    const std::string path = testing::TempDir() + "alloc_test.heap";
+    EXPECT_TRUE(allocator.dumpHeapProfile(path.c_str()));
+
+    std::ifstream file{path};
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line);) {
+        lines.push_back(line);
+    }
+    std::remove(path.c_str());
+    return lines;
+}
+
+TEST_F(MemoryAllocatorTest, HeapProfileTracksLiveSamples)
+{
+    EXPECT_FALSE(allocator.dumpHeapProfile("/dev/null"));
+    allocator.destroy();
+    allocator.init({.profile_sample_bytes = 4_KB});
+
+    // 256KB allocated: about 64 samples expected
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1000; ++i) {
+        blocks.push_back(allocator.alloc(256));
+        std::memset(blocks.back(), i, 256);
+    }
+
+    std::vector<std::string> lines = readHeapProfile(allocator);
+    ASSERT_FALSE(lines.empty());
+    size_t objects = 0;
+    size_t bytes   = 0;
+    ASSERT_EQ(std::sscanf(lines[0].c_str(), "heap profile: %zu: %zu", &objects, &bytes), 2) << lines[0];
+    EXPECT_NE(lines[0].find("@ heap_v2/4096"), std::string::npos);
+    EXPECT_GT(objects, 20u);
+    EXPECT_LT(objects, 150u);
+    EXPECT_EQ(bytes, objects * 256);
+    EXPECT_EQ(lines[1].rfind("1: 256 [1: 256] @ 0x", 0), 0u) << lines[1];
+    EXPECT_NE(std::find(lines.begin(), lines.end(), "MAPPED_LIBRARIES:"), lines.end());
+
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(static_cast<unsigned char*>(blocks[i])[255], static_cast<unsigned char>(i));
+        allocator.free(blocks[i]);
+    }
+    lines = readHeapProfile(allocator);
+    ASSERT_FALSE(lines.empty());
+    EXPECT_EQ(lines[0], "heap profile: 0: 0 [0: 0] @ heap_v2/4096");
+}
+
+TEST_F(MemoryAllocatorTest, SampledBlocksBehaveLikeAnyOther)
+{
+    allocator.destroy();
+    // a one byte gap samples every allocation
+    allocator.init({.profile_sample_bytes = 1});
+
+    std::vector<void*> blocks;
+    for (size_t size : {size_t{8}, size_t{100}, size_t{4_KB}, size_t{20_KB}, size_t{11_MB}}) {
+        void* block = allocator.alloc(size);
+        ASSERT_NE(block, nullptr);
+        EXPECT_GE(allocator.usableSize(block), size);
+        std::memset(block, 0xAB, size);
+        blocks.push_back(block);
+    }
+
+    void* aligned = allocator.allocAligned(300, 256);
+    ASSERT_NE(aligned, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(aligned) % 256, 0u);
+    blocks.push_back(aligned);
+
+    auto* zeroed = static_cast<unsigned char*>(allocator.calloc(100, 100));
+    ASSERT_NE(zeroed, nullptr);
+    EXPECT_TRUE(std::all_of(zeroed, zeroed + 10000, [](unsigned char byte) { return byte == 0; }));
+    blocks.push_back(zeroed);
+
+    // a sampled block moves on realloc and takes its content along
+    auto* grown = static_cast<unsigned char*>(allocator.realloc(blocks[1], 5000));
+    ASSERT_NE(grown, nullptr);
+    EXPECT_EQ(grown[99], 0xAB);
+    blocks[1] = grown;
+
+    EXPECT_GT(readHeapProfile(allocator).size(), blocks.size());
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+    std::vector<std::string> lines = readHeapProfile(allocator);
+    ASSERT_FALSE(lines.empty());
+    EXPECT_EQ(lines[0], "heap profile: 0: 0 [0: 0] @ heap_v2/1");
+    EXPECT_EQ(allocator.stats().live_bytes, 0u);
+}
+
+TEST_F(MemoryAllocatorTest, TraceRecordsEveryCallOnce)
+{
+    const std::string path = testing::TempDir() + "alloc_test.trace";
+    allocator.destroy();
+    allocator.init({.thread_safe = true, .trace_path = path.c_str()});
+
+    void* small   = allocator.alloc(24);
+    void* zeroed  = allocator.calloc(10, 100);
+    void* aligned = allocator.allocAligned(300, 256);
+    // the move allocates and frees inside, still a single event
+    void* grown  = allocator.realloc(small, 50_KB);
+    void* remote = nullptr;
+    std::thread{[&] { remote = allocator.alloc(128); }}.join();
+    allocator.free(remote);
+    allocator.free(aligned);
+    allocator.free(zeroed);
+    allocator.free(grown);
+    allocator.destroy();
+
+    std::vector<TraceEvent> events;
+    ASSERT_TRUE(readTrace(path.c_str(), events));
+    std::remove(path.c_str());
+    allocator.init();
+
+    ASSERT_EQ(events.size(), 9u);
+    auto ptr = [](void* p) { return reinterpret_cast<uintptr_t>(p); };
+    EXPECT_EQ(events[0].op, TraceOp::Alloc);
+    EXPECT_EQ(events[0].ptr, ptr(small));
+    EXPECT_EQ(events[0].size, 24u);
+    EXPECT_EQ(events[1].op, TraceOp::Calloc);
+    EXPECT_EQ(events[1].size, 1000u);
+    EXPECT_EQ(events[2].op, TraceOp::AllocAligned);
+    EXPECT_EQ(events[2].ptr, ptr(aligned));
+    EXPECT_EQ(events[2].alignment, 256u);
+    EXPECT_EQ(events[3].op, TraceOp::Realloc);
+    EXPECT_EQ(events[3].ptr, ptr(grown));
+    EXPECT_EQ(events[3].old_ptr, ptr(small));
+    EXPECT_EQ(events[3].size, 50_KB);
+    EXPECT_EQ(events[4].ptr, ptr(remote));
+    EXPECT_NE(events[4].thread, events[0].thread);
+    for (size_t i = 5; i < events.size(); ++i) {
+        EXPECT_EQ(events[i].op, TraceOp::Free);
+        EXPECT_EQ(events[i].thread, events[0].thread);
+    }
+    EXPECT_EQ(events[5].ptr, ptr(remote));
+    EXPECT_EQ(events[8].ptr, ptr(grown));
+    for (size_t i = 0; i < events.size(); ++i) {
+        EXPECT_EQ(events[i].sequence, i);
+    }
+    EXPECT_LE(events[0].time_ns, events[3].time_ns);
+}
+
+TEST_F(MemoryAllocatorTest, DefaultReservationIsBounded)
+{
+    std::vector<void*> blocks;
+    while (void* block = allocator.alloc(5_MB)) {
+        blocks.push_back(block);
+        ASSERT_LT(blocks.size(), 512_MB / 5_MB);
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+TEST_F(MemoryAllocatorTest, HeapReserveGrowsPastDefault)
+{
+    allocator.destroy();
+    allocator.init({.heap_reserve = 64_GB});
+
+    // 750MB in 5MB blocks: far more regions than the default reservation holds
+    std::vector<char*> blocks;
+    for (int i = 0; i < 150; ++i) {
+        char* block = static_cast<char*>(allocator.alloc(5_MB));
+        ASSERT_NE(block, nullptr) << "block " << i;
+        block[0]        = static_cast<char>(i);
+        block[5_MB - 1] = static_cast<char>(i);
+        blocks.push_back(block);
+    }
+    for (int i = 0; i < 150; ++i) {
+        EXPECT_EQ(blocks[i][0], static_cast<char>(i));
+        EXPECT_EQ(blocks[i][5_MB - 1], static_cast<char>(i));
+    }
+    for (char* block : blocks) {
+        allocator.free(block);
+    }
+
+    // the small paths are unaffected by the bigger reservation
+    randomAllocationsStress(allocator, 64_KB);
+}
+
+class LazyCarvingAllocatorTest : public MemoryAllocatorTest
+{
+protected:
+    void SetUp() override
+    {
+        allocator.init({.lazy_carving = true});
+    }
+};
+
+TEST_F(LazyCarvingAllocatorTest, BlocksAreCarvedBackToBack)
+{
+    char* first  = static_cast<char*>(allocator.alloc(20_KB));
+    char* second = static_cast<char*>(allocator.alloc(20_KB));
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    EXPECT_GT(second, first);
+    EXPECT_LT(second - first, 21_KB);
+
+    // the freed tail block melts into the wilderness and is carved again
+    allocator.free(second);
+    void* third = allocator.alloc(20_KB);
+    EXPECT_EQ(third, second);
+
+    allocator.free(third);
+    allocator.free(first);
+    EXPECT_EQ(allocator.alloc(40_KB), first);
+    allocator.free(first);
+}
+
+TEST_F(LazyCarvingAllocatorTest, ReallocGrowsIntoWilderness)
+{
+    void* block = allocator.alloc(20_KB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x5C, 20_KB);
+
+    void* grown = allocator.realloc(block, 5_MB);
+    ASSERT_EQ(grown, block);
+    EXPECT_EQ(static_cast<unsigned char*>(grown)[20_KB - 1], 0x5C);
+    memset(grown, 0x5D, 5_MB);
+
+    EXPECT_EQ(allocator.realloc(grown, 1_KB * 100), block);
+    allocator.free(block);
+}
+
+TEST_F(LazyCarvingAllocatorTest, TrimPurgesWrittenWilderness)
+{
+    void* block = allocator.alloc(5_MB);
+    ASSERT_NE(block, nullptr);
+    memset(block, 0x42, 5_MB);
+    allocator.free(block);
+
+    EXPECT_GE(allocator.trim(), 4_MB);
+    EXPECT_EQ(allocator.trim(), 0u);
+
+    // the purged wilderness reads back as zeroes
+    unsigned char* zeroed = static_cast<unsigned char*>(allocator.calloc(1, 5_MB));
+    ASSERT_EQ(zeroed, block);
+    for (size_t i = 0; i < 5_MB; i += 4_KB) {
+        ASSERT_EQ(zeroed[i], 0) << "at " << i;
+    }
+    allocator.free(zeroed);
+}
+
+TEST_F(LazyCarvingAllocatorTest, FragmentationCountsTheWilderness)
+{
+    allocator.destroy();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+
+    void* first  = allocator.alloc(20_KB);
+    void* second = allocator.alloc(20_KB);
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    allocator.free(first);
+
+    FragmentationReport report = allocator.fragmentation();
+    // every region type starts as a single wilderness
+    ASSERT_EQ(report.regions.size(), 3u);
+    auto carved = std::find_if(report.regions.begin(), report.regions.end(), [](const RegionFragmentation& region) { return region.used_blocks != 0; });
+    ASSERT_NE(carved, report.regions.end());
+    const RegionFragmentation& region = *carved;
+    EXPECT_EQ(region.max_request, 1_MB);
+    EXPECT_EQ(region.used_blocks, 1u);
+    EXPECT_EQ(region.free_blocks, 1u);
+    EXPECT_GT(region.wilderness_bytes, 31_MB);
+    EXPECT_EQ(region.largest_free_block, region.wilderness_bytes);
+    EXPECT_GT(region.external_fragmentation, 0.0);
+    EXPECT_LT(region.external_fragmentation, 0.01);
+
+    // TLSF reports its first levels, the freed block sits in the one of 16KB
+    ASSERT_EQ(report.free_lists.size(), 1u);
+    EXPECT_EQ(report.free_lists[0].min_size, 16_KB);
+    EXPECT_EQ(report.free_lists[0].blocks, 1u);
+
+    allocator.free(second);
+}
+
+TEST_F(LazyCarvingAllocatorTest, RandomAllocationsStressTest)
+{
+    randomAllocationsStress(allocator, 64_KB);
+    randomAllocationsStress(allocator, 2_MB);
+}
+
+TEST_F(LazyCarvingAllocatorTest, AlignedAndTLSFChurn)
+{
+    allocator.destroy();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<size_t> size_dist(5_KB, 300_KB);
+    std::vector<void*> blocks;
+    for (int i = 0; i < 50000; ++i) {
+        void* block = (i % 3 == 0) ? allocator.allocAligned(size_dist(gen), 4_KB) : allocator.alloc(size_dist(gen));
+        ASSERT_NE(block, nullptr);
+        memset(block, 0x7E, 5_KB);
+        blocks.push_back(block);
+
+        if (blocks.size() > 64) {
+            size_t idx = gen() % blocks.size();
+            allocator.free(blocks[idx]);
+            blocks[idx] = blocks.back();
+            blocks.pop_back();
+        }
+    }
+    for (void* block : blocks) {
+        allocator.free(block);
+    }
+}
+
+// Carving the over-allocation of an aligned block leaves the aligned one below top, the next carve must see its size
+TEST_F(LazyCarvingAllocatorTest, AlignedChurnKeepsTheHeapIntact)
+{
+    allocator.destroy();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true});
+
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<size_t> size_dist(1, 20000);
+    std::vector<std::pair<unsigned char*, size_t>> slots(4096);
+    for (int i = 0; i < 200000; ++i) {
+        auto& [block, size] = slots[gen() % slots.size()];
+        if (block) {
+            ASSERT_EQ(block[size - 1], static_cast<unsigned char>(size)) << "at " << i;
+            allocator.free(block);
+        }
+        size  = size_dist(gen);
+        block = static_cast<unsigned char*>(allocator.allocAligned(size, 16));
+        ASSERT_NE(block, nullptr);
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % 16, 0u);
+        memset(block, static_cast<unsigned char>(size), size);
+    }
+    for (auto& [block, size] : slots) {
+        allocator.free(block);
+    }
+}
+
+// The same churn with min_alignment, which aligns every coalesce allocation
+TEST_F(LazyCarvingAllocatorTest, MinAlignmentChurnKeepsTheHeapIntact)
+{
+    allocator.destroy();
+    allocator.init({.engine = CoalesceEngine::TLSF, .lazy_carving = true, .min_alignment = 16});
+
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<size_t> size_dist(1, 20000);
+    std::vector<std::pair<unsigned char*, size_t>> slots(4096);
+    for (int i = 0; i < 200000; ++i) {
+        auto& [block, size] = slots[gen() % slots.size()];
+        if (block) {
+            ASSERT_EQ(block[size - 1], static_cast<unsigned char>(size)) << "at " << i;
+            allocator.free(block);
+        }
+        size  = size_dist(gen);
+        block = static_cast<unsigned char*>(allocator.alloc(size));
+        ASSERT_NE(block, nullptr);
+        if (size > 8) {
+            ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % 16, 0u);
+        }
+        memset(block, static_cast<unsigned char>(size), size);
+    }
+    for (auto& [block, size] : slots) {
+        allocator.free(block);
     }
 }
 } // namespace test
@@ -1,13 +1,34 @@
 #include "allocator.hpp"
+#include "allocator_trace.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
 
 #include "memory.hpp"
@@ -16,20 +37,79 @@ namespace jd::memory
 {
 static constexpr size_t ALIGNMENT             = 8;
 static constexpr size_t PAGE_SIZE             = 4_KB;
+static constexpr size_t HUGE_PAGE_SIZE        = 2_MB;
 static constexpr size_t LARGE_ALLOC_THRESHOLD = 10_MB;
+static constexpr size_t MAX_ALLOC_SIZE        = PTRDIFF_MAX; // bigger requests fail before any size is aligned
 
 static constexpr size_t SMALL_REGION_MAX  = 10_KB;
 static constexpr size_t MEDIUM_REGION_MAX = 1_MB;
 
 static constexpr size_t REGION_SIZE                = 32_MB;
-static constexpr size_t MAX_REGIONS                = 16;
+static constexpr size_t DEFAULT_MAX_REGIONS        = 16;
+static constexpr size_t REGION_SHIFT               = std::countr_zero(REGION_SIZE);
 static constexpr size_t REGION_COUNT_BY_TYPE       = 3;
 static constexpr size_t FSA_ARENA_SIZE             = 24_MB;
-static constexpr size_t METADATA_SIZE              = 64_MB;
-static constexpr size_t TOTAL_VIRTUAL_MEMORY       = MAX_REGIONS * REGION_SIZE + FSA_ARENA_SIZE + METADATA_SIZE + PAGE_SIZE * 2;
-static constexpr size_t FSA_SIZES_COUNT            = 6;
-static constexpr size_t FSA_SIZES[FSA_SIZES_COUNT] = {16, 32, 64, 128, 256, 512};
+static constexpr size_t METADATA_SIZE              = 64_KB;
+static constexpr size_t FSA_SLAB_SIZE              = 16 * PAGE_SIZE;
+static constexpr size_t FSA_SLAB_SHIFT             = std::countr_zero(FSA_SLAB_SIZE);
+static constexpr size_t FSA_SIZES_COUNT            = 32;
+static constexpr size_t FSA_MAX_SIZE               = 4_KB;
 static constexpr size_t COALESCE_LISTS_COUNT       = 3;
+static constexpr size_t TLSF_SL_LOG2               = 4;
+static constexpr size_t TLSF_SL_COUNT              = 1 << TLSF_SL_LOG2;
+static constexpr size_t TLSF_FL_COUNT              = 32;
+static constexpr size_t PURGE_MIN_SIZE             = 16_KB;
+static constexpr size_t DECAY_TICKS_PER_PERIOD     = 4;
+static constexpr size_t LARGE_HEADER_OFFSET        = 64;
+static constexpr size_t LARGE_TABLE_MIN_SIZE       = PAGE_SIZE / sizeof(void*);
+static constexpr size_t LARGE_CACHE_SLOTS          = 8;
+static constexpr size_t LARGE_CACHE_MAX_BYTES      = 128_MB;
+static constexpr size_t MAX_ARENAS                 = 8;
+static constexpr size_t DEFAULT_MAX_ARENAS         = 4;
+static constexpr size_t TCACHE_BIN_BYTES           = 32_KB;
+static constexpr size_t TCACHE_MIN_CAPACITY        = 8;
+static constexpr size_t TCACHE_MAX_CAPACITY        = 64;
+// Statistics buckets: one per FSA size class, then the coalesce and the large path
+static constexpr size_t COALESCE_BUCKET            = FSA_SIZES_COUNT;
+static constexpr size_t LARGE_BUCKET               = FSA_SIZES_COUNT + 1;
+static constexpr size_t STATS_BUCKETS_COUNT        = FSA_SIZES_COUNT + 2;
+static constexpr int64_t STATS_PUBLISH_BYTES       = 256_KB;
+static constexpr size_t STATS_PUBLISH_PERIOD       = 64; // allocations of a size class between two peak updates
+static constexpr size_t PROFILE_MAX_DEPTH          = 32;
+static constexpr size_t PROFILE_SKIP_FRAMES        = 1; // the capture itself, the entry points may reach it by a tail call
+static constexpr size_t PROFILE_TABLE_BITS         = 16;
+static constexpr size_t PROFILE_TABLE_SIZE         = size_t{1} << PROFILE_TABLE_BITS;
+static constexpr size_t PROFILE_MAX_SAMPLES        = PROFILE_TABLE_SIZE / 4 * 3;
+static constexpr size_t TRACE_BUFFER_SIZE          = 64_KB;
+static constexpr size_t TRACE_MAX_EVENT_BYTES      = 64; // the op byte and up to six 10-byte varints
+
+// 8-byte steps up to 64, then four classes per power of two: 80, 96, 112, 128, 160, ..., 3584, 4096
+static constexpr auto FSA_SIZES = [] {
+    std::array<size_t, FSA_SIZES_COUNT> sizes{};
+    size_t count = 0;
+    for (size_t size = ALIGNMENT; size <= 64; size += ALIGNMENT) {
+        sizes[count++] = size;
+    }
+    for (size_t group = 64; group < FSA_MAX_SIZE; group *= 2) {
+        for (size_t step = 1; step <= 4; ++step) {
+            sizes[count++] = group + step * group / 4;
+        }
+    }
+    return sizes;
+}();
+
+// Size class of every multiple of 8 up to FSA_MAX_SIZE, indexed by (size + 7) >> 3
+static constexpr auto FSA_SIZE_CLASSES = [] {
+    std::array<uint8_t, (FSA_MAX_SIZE >> 3) + 1> classes{};
+    size_t size_class = 0;
+    for (size_t i = 0; i < classes.size(); ++i) {
+        while (FSA_SIZES[size_class] < (i << 3)) {
+            ++size_class;
+        }
+        classes[i] = static_cast<uint8_t>(size_class);
+    }
+    return classes;
+}();
 
 struct free_list_t {
     free_list_t* next;
@@ -40,8 +120,13 @@ enum class RegionType : uint8_t { SMALL = 0, MEDIUM, LARGE };
 struct alignas(ALIGNMENT) region_t {
     char* start;
     char* end;
+    // Blocks only exist below top, the wilderness above it is carved on demand. Eagerly split regions have top == end
+    char* top;
+    char* dirty_top;      // highest address ever carved, the wilderness above it was never written
+    size_t top_prev_size; // size of the block right below top, 0 when there is none
     bool is_used;
     RegionType region_type;
+    uint8_t arena_index;
 };
 
 struct free_node_t;
@@ -51,6 +136,12 @@ struct alignas(ALIGNMENT) block_t {
     size_t prev_size;
     free_node_t* free_node{nullptr};
     bool is_free;
+    // the payload past the free-list node was never written since the region was mapped
+    bool is_zeroed{false};
+    // the page-aligned interior was given back to the OS and has not been written since
+    bool is_purged{false};
+    bool is_sampled{false}; // the heap profiler tracks the block
+    uint32_t freed_at{};    // decay tick the block became free at
 };
 
 struct alignas(ALIGNMENT) free_node_t {
@@ -60,15 +151,205 @@ struct alignas(ALIGNMENT) free_node_t {
     size_t list_index{};
 };
 
+struct tlsf_index_t {
+    size_t fl;
+    size_t sl;
+};
+
+static constexpr uint8_t NO_SIZE_CLASS    = UINT8_MAX;
+static constexpr uint8_t WHOLE_SLAB_CLASS = UINT8_MAX - 1; // handed out by allocSlab() to carve blocks of its own
+
+// Blocks other threads freed to the owner of their slab, a lock-free stack per size class. The freeing threads
+// push with a CAS and the owner takes a whole stack with one exchange: nothing is ever popped alone, so no ABA.
+// A stack holds at most the cache capacity of its class, the frees past it go to the pool
+struct alignas(64) remote_queue_t {
+    std::atomic<free_list_t*> heads[FSA_SIZES_COUNT];
+    std::atomic<uint32_t> lengths[FSA_SIZES_COUNT]; // blocks pushed and not taken yet
+    std::atomic<bool> is_owned; // cleared when the owner exits, its blocks then stay with the freeing threads
+    remote_queue_t* next;       // every queue ever mapped, they are never unmapped
+    remote_queue_t* next_free;
+};
+
+// A run of pages of the FSA arena given to one size class on demand and handed back once it is empty
+struct slab_t {
+    free_list_t* free_list{nullptr}; // blocks freed back to the slab
+    char* bump{nullptr};             // blocks past the bump pointer have never been handed out
+    slab_t* next{nullptr};           // partial slabs of the pool, or empty slabs of the reserve
+    slab_t* prev{nullptr};
+    uint32_t used_blocks{};
+    uint32_t capacity{};
+    uint32_t released_at{}; // decay tick the slab went back to the reserve at
+    uint8_t size_class{NO_SIZE_CLASS};
+    bool is_purged{false};
+    std::atomic<remote_queue_t*> owner{nullptr}; // the thread cache that last refilled from the slab
+};
+
 // FSA pools - each pool manages blocks of fixed size
-struct FSAPool {
+struct alignas(64) FSAPool {
     size_t block_size{};
-    free_list_t* free_list{nullptr};
-    char* memory_pool{nullptr};
-    size_t pool_size{};
-    size_t used_blocks{};
+    size_t size_class{};
+    slab_t* partial_slabs{nullptr}; // slabs with at least one free block
+    size_t slabs_count{};
+    size_t used_blocks{}; // blocks handed out of the pool, including those parked in thread caches
+    // requested against handed out bytes measure the internal fragmentation of the class
+    size_t allocations{};
+    size_t requested_bytes{};
+    // live blocks of a single-threaded heap already added to the peak tracking, a thread-safe one counts in the thread caches
+    size_t published_blocks{};
+    std::mutex mutex;
+};
+
+// Written only by the owning thread and read by snapshots from any thread: a relaxed load and store, never a locked add
+struct stat_counter_t {
+    std::atomic<size_t> value;
+
+    size_t add(size_t n) noexcept
+    {
+        size_t result = value.load(std::memory_order_relaxed) + n;
+        value.store(result, std::memory_order_relaxed);
+        return result;
+    }
+
+    size_t sub(size_t n) noexcept
+    {
+        size_t result = value.load(std::memory_order_relaxed) - n;
+        value.store(result, std::memory_order_relaxed);
+        return result;
+    }
+
+    void store(size_t n) noexcept
+    {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] size_t load() const noexcept
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Per-thread cache of free FSA blocks, one bin for every size class
+struct tcache_bin_t {
+    free_list_t* head;
+    stat_counter_t count;
+    // The statistics of the class on this thread: they share the line the fast path writes anyway and are never reset.
+    // Only allocations are counted per call, the frees follow from count and traded (see binFrees()).
+    // The pool takes the allocations past folded_allocations whenever the bin trades blocks with it
+    stat_counter_t allocations;
+    stat_counter_t traded; // blocks sent to the pool or other threads minus blocks taken in, wraps
+    size_t folded_allocations;
+    size_t requested_bytes; // since the last fold
+};
+
+struct thread_cache_t {
+    tcache_bin_t bins[FSA_SIZES_COUNT];
+    uint64_t epoch;
+    size_t arena_index;
+    remote_queue_t* remote; // nullptr when remote frees are off
+};
+
+struct stat_bucket_t {
+    stat_counter_t allocations;
+    stat_counter_t frees;
+    stat_counter_t allocated_bytes;
+    stat_counter_t freed_bytes;
+};
+
+struct stat_totals_t {
+    size_t allocations;
+    size_t frees;
+    size_t allocated_bytes;
+    size_t freed_bytes;
+};
+
+// Counters of one thread, linked into a registry so that a snapshot can merge them.
+// A thread freeing blocks of another one drives its own live bytes below zero, only the sum is meaningful
+struct thread_stats_t {
+    stat_bucket_t buckets[STATS_BUCKETS_COUNT - COALESCE_BUCKET]; // the coalesce and the large path
+    const tcache_bin_t* bins; // the size classes, counted in the thread cache
+    size_t published_blocks[FSA_SIZES_COUNT];
+    int64_t unpublished_bytes; // live bytes change not yet added to the process-wide peak tracking
+    uint64_t epoch;
+    bool is_linked;
+    thread_stats_t* prev;
+    thread_stats_t* next;
+};
+
+// Sits right in front of the user pointer of every direct mapping of the large path.
+// Read only once g_large_table knows the pointer: the memory in front of a foreign one may not even be mapped
+struct large_header_t {
+    char* map_start;
+    size_t map_size;
+    size_t size; // aligned requested bytes
+    bool is_sampled;
+};
+
+// A live sampled block and the call stack that allocated it
+struct heap_sample_t {
+    void* ptr; // nullptr marks an empty slot
+    size_t size;
+    size_t depth;
+    void* frames[PROFILE_MAX_DEPTH];
+};
+
+// Per-thread countdown to the next sampled allocation
+struct sampler_t {
+    int64_t bytes_until_sample;
+    uint64_t rng;
+    uint64_t epoch;
+    bool is_sampling; // the stack capture may allocate itself, those requests are never sampled
+};
+
+// Events of one thread not written to the trace yet. Mapped outside the heap on the first event of the thread,
+// the chunk header and the events are contiguous so a chunk goes out with a single write
+struct trace_buffer_t {
+    trace_buffer_t* prev;
+    trace_buffer_t* next;
+    uint64_t last_sequence;
+    uint64_t last_time_ns;
+    uint64_t last_ptr;
+    TraceChunkHeader header;
+    uint8_t events[TRACE_BUFFER_SIZE];
+};
+
+struct tracer_t {
+    trace_buffer_t* buffer;
+    uint64_t epoch;
+    bool is_inside; // an entry point is running: the calls it makes and the allocations of the tracer are not events
+};
+
+// A direct mapping kept after its block was freed, so the next large request skips mmap and the page faults
+struct large_span_t {
+    char* start;
+    size_t size;
+    uint32_t cached_at; // decay tick
+};
+
+// Independent coalesce heap: a thread allocates from its own arena, a block is always freed to the arena owning its region
+struct alignas(64) arena_t {
+    free_node_t* free_lists[COALESCE_LISTS_COUNT];
+    // TLSF engine: the first level splits sizes by powers of two, the second one linearly inside them
+    uint32_t tlsf_fl_bitmap;
+    uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+    free_node_t* tlsf_bins[TLSF_FL_COUNT * TLSF_SL_COUNT];
+    // lazy carving: the region of every type whose wilderness new blocks are carved from
+    region_t* top_regions[REGION_COUNT_BY_TYPE];
+    uint32_t next_decay_tick;
+    size_t index;
+    std::mutex mutex;
 };
 
+// Free-list links live inside the payload of the free block, so every block must be able to hold them
+static constexpr size_t MIN_BLOCK_SIZE = sizeof(block_t) + sizeof(free_node_t);
+
+static_assert(FSA_SIZES.back() == FSA_MAX_SIZE, "the last size class must end the FSA range");
+static_assert(FSA_SIZES_COUNT < WHOLE_SLAB_CLASS, "size classes must fit the slab table");
+static_assert(MemoryAllocator::SLAB_SIZE == FSA_SLAB_SIZE, "the public slab size must match the FSA slabs");
+static_assert(FSA_SIZES[0] >= sizeof(free_list_t), "the smallest FSA block must hold a free-list link");
+static_assert(std::has_single_bit(REGION_SIZE), "region lookup by address needs a power of two region size");
+static_assert(FSA_ARENA_SIZE % HUGE_PAGE_SIZE == 0 && REGION_SIZE % HUGE_PAGE_SIZE == 0, "huge pages must tile the FSA arena and the regions");
+static_assert(HUGE_PAGE_SIZE % FSA_SLAB_SIZE == 0, "huge page alignment must keep the slabs aligned");
+static_assert(sizeof(large_header_t) <= LARGE_HEADER_OFFSET, "large header must fit in front of the user pointer");
 static_assert(sizeof(free_list_t) % ALIGNMENT == 0, "free_list_t not aligned");
 static_assert(alignof(free_list_t) == ALIGNMENT, "free_list_t alignment wrong");
 static_assert(sizeof(region_t) % ALIGNMENT == 0, "region_t not aligned");
@@ -79,37 +360,317 @@ static_assert(sizeof(free_node_t) % ALIGNMENT == 0, "free_node_t not aligned");
 static_assert(alignof(free_node_t) == ALIGNMENT, "free_node_t alignment wrong");
 
 static char* g_virtual_memory         = nullptr;
+static size_t g_total_virtual_memory  = 0;
 static char* g_fsa_arena_start        = nullptr;
 static char* g_fsa_arena_end          = nullptr;
+// The FSA arena is a shared reserve of slabs, every slab carries its size class in this table
+static slab_t* g_slabs                = nullptr;
+static slab_t* g_free_slabs           = nullptr;
+static size_t g_slabs_count           = 0;
+static size_t g_slabs_carved          = 0;
+static std::mutex g_slabs_mutex;
 static region_t* g_regions            = nullptr;
-static free_node_t* g_free_nodes_pool = nullptr;
-static free_node_t** g_free_lists     = nullptr;
-static size_t g_free_nodes_used       = 0;
-static size_t g_current_offset        = 0;
-static size_t g_max_free_nodes        = 0;
+static size_t g_max_regions           = DEFAULT_MAX_REGIONS;
+// Region i always starts at g_regions_base + i * REGION_SIZE, so a pointer maps to its region in O(1).
+// The slots are reserved PROT_NONE up front and committed one region at a time
+static char* g_regions_base = nullptr;
+// Regions are handed out in slot order and never given back, so slots below the count are immutable
+static std::atomic<size_t> g_regions_count{0};
+static std::mutex g_regions_mutex;
 FSAPool g_fsa_pools[FSA_SIZES_COUNT];
+arena_t g_arenas[MAX_ARENAS];
+static size_t g_arenas_count = 1;
+static std::atomic<size_t> g_next_arena{0};
+
+// Purging: free memory idle for g_decay_ms goes back to the OS, 0 purges on free, negative never
+static int64_t g_decay_ms               = -1;
+static bool g_lazy_purge                = false;
+static uint32_t g_slabs_next_decay_tick = 0;
+static std::chrono::steady_clock::time_point g_decay_clock_base;
+static std::atomic<size_t> g_purged_bytes{0};
+static std::atomic<size_t> g_purge_calls{0};
+
+static HugePages g_huge_pages = HugePages::None;
+
+static large_span_t g_large_cache[LARGE_CACHE_SLOTS];
+static size_t g_large_cache_count = 0;
+static size_t g_large_cache_bytes = 0;
+static std::mutex g_large_mutex;
+// User pointers of the live direct mappings: open addressing in a table mapped outside the heap, doubled at 3/4 full
+static void** g_large_table       = nullptr;
+static size_t g_large_table_size  = 0;
+static size_t g_large_table_count = 0;
+
+static bool g_thread_safe      = false;
+static CoalesceEngine g_engine = CoalesceEngine::SegregatedLists;
+static bool g_lazy_carving     = false;
+static size_t g_min_alignment  = ALIGNMENT;
+// Bumped on every init()/destroy(): blocks cached by a thread for another epoch are stale
+static std::atomic<uint64_t> g_epoch{0};
+static pthread_key_t g_tcache_key;
+static pthread_once_t g_tcache_key_once = PTHREAD_ONCE_INIT;
+// Trivially constructible, so the fast path pays no TLS guard and no malloc on first touch
+static constinit thread_local thread_cache_t t_cache{};
+// Remote frees: queues are mapped a page at a time and recycled for new threads
+static bool g_remote_frees                  = true;
+static std::mutex g_remote_mutex;
+static remote_queue_t* g_remote_queues      = nullptr;
+static remote_queue_t* g_free_remote_queues = nullptr;
+
+// Always-on statistics: counters of the live threads, folded ones of the exited threads and the totals at init()
+static std::mutex g_stats_mutex;
+static thread_stats_t* g_stats_threads = nullptr;
+static stat_totals_t g_stats_retired[STATS_BUCKETS_COUNT];
+static stat_totals_t g_stats_base[STATS_BUCKETS_COUNT];
+// The peak is tracked over the live bytes the threads publish in STATS_PUBLISH_BYTES steps
+static std::atomic<int64_t> g_published_live_bytes{0};
+static std::atomic<size_t> g_peak_live_bytes{0};
+static pthread_key_t g_stats_key;
+static pthread_once_t g_stats_key_once = PTHREAD_ONCE_INIT;
+static constinit thread_local thread_stats_t t_stats{};
+
+// Heap profiler: the live sampled blocks sit in an open-addressing table mapped outside the heap
+static size_t g_sample_interval     = 0;
+static heap_sample_t* g_samples     = nullptr;
+static size_t g_samples_count       = 0;
+static std::mutex g_profile_mutex;
+static const char* g_profile_prefix = nullptr;
+static int g_profile_signal         = 0;
+static struct sigaction g_previous_profile_action;
+static std::atomic<size_t> g_profile_dumps{0};
+static constinit thread_local sampler_t t_sampler{};
+
+// Allocation trace
+static int g_trace_fd                      = -1;
+static trace_buffer_t* g_trace_buffers     = nullptr;
+static std::mutex g_trace_mutex;
+static std::atomic<uint64_t> g_trace_sequence{0};
+static std::atomic<uint32_t> g_trace_threads{0};
+static std::chrono::steady_clock::time_point g_trace_clock_base;
+static pthread_key_t g_trace_key;
+static pthread_once_t g_trace_key_once = PTHREAD_ONCE_INIT;
+static constinit thread_local tracer_t t_tracer{};
+
+[[nodiscard]] inline std::unique_lock<std::mutex> lockShared(std::mutex& mutex)
+{
+    return g_thread_safe ? std::unique_lock<std::mutex>{mutex} : std::unique_lock<std::mutex>{};
+}
 
 inline constexpr size_t alignSize(size_t size) noexcept
 {
     return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
+inline constexpr size_t alignTo(size_t size, size_t alignment) noexcept
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
 inline constexpr size_t alignToPage(size_t size) noexcept
 {
     return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 }
 
+void publishLiveBytes(int64_t delta) noexcept
+{
+    int64_t live = g_published_live_bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+    size_t peak  = g_peak_live_bytes.load(std::memory_order_relaxed);
+    while (live > 0 && static_cast<size_t>(live) > peak && !g_peak_live_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+void publishLiveBytes(thread_stats_t& stats) noexcept
+{
+    publishLiveBytes(stats.unpublished_bytes);
+    stats.unpublished_bytes = 0;
+}
+
+// A size class publishes the blocks it gained or lost since the last time, the counters may wrap on a remote free
+void publishClassLive(size_t size_class, size_t allocations, size_t frees, size_t& published_blocks) noexcept
+{
+    size_t live_blocks = allocations - frees;
+    publishLiveBytes(static_cast<int64_t>(live_blocks - published_blocks) * static_cast<int64_t>(FSA_SIZES[size_class]));
+    published_blocks = live_blocks;
+}
+
+// A block freed by the thread either still sits in its bin or was traded away, so the free path counts nothing.
+// The owner always applies the decrement first, so a snapshot racing it sees too few frees rather than too many
+[[nodiscard]] inline size_t binFrees(const tcache_bin_t& bin) noexcept
+{
+    return bin.allocations.load() + bin.count.load() + bin.traded.load();
+}
+
+// The size classes of a thread-safe heap publish whenever a bin trades with its pool,
+// the live bytes in between move by no more than a bin holds
+inline void publishBinLive(size_t size_class, const tcache_bin_t& bin) noexcept
+{
+    publishClassLive(size_class, bin.allocations.load(), binFrees(bin), t_stats.published_blocks[size_class]);
+}
+
+// Moves the counters of a thread between the registry and the retired totals, the caller holds g_stats_mutex.
+// Retiring adds them and relinking takes them back, so a thread that allocates again from a late destructor is not counted twice
+void retireThreadStats(const thread_stats_t& stats, bool retire) noexcept
+{
+    auto move = [retire](size_t& total, size_t value) {
+        total = retire ? total + value : total - value;
+    };
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        move(g_stats_retired[i].allocations, stats.bins[i].allocations.load());
+        move(g_stats_retired[i].frees, binFrees(stats.bins[i]));
+    }
+    for (size_t i = COALESCE_BUCKET; i < STATS_BUCKETS_COUNT; ++i) {
+        const stat_bucket_t& bucket = stats.buckets[i - COALESCE_BUCKET];
+        move(g_stats_retired[i].allocations, bucket.allocations.load());
+        move(g_stats_retired[i].frees, bucket.frees.load());
+        move(g_stats_retired[i].allocated_bytes, bucket.allocated_bytes.load());
+        move(g_stats_retired[i].freed_bytes, bucket.freed_bytes.load());
+    }
+}
+
+// The key destructor: the counters of an exiting thread are folded into the retired totals
+void detachThreadStats(void* data) noexcept
+{
+    thread_stats_t* stats = static_cast<thread_stats_t*>(data);
+    std::lock_guard lock{g_stats_mutex};
+    if (!stats->is_linked) {
+        return;
+    }
+
+    retireThreadStats(*stats, true);
+    if (stats->epoch == g_epoch.load(std::memory_order_relaxed)) {
+        publishLiveBytes(*stats);
+    }
+
+    if (stats->prev) {
+        stats->prev->next = stats->next;
+    } else {
+        g_stats_threads = stats->next;
+    }
+    if (stats->next) {
+        stats->next->prev = stats->prev;
+    }
+    stats->is_linked = false;
+    // a free from a later destructor of the same thread links the counters again
+    stats->epoch = 0;
+}
+
+void attachThreadStats(thread_stats_t& stats, uint64_t epoch) noexcept
+{
+    // bytes counted for a previous init() do not belong to the new peak
+    stats.unpublished_bytes = 0;
+    stats.epoch             = epoch;
+    if (stats.is_linked) {
+        return;
+    }
+
+    pthread_once(&g_stats_key_once, [] { pthread_key_create(&g_stats_key, detachThreadStats); });
+    {
+        std::lock_guard lock{g_stats_mutex};
+        stats.bins = t_cache.bins;
+        retireThreadStats(stats, false);
+        stats.prev = nullptr;
+        stats.next = g_stats_threads;
+        if (g_stats_threads) {
+            g_stats_threads->prev = &stats;
+        }
+        g_stats_threads = &stats;
+        stats.is_linked = true;
+    }
+    pthread_setspecific(g_stats_key, &stats);
+}
+
+[[nodiscard]] inline thread_stats_t& threadStats() noexcept
+{
+    thread_stats_t& stats = t_stats;
+    uint64_t epoch        = g_epoch.load(std::memory_order_relaxed);
+    if (stats.epoch != epoch) [[unlikely]] {
+        attachThreadStats(stats, epoch);
+    }
+    return stats;
+}
+
+// The coalesce and the large path count here, the size classes right in their FSA fast path
+inline void recordAlloc(size_t bucket, size_t bytes) noexcept
+{
+    thread_stats_t& stats = threadStats();
+    stat_bucket_t& counts = stats.buckets[bucket - COALESCE_BUCKET];
+    counts.allocations.add(1);
+    counts.allocated_bytes.add(bytes);
+    stats.unpublished_bytes += static_cast<int64_t>(bytes);
+    if (stats.unpublished_bytes >= STATS_PUBLISH_BYTES) [[unlikely]] {
+        publishLiveBytes(stats);
+    }
+}
+
+inline void recordFree(size_t bucket, size_t bytes) noexcept
+{
+    thread_stats_t& stats = threadStats();
+    stat_bucket_t& counts = stats.buckets[bucket - COALESCE_BUCKET];
+    counts.frees.add(1);
+    counts.freed_bytes.add(bytes);
+    stats.unpublished_bytes -= static_cast<int64_t>(bytes);
+    if (stats.unpublished_bytes <= -STATS_PUBLISH_BYTES) [[unlikely]] {
+        publishLiveBytes(stats);
+    }
+}
+
+// A block resized in place is neither a new allocation nor a free
+inline void recordResize(size_t bucket, size_t old_bytes, size_t new_bytes) noexcept
+{
+    thread_stats_t& stats = threadStats();
+    stat_bucket_t& counts = stats.buckets[bucket - COALESCE_BUCKET];
+    counts.allocated_bytes.add(new_bytes);
+    counts.freed_bytes.add(old_bytes);
+    stats.unpublished_bytes += static_cast<int64_t>(new_bytes) - static_cast<int64_t>(old_bytes);
+    if (stats.unpublished_bytes >= STATS_PUBLISH_BYTES || stats.unpublished_bytes <= -STATS_PUBLISH_BYTES) [[unlikely]] {
+        publishLiveBytes(stats);
+    }
+}
+
+// Sums the counters of every thread that ever allocated, the caller holds g_stats_mutex.
+// The bytes of the size classes are left to the caller, they follow from the counts
+void collectStats(stat_totals_t (&totals)[STATS_BUCKETS_COUNT]) noexcept
+{
+    for (size_t i = 0; i < STATS_BUCKETS_COUNT; ++i) {
+        totals[i] = g_stats_retired[i];
+    }
+    for (thread_stats_t* stats = g_stats_threads; stats; stats = stats->next) {
+        for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+            totals[i].allocations += stats->bins[i].allocations.load();
+            totals[i].frees += binFrees(stats->bins[i]);
+        }
+        for (size_t i = COALESCE_BUCKET; i < STATS_BUCKETS_COUNT; ++i) {
+            const stat_bucket_t& bucket = stats->buckets[i - COALESCE_BUCKET];
+            totals[i].allocations += bucket.allocations.load();
+            totals[i].frees += bucket.frees.load();
+            totals[i].allocated_bytes += bucket.allocated_bytes.load();
+            totals[i].freed_bytes += bucket.freed_bytes.load();
+        }
+    }
+}
+
 inline size_t getFSASizeClass(size_t size) noexcept
 {
-    if (size < 16) {
-        return 0;
-    } else if (size > 512) {
+    if (size > FSA_MAX_SIZE) {
         return FSA_SIZES_COUNT;
     }
+    return FSA_SIZE_CLASSES[(size + 7) >> 3];
+}
+
+// Slabs are aligned to their size, so every block of a class whose size is a multiple of the alignment is aligned too
+inline size_t getFSAAlignedSizeClass(size_t size, size_t alignment) noexcept
+{
+    size_t size_class = getFSASizeClass(size);
+    while (size_class < FSA_SIZES_COUNT && FSA_SIZES[size_class] % alignment != 0) {
+        ++size_class;
+    }
+    return size_class;
+}
 
-    // 17-31 → 5, 32-63 → 6, 64-127 → 7, 128-255 → 8, 256-511 → 9, 512 → 10
-    // And then minius 4
-    return std::bit_width(size - 1) - 4;
+// Big blocks are cached by fewer pieces, so a thread never parks more than a few pages per class
+inline constexpr size_t getTCacheCapacity(size_t size_class) noexcept
+{
+    return std::clamp(TCACHE_BIN_BYTES / FSA_SIZES[size_class], TCACHE_MIN_CAPACITY, TCACHE_MAX_CAPACITY);
 }
 
 inline constexpr size_t getCoalesceListIndex(size_t size) noexcept
@@ -123,6 +684,23 @@ inline constexpr size_t getCoalesceListIndex(size_t size) noexcept
     return 2;
 }
 
+inline constexpr tlsf_index_t getTLSFIndex(size_t size) noexcept
+{
+    size_t fl = std::bit_width(size) - 1;
+    size_t sl = fl < TLSF_SL_LOG2 ? size : (size >> (fl - TLSF_SL_LOG2)) & (TLSF_SL_COUNT - 1);
+    return {fl, sl};
+}
+
+// Rounds the size up to the next bin boundary, so any block of the returned bin is big enough
+inline constexpr tlsf_index_t getTLSFSearchIndex(size_t size) noexcept
+{
+    size_t fl = std::bit_width(size) - 1;
+    if (fl >= TLSF_SL_LOG2) {
+        size += (size_t{1} << (fl - TLSF_SL_LOG2)) - 1;
+    }
+    return getTLSFIndex(size);
+}
+
 inline constexpr RegionType getRegionType(size_t size) noexcept
 {
     if (size <= SMALL_REGION_MAX) {
@@ -151,13 +729,24 @@ block_t* getNextBlock(block_t* block, region_t* region) noexcept
     }
 
     char* block_end = reinterpret_cast<char*>(block) + block->current_size;
-    if (block_end >= region->end) {
+    if (block_end >= region->top) {
         return nullptr;
     }
 
     return reinterpret_cast<block_t*>(block_end);
 }
 
+// Tells the block after this one its new size, or the wilderness when this one is the last block below top
+void updateNextPrevSize(block_t* block, region_t* region) noexcept
+{
+    char* block_end = reinterpret_cast<char*>(block) + block->current_size;
+    if (block_end == region->top) {
+        region->top_prev_size = block->current_size;
+    } else if (block_end < region->top) {
+        reinterpret_cast<block_t*>(block_end)->prev_size = block->current_size;
+    }
+}
+
 inline block_t* getPrevBlock(block_t* block) noexcept
 {
     if (block->prev_size == 0) {
@@ -171,34 +760,40 @@ inline bool isBlockInRegion(block_t* block, region_t* region) noexcept
     return (reinterpret_cast<char*>(block) >= region->start && reinterpret_cast<char*>(block) < region->end);
 }
 
-[[nodiscard]] free_node_t* allocateFreeNode() noexcept
+// Visits the blocks below the wilderness in address order, the caller holds the lock of the arena owning the region
+template <typename Visitor>
+void forEachBlock(const region_t& region, Visitor&& visit) noexcept
 {
-    if (g_free_nodes_used >= g_max_free_nodes) {
-        return nullptr;
+    for (char* current = region.start; current + sizeof(block_t) <= region.top;) {
+        const block_t* block = reinterpret_cast<const block_t*>(current);
+        if (block->current_size == 0) [[unlikely]] {
+            break;
+        }
+        visit(block);
+        current += block->current_size;
     }
+}
 
-    free_node_t* node = &g_free_nodes_pool[g_free_nodes_used++];
-
-    node->next       = nullptr;
-    node->prev       = nullptr;
-    node->header     = nullptr;
-    node->list_index = 0;
-
-    return node;
+// The node is placed into the payload of the free block itself, so the metadata is bounded by the free blocks
+[[nodiscard]] free_node_t* allocateFreeNode(block_t* block) noexcept
+{
+    return ::new (getPointerFromBlock(block)) free_node_t{.header = block};
 }
 
-void removeFromFreeList(free_node_t* node) noexcept
+void removeFromFreeList(arena_t& arena, free_node_t* node) noexcept
 {
     if (!node) {
         return;
     }
 
-    size_t list_index = node->list_index;
+    size_t list_index  = node->list_index;
+    bool is_tlsf       = g_engine == CoalesceEngine::TLSF;
+    free_node_t** head = is_tlsf ? &arena.tlsf_bins[list_index] : &arena.free_lists[list_index];
 
     if (node->prev) {
         node->prev->next = node->next;
     } else {
-        g_free_lists[list_index] = node->next;
+        *head = node->next;
     }
 
     if (node->next) {
@@ -207,12 +802,20 @@ void removeFromFreeList(free_node_t* node) noexcept
 
     node->prev = node->next = nullptr;
 
+    if (is_tlsf && !*head) {
+        size_t fl = list_index / TLSF_SL_COUNT;
+        arena.tlsf_sl_bitmap[fl] &= ~(1u << (list_index % TLSF_SL_COUNT));
+        if (!arena.tlsf_sl_bitmap[fl]) {
+            arena.tlsf_fl_bitmap &= ~(1u << fl);
+        }
+    }
+
     if (node->header) {
         node->header->free_node = nullptr;
     }
 }
 
-void addToFreeList(free_node_t* node, size_t list_index) noexcept
+void addToFreeList(arena_t& arena, free_node_t* node, size_t list_index) noexcept
 {
     if (!node || !node->header) {
         return;
@@ -220,7 +823,7 @@ void addToFreeList(free_node_t* node, size_t list_index) noexcept
 
     node->list_index = list_index;
 
-    free_node_t** list   = &g_free_lists[list_index];
+    free_node_t** list   = &arena.free_lists[list_index];
     free_node_t* current = *list;
     free_node_t* prev    = nullptr;
 
@@ -245,9 +848,9 @@ void addToFreeList(free_node_t* node, size_t list_index) noexcept
     node->header->free_node = node;
 }
 
-block_t* bestFitApproach(size_t size, size_t list_index) noexcept
+block_t* bestFitApproach(arena_t& arena, size_t size, size_t list_index) noexcept
 {
-    free_node_t* current  = g_free_lists[list_index];
+    free_node_t* current  = arena.free_lists[list_index];
     free_node_t* best_fit = nullptr;
 
     while (current) {
@@ -262,27 +865,87 @@ block_t* bestFitApproach(size_t size, size_t list_index) noexcept
     return best_fit ? best_fit->header : nullptr;
 }
 
-region_t* findRegionForBlock(block_t* block) noexcept
+void insertTLSF(arena_t& arena, free_node_t* node) noexcept
 {
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
-        if (g_regions[i].is_used && isBlockInRegion(block, &g_regions[i])) {
-            return &g_regions[i];
-        }
+    auto [fl, sl] = getTLSFIndex(node->header->current_size);
+    assert(fl < TLSF_FL_COUNT && "block is too big for TLSF bins");
+
+    size_t bin       = fl * TLSF_SL_COUNT + sl;
+    node->list_index = bin;
+    node->prev       = nullptr;
+    node->next       = arena.tlsf_bins[bin];
+    if (node->next) {
+        node->next->prev = node;
     }
-    return nullptr;
+
+    arena.tlsf_bins[bin] = node;
+    arena.tlsf_fl_bitmap |= 1u << fl;
+    arena.tlsf_sl_bitmap[fl] |= 1u << sl;
+    node->header->free_node = node;
 }
 
-region_t* findRegionForPointer(void* ptr) noexcept
+block_t* findFitTLSF(arena_t& arena, size_t size) noexcept
 {
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
-        if (g_regions[i].is_used && ptr >= g_regions[i].start && ptr < g_regions[i].end) {
-            return &g_regions[i];
+    auto [fl, sl] = getTLSFSearchIndex(size);
+    if (fl >= TLSF_FL_COUNT) [[unlikely]] {
+        return nullptr;
+    }
+
+    uint32_t sl_map = arena.tlsf_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl + 1 < TLSF_FL_COUNT ? arena.tlsf_fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) {
+            return nullptr;
         }
+        fl     = std::countr_zero(fl_map);
+        sl_map = arena.tlsf_sl_bitmap[fl];
     }
-    return nullptr;
+    sl = std::countr_zero(sl_map);
+
+    return arena.tlsf_bins[fl * TLSF_SL_COUNT + sl]->header;
+}
+
+void indexFreeBlock(arena_t& arena, free_node_t* node) noexcept
+{
+    if (g_engine == CoalesceEngine::TLSF) {
+        insertTLSF(arena, node);
+        return;
+    }
+
+    size_t user_size = node->header->current_size - sizeof(block_t);
+    addToFreeList(arena, node, getCoalesceListIndex(user_size));
+}
+
+block_t* findFreeBlock(arena_t& arena, size_t size, size_t list_index) noexcept
+{
+    if (g_engine == CoalesceEngine::TLSF) {
+        return findFitTLSF(arena, size);
+    }
+
+    block_t* best_fit = bestFitApproach(arena, size, list_index);
+    for (size_t i = list_index + 1; !best_fit && i < COALESCE_LISTS_COUNT; ++i) {
+        best_fit = bestFitApproach(arena, size, i);
+    }
+    return best_fit;
+}
+
+inline region_t* findRegionForPointer(const void* ptr) noexcept
+{
+    // pointers below the base wrap around to a huge index and fail the bound check as well
+    size_t offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(g_regions_base);
+    size_t index  = offset >> REGION_SHIFT;
+    if (index >= g_regions_count.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return &g_regions[index];
 }
 
-void mergeBlocks(block_t* first, block_t* second) noexcept
+inline region_t* findRegionForBlock(block_t* block) noexcept
+{
+    return findRegionForPointer(block);
+}
+
+void mergeBlocks(arena_t& arena, region_t* region, block_t* first, block_t* second) noexcept
 {
     if (!first || !second) {
         return;
@@ -294,44 +957,46 @@ void mergeBlocks(block_t* first, block_t* second) noexcept
     }
 
     first->current_size += second->current_size;
+    first->is_zeroed = false; // the header of the second block is left inside the payload
+    first->is_purged = false;
 
-    region_t* region = findRegionForBlock(first);
-    if (region) {
-        block_t* next = getNextBlock(first, region);
-        if (next) {
-            next->prev_size = first->current_size;
-        }
-    }
+    updateNextPrevSize(first, region);
 
     second->current_size = 0;
     second->prev_size    = 0;
     second->is_free      = false;
     if (second->free_node) {
-        removeFromFreeList(second->free_node);
+        removeFromFreeList(arena, second->free_node);
         second->free_node = nullptr;
     }
 }
 
-[[nodiscard]] region_t* allocateRegionByType(RegionType region_type) noexcept
+[[nodiscard]] region_t* allocateRegionByType(arena_t& arena, RegionType region_type) noexcept
 {
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
-        if (g_regions[i].is_used) {
-            continue;
-        }
-        static constexpr size_t usable_size = TOTAL_VIRTUAL_MEMORY - PAGE_SIZE * 2;
-        if (g_current_offset + REGION_SIZE > usable_size) {
-            return nullptr;
-        }
+    auto lock = lockShared(g_regions_mutex);
 
-        g_regions[i].start       = g_virtual_memory + PAGE_SIZE + g_current_offset;
-        g_regions[i].end         = g_regions[i].start + REGION_SIZE;
-        g_regions[i].is_used     = true;
-        g_regions[i].region_type = region_type;
+    size_t i = g_regions_count.load(std::memory_order_relaxed);
+    if (i >= g_max_regions) {
+        return nullptr;
+    }
 
-        g_current_offset += REGION_SIZE;
-        return &g_regions[i];
+    char* start = g_regions_base + (i << REGION_SHIFT);
+    // hugetlb mappings are committed as a whole at init
+    if (g_huge_pages != HugePages::Explicit && mprotect(start, REGION_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return nullptr;
     }
-    return nullptr;
+
+    g_regions[i].start         = start;
+    g_regions[i].end           = start + REGION_SIZE;
+    g_regions[i].top           = g_regions[i].end;
+    g_regions[i].dirty_top     = g_regions[i].end;
+    g_regions[i].top_prev_size = 0;
+    g_regions[i].is_used       = true;
+    g_regions[i].region_type   = region_type;
+    g_regions[i].arena_index   = static_cast<uint8_t>(arena.index);
+
+    g_regions_count.store(i + 1, std::memory_order_release);
+    return &g_regions[i];
 }
 
 inline constexpr size_t getOptimalSplitSize(RegionType region_type, size_t remaining) noexcept
@@ -359,14 +1024,52 @@ inline constexpr size_t getOptimalSplitSize(RegionType region_type, size_t remai
     }
 }
 
-void initializeRegion(region_t* region) noexcept
+// The wilderness left in a region that stops being carved from becomes an ordinary free block
+void retireTopRegion(arena_t& arena, RegionType region_type) noexcept
+{
+    region_t*& top_region = arena.top_regions[static_cast<size_t>(region_type)];
+    region_t* region      = top_region;
+    top_region            = nullptr;
+    if (!region) {
+        return;
+    }
+
+    size_t remaining = region->end - region->top;
+    if (remaining < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    block_t* block      = ::new (region->top) block_t{};
+    block->current_size = remaining;
+    block->prev_size    = region->top_prev_size;
+    block->is_free      = true;
+    block->is_zeroed    = region->top >= region->dirty_top;
+
+    region->top           = region->end;
+    region->dirty_top     = region->end;
+    region->top_prev_size = remaining;
+    indexFreeBlock(arena, allocateFreeNode(block));
+}
+
+void initializeRegion(arena_t& arena, region_t* region) noexcept
 {
     if (!region) [[unlikely]] {
         return;
     }
 
     RegionType region_type = region->region_type;
-    char* current          = region->start;
+
+    // lazy carving leaves the whole region to the wilderness, no block exists until one is asked for
+    if (g_lazy_carving) {
+        retireTopRegion(arena, region_type);
+        region->top                                         = region->start;
+        region->dirty_top                                   = region->start;
+        region->top_prev_size                               = 0;
+        arena.top_regions[static_cast<size_t>(region_type)] = region;
+        return;
+    }
+
+    char* current = region->start;
 
     uintptr_t addr = reinterpret_cast<uintptr_t>(current);
     if (addr & (ALIGNMENT - 1)) {
@@ -377,35 +1080,24 @@ void initializeRegion(region_t* region) noexcept
     size_t remaining       = region->end - current;
     size_t prev_block_size = 0;
 
-    auto allocateBlock = +[](char* memory, size_t block_size, size_t prev_block_size) noexcept {
+    auto allocateBlock = [&arena](char* memory, size_t block_size, size_t prev_block_size) noexcept {
         block_t* block      = ::new (memory) block_t{};
         block->current_size = block_size;
         block->prev_size    = prev_block_size;
         block->is_free      = true;
+        block->is_zeroed    = true;
 
-        free_node_t* node = allocateFreeNode();
-        if (!node) {
-            return false;
-        }
-
-        node->header      = block;
-        size_t user_size  = block_size - sizeof(block_t);
-        size_t list_index = getCoalesceListIndex(user_size);
-        addToFreeList(node, list_index);
-
-        return true;
+        indexFreeBlock(arena, allocateFreeNode(block));
     };
 
-    while (remaining > sizeof(block_t) + ALIGNMENT) {
+    while (remaining > MIN_BLOCK_SIZE) {
         size_t target_block_size = getOptimalSplitSize(region_type, remaining);
         size_t block_size        = (target_block_size <= remaining) ? target_block_size : alignSize(remaining);
 
-        if (block_size < sizeof(block_t) + ALIGNMENT) {
-            break;
-        }
-        if (!allocateBlock(current, block_size, prev_block_size)) {
+        if (block_size < MIN_BLOCK_SIZE) {
             break;
         }
+        allocateBlock(current, block_size, prev_block_size);
 
         prev_block_size = block_size;
         current += block_size;
@@ -413,102 +1105,236 @@ void initializeRegion(region_t* region) noexcept
 
         // added all remaining size to the last node
         if (region_type == RegionType::LARGE && prev_block_size >= alignSize(5_MB + sizeof(block_t))) {
-            if (remaining < alignSize(5_MB + sizeof(block_t)) && remaining >= sizeof(block_t) + ALIGNMENT) {
-                size_t last_block_size = alignSize(remaining);
-                if (!allocateBlock(current, last_block_size, prev_block_size)) {
-                    std::cerr << "WARNING: allocation has failed for LARGE region at ptr=" << static_cast<void*>(current) << " with size=" << last_block_size
-                              << std::endl;
-                }
+            if (remaining < alignSize(5_MB + sizeof(block_t)) && remaining >= MIN_BLOCK_SIZE) {
+                allocateBlock(current, alignSize(remaining), prev_block_size);
+                remaining = 0;
                 break;
             }
         }
     }
 
-    if (remaining >= sizeof(block_t) + ALIGNMENT) {
-        size_t block_size = alignSize(remaining);
-        if (!allocateBlock(current, block_size, prev_block_size)) {
-            std::cerr << "WARNING: allocation has failed at ptr=" << static_cast<void*>(current) << " with size=" << block_size << std::endl;
-        }
+    if (remaining >= MIN_BLOCK_SIZE) {
+        allocateBlock(current, alignSize(remaining), prev_block_size);
     }
 }
 
-bool isPointerInCoalesceRegion(void* ptr) noexcept
+// Milliseconds since init(), wrapping around; ticks are only ever compared by their difference
+inline uint32_t decayTick() noexcept
 {
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
-        if (g_regions[i].is_used && ptr >= g_regions[i].start && ptr < g_regions[i].end) {
-            return true;
-        }
-    }
-    return false;
+    auto elapsed = std::chrono::steady_clock::now() - g_decay_clock_base;
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
 }
 
-[[nodiscard]] block_t* tryToSplitCoalesce(block_t* best_fit, size_t total_size, size_t aligned_new_size, size_t remaining) noexcept
+inline bool isDecayed(uint32_t since, uint32_t now) noexcept
 {
-    if (aligned_new_size < sizeof(block_t) + ALIGNMENT) {
-        return best_fit;
-    }
-    if (g_free_nodes_used >= g_max_free_nodes) {
-        return best_fit;
-    }
-
-    best_fit->current_size = total_size + (remaining - aligned_new_size);
-
-    char* new_block_addr = reinterpret_cast<char*>(best_fit) + best_fit->current_size;
+    return static_cast<int64_t>(now - since) >= g_decay_ms;
+}
 
-    assert((reinterpret_cast<uintptr_t>(new_block_addr) & (ALIGNMENT - 1)) == 0);
+inline bool isTickDue(uint32_t deadline, uint32_t now) noexcept
+{
+    return static_cast<int32_t>(now - deadline) >= 0;
+}
 
-    block_t* new_block      = ::new (new_block_addr) block_t{};
-    new_block->current_size = aligned_new_size;
-    new_block->prev_size    = best_fit->current_size;
-    new_block->is_free      = true;
+inline uint32_t nextDecayTick(uint32_t now) noexcept
+{
+    return now + static_cast<uint32_t>(std::max<int64_t>(g_decay_ms / DECAY_TICKS_PER_PERIOD, 1));
+}
 
-    region_t* region = findRegionForBlock(best_fit);
-    if (region) {
-        block_t* next = getNextBlock(new_block, region);
-        if (next) {
-            next->prev_size = new_block->current_size;
-        }
+// Gives the whole pages inside [begin, end) back to the OS, their next touch faults in zeroed pages
+size_t purgeRange(char* begin, char* end) noexcept
+{
+    char* first = reinterpret_cast<char*>(alignToPage(reinterpret_cast<uintptr_t>(begin)));
+    char* last  = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(end) & ~(PAGE_SIZE - 1));
+    if (last <= first) {
+        return 0;
     }
 
-    free_node_t* new_node = allocateFreeNode();
-    if (new_node) {
-        new_node->header      = new_block;
-        size_t user_size      = new_block->current_size - sizeof(block_t);
-        size_t new_list_index = getCoalesceListIndex(user_size);
-        addToFreeList(new_node, new_list_index);
+    size_t length = last - first;
+    int result    = -1;
+#ifdef MADV_FREE
+    if (g_lazy_purge) {
+        result = madvise(first, length, MADV_FREE);
+    }
+    // kernels older than 4.5 reject MADV_FREE, the eager advice always works
+    if (result != 0 && (!g_lazy_purge || errno == EINVAL))
+#endif
+    {
+        result = madvise(first, length, MADV_DONTNEED);
     }
 
-    return best_fit;
+    if (result != 0) {
+        return 0;
+    }
+    g_purged_bytes.fetch_add(length, std::memory_order_relaxed);
+    g_purge_calls.fetch_add(1, std::memory_order_relaxed);
+    return length;
 }
 
-[[nodiscard]] void* allocateFromCoalesce(size_t size) noexcept
+// Purges the interior of a free block behind its free-list node; untouched and small blocks are not worth a syscall
+size_t purgeFreeBlock(block_t* block) noexcept
 {
-    if (size >= LARGE_ALLOC_THRESHOLD) [[unlikely]] {
-        return nullptr;
+    if (block->is_zeroed || block->is_purged || block->current_size < PURGE_MIN_SIZE) {
+        return 0;
     }
 
-    size_t total_size      = alignSize(size + sizeof(block_t));
-    RegionType region_type = getRegionType(size);
+    char* begin = static_cast<char*>(getPointerFromBlock(block)) + sizeof(free_node_t);
+    char* end   = reinterpret_cast<char*>(block) + block->current_size;
+
+    size_t purged    = purgeRange(begin, end);
+    block->is_purged = purged != 0;
+    return purged;
+}
+
+size_t purgeArena(arena_t& arena, bool only_decayed, uint32_t now) noexcept
+{
+    size_t purged = 0;
+    auto purgeList = [&](free_node_t* node) {
+        for (; node; node = node->next) {
+            if (!only_decayed || isDecayed(node->header->freed_at, now)) {
+                purged += purgeFreeBlock(node->header);
+            }
+        }
+    };
+
+    if (g_engine == CoalesceEngine::TLSF) {
+        for (free_node_t* bin : arena.tlsf_bins) {
+            purgeList(bin);
+        }
+    } else {
+        for (free_node_t* list : arena.free_lists) {
+            purgeList(list);
+        }
+    }
+    return purged;
+}
+
+// Stamps a block that just became free and purges whatever has been idle for the decay time
+void decayFreeBlock(arena_t& arena, block_t* block) noexcept
+{
+    if (g_decay_ms < 0) {
+        return;
+    }
+
+    if (g_decay_ms == 0) {
+        purgeFreeBlock(block);
+        return;
+    }
+
+    uint32_t now    = decayTick();
+    block->freed_at = now;
+    if (isTickDue(arena.next_decay_tick, now)) {
+        arena.next_decay_tick = nextDecayTick(now);
+        purgeArena(arena, true, now);
+    }
+}
+
+// Carves an allocated block of exactly total_size off the wilderness, moving to a new region when it runs short
+[[nodiscard]] block_t* carveFromTop(arena_t& arena, RegionType region_type, size_t total_size) noexcept
+{
+    region_t* region = arena.top_regions[static_cast<size_t>(region_type)];
+    if (!region || static_cast<size_t>(region->end - region->top) < total_size) {
+        region = allocateRegionByType(arena, region_type);
+        if (!region) {
+            return nullptr;
+        }
+        initializeRegion(arena, region);
+    }
+
+    block_t* block      = ::new (region->top) block_t{};
+    block->current_size = total_size;
+    block->prev_size    = region->top_prev_size;
+    block->is_free      = false;
+    block->is_zeroed    = region->top >= region->dirty_top;
+
+    region->top += total_size;
+    region->top_prev_size = total_size;
+    region->dirty_top     = std::max(region->dirty_top, region->top);
+    return block;
+}
+
+// A free block touching the wilderness of the region being carved melts back into it instead of being indexed
+[[nodiscard]] bool releaseToTop(arena_t& arena, region_t* region, block_t* block) noexcept
+{
+    if (reinterpret_cast<char*>(block) + block->current_size != region->top || arena.top_regions[static_cast<size_t>(region->region_type)] != region) {
+        return false;
+    }
+
+    region->top           = reinterpret_cast<char*>(block);
+    region->top_prev_size = block->prev_size;
+    return true;
+}
+
+// Gives the written part of the wilderness back to the OS
+size_t purgeWilderness(region_t* region) noexcept
+{
+    if (region->dirty_top <= region->top) {
+        return 0;
+    }
+
+    size_t purged = purgeRange(region->top, region->dirty_top);
+    // lazily freed pages may keep their contents until the kernel actually reclaims them
+    if (purged && !g_lazy_purge) {
+        region->dirty_top = std::max(region->top, reinterpret_cast<char*>(alignToPage(reinterpret_cast<uintptr_t>(region->top))));
+    }
+    return purged;
+}
+
+[[nodiscard]] block_t* tryToSplitCoalesce(arena_t& arena, block_t* best_fit, size_t total_size, size_t aligned_new_size, size_t remaining) noexcept
+{
+    if (aligned_new_size < MIN_BLOCK_SIZE) {
+        return best_fit;
+    }
+
+    best_fit->current_size = total_size + (remaining - aligned_new_size);
+
+    char* new_block_addr = reinterpret_cast<char*>(best_fit) + best_fit->current_size;
+
+    assert((reinterpret_cast<uintptr_t>(new_block_addr) & (ALIGNMENT - 1)) == 0);
+
+    block_t* new_block      = ::new (new_block_addr) block_t{};
+    new_block->current_size = aligned_new_size;
+    new_block->prev_size    = best_fit->current_size;
+    new_block->is_free      = true;
+    new_block->is_zeroed    = best_fit->is_zeroed;
+    new_block->is_purged    = best_fit->is_purged;
+    new_block->freed_at     = best_fit->freed_at;
+
+    region_t* region = findRegionForBlock(best_fit);
+    if (region) {
+        updateNextPrevSize(new_block, region);
+    }
+
+    indexFreeBlock(arena, allocateFreeNode(new_block));
+
+    return best_fit;
+}
+
+[[nodiscard]] void* allocateFromCoalesce(arena_t& arena, size_t size) noexcept
+{
+    if (size >= LARGE_ALLOC_THRESHOLD) [[unlikely]] {
+        return nullptr;
+    }
+
+    size_t total_size      = std::max(alignSize(size + sizeof(block_t)), MIN_BLOCK_SIZE);
+    RegionType region_type = getRegionType(size);
     size_t list_index      = static_cast<size_t>(region_type);
 
-    block_t* best_fit = bestFitApproach(total_size, list_index);
+    block_t* best_fit = findFreeBlock(arena, total_size, list_index);
 
-    for (size_t i = list_index + 1; !best_fit && i < COALESCE_LISTS_COUNT; ++i) {
-        best_fit = bestFitApproach(total_size, i);
+    if (!best_fit && g_lazy_carving) {
+        block_t* block = carveFromTop(arena, region_type, total_size);
+        return block ? getPointerFromBlock(block) : nullptr;
     }
 
     if (!best_fit) {
-        region_t* new_region = allocateRegionByType(static_cast<RegionType>(list_index));
+        region_t* new_region = allocateRegionByType(arena, static_cast<RegionType>(list_index));
         if (!new_region) {
             return nullptr;
         }
 
-        initializeRegion(new_region);
+        initializeRegion(arena, new_region);
 
-        best_fit = bestFitApproach(total_size, list_index);
-        for (size_t i = list_index + 1; !best_fit && i < COALESCE_LISTS_COUNT; ++i) {
-            best_fit = bestFitApproach(total_size, i);
-        }
+        best_fit = findFreeBlock(arena, total_size, list_index);
     }
 
     if (!best_fit) {
@@ -516,7 +1342,7 @@ bool isPointerInCoalesceRegion(void* ptr) noexcept
     }
 
     if (best_fit->free_node) {
-        removeFromFreeList(best_fit->free_node);
+        removeFromFreeList(arena, best_fit->free_node);
         best_fit->free_node = nullptr;
     }
 
@@ -524,11 +1350,11 @@ bool isPointerInCoalesceRegion(void* ptr) noexcept
 
     // split logic for the remaning size
     size_t remaining = best_fit->current_size - total_size;
-    if (remaining >= sizeof(block_t) + ALIGNMENT) {
+    if (remaining >= MIN_BLOCK_SIZE) {
         size_t min_split_size = (region_type == RegionType::LARGE) ? alignSize(1_MB + sizeof(block_t)) : alignSize(4_KB + sizeof(block_t));
         if (remaining >= min_split_size) {
             size_t aligned_new_size = remaining & ~(ALIGNMENT - 1); // lower border
-            best_fit                = tryToSplitCoalesce(best_fit, total_size, aligned_new_size, remaining);
+            best_fit                = tryToSplitCoalesce(arena, best_fit, total_size, aligned_new_size, remaining);
         }
     }
 
@@ -537,7 +1363,7 @@ bool isPointerInCoalesceRegion(void* ptr) noexcept
     return result;
 }
 
-size_t freeCoalesce(void* ptr) noexcept
+size_t freeCoalesce(arena_t& arena, region_t* region, void* ptr) noexcept
 {
     if (!ptr) {
         return 0;
@@ -550,343 +1376,2510 @@ size_t freeCoalesce(void* ptr) noexcept
 
     size_t user_size = block->current_size - sizeof(block_t);
     block->is_free   = true;
-
-    region_t* region = findRegionForBlock(block);
-    if (!region) {
-        return 0;
-    }
+    block->is_zeroed = false;
+    block->is_purged = false;
 
     block_t* prev = getPrevBlock(block);
     if (prev && prev->is_free && isBlockInRegion(prev, region)) {
         if (prev->free_node) {
-            removeFromFreeList(prev->free_node);
+            removeFromFreeList(arena, prev->free_node);
         }
-        mergeBlocks(prev, block);
+        mergeBlocks(arena, region, prev, block);
         block = prev;
     }
 
     block_t* next = getNextBlock(block, region);
     if (next && next->is_free) {
         if (next->free_node) {
-            removeFromFreeList(next->free_node);
+            removeFromFreeList(arena, next->free_node);
         }
-        mergeBlocks(block, next);
+        mergeBlocks(arena, region, block, next);
     }
 
-    free_node_t* new_node = allocateFreeNode();
-    if (new_node) {
-        new_node->header  = block;
-        size_t user_size  = block->current_size - sizeof(block_t);
-        size_t list_index = getCoalesceListIndex(user_size);
-        addToFreeList(new_node, list_index);
+    if (!releaseToTop(arena, region, block)) {
+        indexFreeBlock(arena, allocateFreeNode(block));
+        decayFreeBlock(arena, block);
     }
 
     return user_size;
 }
 
-void initFSA(FSAPool& pool, size_t block_size, char* memory, size_t mem_size) noexcept
+// Gives the part of an allocated block past total_size back to the arena, merged with a free next block
+void splitTailCoalesce(arena_t& arena, region_t* region, block_t* block, size_t total_size) noexcept
+{
+    size_t tail_size = block->current_size - total_size;
+    if (tail_size < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    block->current_size = total_size;
+
+    block_t* tail      = ::new (reinterpret_cast<char*>(block) + total_size) block_t{};
+    tail->current_size = tail_size;
+    tail->prev_size    = total_size;
+    tail->is_free      = true;
+
+    block_t* next = getNextBlock(tail, region);
+    if (next) {
+        next->prev_size = tail_size;
+        if (next->is_free) {
+            mergeBlocks(arena, region, tail, next);
+        }
+    }
+
+    if (!releaseToTop(arena, region, tail)) {
+        indexFreeBlock(arena, allocateFreeNode(tail));
+        decayFreeBlock(arena, tail);
+    }
+}
+
+// Shrinks a block by splitting off its tail or grows it by absorbing the free next block, never moving it
+[[nodiscard]] bool resizeCoalesce(arena_t& arena, region_t* region, void* ptr, size_t size) noexcept
+{
+    block_t* block    = getBlockFromPointer(ptr);
+    size_t total_size = std::max(alignSize(size + sizeof(block_t)), MIN_BLOCK_SIZE);
+
+    if (total_size > block->current_size) {
+        // the last block before the wilderness grows into it
+        char* block_end = reinterpret_cast<char*>(block) + block->current_size;
+        if (block_end == region->top && static_cast<size_t>(region->end - block_end) >= total_size - block->current_size) {
+            block->current_size   = total_size;
+            region->top           = reinterpret_cast<char*>(block) + total_size;
+            region->top_prev_size = total_size;
+            region->dirty_top     = std::max(region->dirty_top, region->top);
+            return true;
+        }
+
+        block_t* next = getNextBlock(block, region);
+        if (!next || !next->is_free || block->current_size + next->current_size < total_size) {
+            return false;
+        }
+        mergeBlocks(arena, region, block, next);
+    }
+
+    splitTailCoalesce(arena, region, block, total_size);
+    return true;
+}
+
+// Over-allocates by the alignment and gives the leading pad back to the arena as a free block of its own
+[[nodiscard]] void* allocateAlignedFromCoalesce(arena_t& arena, size_t size, size_t alignment) noexcept
+{
+    char* ptr = static_cast<char*>(allocateFromCoalesce(arena, size + alignment + MIN_BLOCK_SIZE));
+    if (!ptr) {
+        return nullptr;
+    }
+
+    block_t* block   = getBlockFromPointer(ptr);
+    region_t* region = findRegionForBlock(block);
+
+    char* aligned = reinterpret_cast<char*>(alignTo(reinterpret_cast<uintptr_t>(ptr), alignment));
+    if (aligned != ptr) {
+        // the pad has to hold a free block with its free-list node
+        if (static_cast<size_t>(aligned - ptr) < MIN_BLOCK_SIZE) {
+            aligned = reinterpret_cast<char*>(alignTo(reinterpret_cast<uintptr_t>(ptr + MIN_BLOCK_SIZE), alignment));
+        }
+        size_t pad_size = aligned - ptr;
+
+        block_t* aligned_block      = ::new (getBlockFromPointer(aligned)) block_t{};
+        aligned_block->current_size = block->current_size - pad_size;
+        aligned_block->prev_size    = pad_size;
+        aligned_block->is_free      = false;
+        // the pad covers the free-list node, so the whole aligned payload is untouched
+        aligned_block->is_zeroed = block->is_zeroed;
+
+        // a block carved off the wilderness leaves the aligned one as the last below top
+        updateNextPrevSize(aligned_block, region);
+
+        block->current_size = pad_size;
+        block->is_free      = true;
+        block->is_zeroed    = false;
+        block->is_purged    = false;
+
+        block_t* prev = getPrevBlock(block);
+        if (prev && prev->is_free && isBlockInRegion(prev, region)) {
+            if (prev->free_node) {
+                removeFromFreeList(arena, prev->free_node);
+            }
+            mergeBlocks(arena, region, prev, block);
+            block = prev;
+        }
+        indexFreeBlock(arena, allocateFreeNode(block));
+
+        block = aligned_block;
+        ptr   = aligned;
+    }
+
+    splitTailCoalesce(arena, region, block, std::max(alignSize(size + sizeof(block_t)), MIN_BLOCK_SIZE));
+    return ptr;
+}
+
+inline slab_t* getSlabFromPointer(void* ptr) noexcept
+{
+    return &g_slabs[static_cast<size_t>(static_cast<char*>(ptr) - g_fsa_arena_start) >> FSA_SLAB_SHIFT];
+}
+
+inline char* getSlabMemory(slab_t* slab) noexcept
+{
+    return g_fsa_arena_start + (static_cast<size_t>(slab - g_slabs) << FSA_SLAB_SHIFT);
+}
+
+[[nodiscard]] slab_t* acquireSlab(size_t size_class) noexcept
+{
+    slab_t* slab = nullptr;
+    {
+        auto lock = lockShared(g_slabs_mutex);
+        if (g_free_slabs) {
+            slab         = g_free_slabs;
+            g_free_slabs = slab->next;
+        } else if (g_slabs_carved < g_slabs_count) {
+            slab = &g_slabs[g_slabs_carved++];
+        } else {
+            return nullptr;
+        }
+    }
+
+    slab->free_list   = nullptr;
+    slab->bump        = getSlabMemory(slab);
+    slab->next        = nullptr;
+    slab->prev        = nullptr;
+    slab->used_blocks = 0;
+    slab->capacity    = size_class < FSA_SIZES_COUNT ? static_cast<uint32_t>(FSA_SLAB_SIZE / FSA_SIZES[size_class]) : 1;
+    slab->size_class  = static_cast<uint8_t>(size_class);
+    slab->owner.store(nullptr, std::memory_order_relaxed);
+    return slab;
+}
+
+size_t purgeSlab(slab_t* slab) noexcept
+{
+    if (slab->is_purged) {
+        return 0;
+    }
+
+    char* memory    = getSlabMemory(slab);
+    size_t purged   = purgeRange(memory, memory + FSA_SLAB_SIZE);
+    slab->is_purged = purged != 0;
+    return purged;
+}
+
+// The caller holds the slabs lock
+size_t purgeSlabReserve(bool only_decayed, uint32_t now) noexcept
+{
+    size_t purged = 0;
+    for (slab_t* slab = g_free_slabs; slab; slab = slab->next) {
+        if (!only_decayed || isDecayed(slab->released_at, now)) {
+            purged += purgeSlab(slab);
+        }
+    }
+    return purged;
+}
+
+// Returns the bytes purged right away
+size_t releaseSlab(slab_t* slab) noexcept
+{
+    slab->size_class = NO_SIZE_CLASS;
+    slab->is_purged  = false;
+
+    auto lock    = lockShared(g_slabs_mutex);
+    slab->next   = g_free_slabs;
+    g_free_slabs = slab;
+
+    if (g_decay_ms == 0) {
+        return purgeSlab(slab);
+    }
+    if (g_decay_ms > 0) {
+        uint32_t now      = decayTick();
+        slab->released_at = now;
+        if (isTickDue(g_slabs_next_decay_tick, now)) {
+            g_slabs_next_decay_tick = nextDecayTick(now);
+            return purgeSlabReserve(true, now);
+        }
+    }
+    return 0;
+}
+
+void linkPartialSlab(FSAPool& pool, slab_t* slab) noexcept
+{
+    slab->prev = nullptr;
+    slab->next = pool.partial_slabs;
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    pool.partial_slabs = slab;
+}
+
+void unlinkPartialSlab(FSAPool& pool, slab_t* slab) noexcept
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        pool.partial_slabs = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = nullptr;
+}
+
+void initFSA(FSAPool& pool, size_t size_class) noexcept
+{
+    pool.block_size       = FSA_SIZES[size_class];
+    pool.size_class       = size_class;
+    pool.partial_slabs    = nullptr;
+    pool.slabs_count      = 0;
+    pool.used_blocks      = 0;
+    pool.allocations      = 0;
+    pool.requested_bytes  = 0;
+    pool.published_blocks = 0;
+}
+
+[[nodiscard]] void* allocFSA(FSAPool& pool) noexcept
+{
+    slab_t* slab = pool.partial_slabs;
+    if (!slab) {
+        slab = acquireSlab(pool.size_class);
+        if (!slab) {
+            return nullptr;
+        }
+        pool.slabs_count++;
+        linkPartialSlab(pool, slab);
+    }
+
+    void* block = nullptr;
+    if (slab->free_list) {
+        block           = slab->free_list;
+        slab->free_list = slab->free_list->next;
+    } else {
+        block = slab->bump;
+        slab->bump += pool.block_size;
+    }
+
+    assert((reinterpret_cast<uintptr_t>(block) & (ALIGNMENT - 1)) == 0 && "a memory for FSA blocks is not aligned");
+
+    if (++slab->used_blocks == slab->capacity) {
+        unlinkPartialSlab(pool, slab);
+    }
+    pool.used_blocks++;
+
+    return block;
+}
+
+void freeFSA(void* ptr, FSAPool& pool) noexcept
+{
+    slab_t* slab       = getSlabFromPointer(ptr);
+    free_list_t* block = static_cast<free_list_t*>(ptr);
+    block->next        = slab->free_list;
+    slab->free_list    = block;
+    pool.used_blocks--;
+
+    if (slab->used_blocks-- == slab->capacity) {
+        linkPartialSlab(pool, slab);
+    }
+
+    // an empty slab can serve any size class again, the last partial one is kept to avoid ping-pong
+    if (slab->used_blocks == 0 && (slab->prev || slab->next)) {
+        unlinkPartialSlab(pool, slab);
+        pool.slabs_count--;
+        releaseSlab(slab);
+    }
+}
+
+// The caller holds the pool lock
+void foldBinCounters(FSAPool& pool, tcache_bin_t& bin) noexcept
+{
+    size_t allocations = bin.allocations.load();
+    pool.allocations += allocations - bin.folded_allocations;
+    pool.requested_bytes += bin.requested_bytes;
+    bin.folded_allocations = allocations;
+    bin.requested_bytes    = 0;
+}
+
+size_t refillBatchFSA(FSAPool& pool, tcache_bin_t& bin, remote_queue_t* owner) noexcept
+{
+    auto lock = lockShared(pool.mutex);
+    foldBinCounters(pool, bin);
+
+    const size_t batch = getTCacheCapacity(pool.size_class) / 2;
+    size_t taken       = 0;
+    while (taken < batch) {
+        free_list_t* block = static_cast<free_list_t*>(allocFSA(pool));
+        if (!block) {
+            break;
+        }
+        // frees of the slab from other threads come back to this one
+        if (slab_t* slab = getSlabFromPointer(block); slab->owner.load(std::memory_order_relaxed) != owner) {
+            slab->owner.store(owner, std::memory_order_relaxed);
+        }
+        block->next = bin.head;
+        bin.head    = block;
+        ++taken;
+    }
+
+    bin.traded.sub(taken);
+    bin.count.add(taken);
+    publishBinLive(pool.size_class, bin);
+    return taken;
+}
+
+// Keeps the `keep` most recently freed blocks in the bin and returns the rest to the pool
+void flushBatchFSA(FSAPool& pool, tcache_bin_t& bin, size_t keep) noexcept
+{
+    const size_t count = bin.count.load();
+    if (count <= keep) {
+        return;
+    }
+
+    free_list_t** link = &bin.head;
+    for (size_t i = 0; i < keep; ++i) {
+        link = &(*link)->next;
+    }
+
+    free_list_t* chain = *link;
+    *link              = nullptr;
+    bin.count.store(keep);
+    bin.traded.add(count - keep);
+
+    auto lock = lockShared(pool.mutex);
+    foldBinCounters(pool, bin);
+    while (chain) {
+        free_list_t* next = chain->next;
+        freeFSA(chain, pool);
+        chain = next;
+    }
+    publishBinLive(pool.size_class, bin);
+}
+
+// Returns a chain taken off a remote queue to its pool
+void releaseRemoteChain(size_t size_class, free_list_t* chain) noexcept
+{
+    if (!chain) {
+        return;
+    }
+
+    FSAPool& pool = g_fsa_pools[size_class];
+    auto lock     = lockShared(pool.mutex);
+    while (chain) {
+        free_list_t* next = chain->next;
+        freeFSA(chain, pool);
+        chain = next;
+    }
+}
+
+// False when the stack is full: an owner that lets it fill up is not allocating the class any more
+[[nodiscard]] bool pushRemoteFree(remote_queue_t& queue, size_t size_class, free_list_t* block) noexcept
+{
+    std::atomic<uint32_t>& length = queue.lengths[size_class];
+    if (length.fetch_add(1, std::memory_order_relaxed) >= getTCacheCapacity(size_class)) {
+        length.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::atomic<free_list_t*>& head = queue.heads[size_class];
+    block->next                     = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+// Takes a whole stack off the queue
+[[nodiscard]] free_list_t* takeRemoteChain(remote_queue_t& queue, size_t size_class) noexcept
+{
+    free_list_t* chain = queue.heads[size_class].exchange(nullptr, std::memory_order_acquire);
+    uint32_t count     = 0;
+    for (free_list_t* block = chain; block; block = block->next) {
+        ++count;
+    }
+    if (count) {
+        queue.lengths[size_class].fetch_sub(count, std::memory_order_relaxed);
+    }
+    return chain;
+}
+
+// Moves the blocks other threads freed to this one into its bin, a queue longer than the bin goes on to the pool
+void drainRemoteFrees(thread_cache_t* cache, size_t size_class) noexcept
+{
+    free_list_t* chain = cache->remote->heads[size_class].exchange(nullptr, std::memory_order_acquire);
+    if (!chain) {
+        return;
+    }
+
+    uint32_t count    = 1;
+    free_list_t* tail = chain;
+    for (; tail->next; tail = tail->next) {
+        ++count;
+    }
+    cache->remote->lengths[size_class].fetch_sub(count, std::memory_order_relaxed);
+
+    tcache_bin_t& bin = cache->bins[size_class];
+    tail->next        = bin.head;
+    bin.head          = chain;
+    bin.traded.sub(count);
+    if (const size_t capacity = getTCacheCapacity(size_class); bin.count.add(count) > capacity) {
+        flushBatchFSA(g_fsa_pools[size_class], bin, capacity);
+    }
+}
+
+[[nodiscard]] remote_queue_t* acquireRemoteQueue() noexcept
+{
+    std::lock_guard lock{g_remote_mutex};
+    if (!g_free_remote_queues) {
+        void* memory = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(remote_queue_t); ++i) {
+            remote_queue_t* queue = ::new (static_cast<remote_queue_t*>(memory) + i) remote_queue_t{};
+            queue->next           = g_remote_queues;
+            queue->next_free      = g_free_remote_queues;
+            g_remote_queues       = queue;
+            g_free_remote_queues  = queue;
+        }
+    }
+
+    remote_queue_t* queue = g_free_remote_queues;
+    g_free_remote_queues  = queue->next_free;
+    // frees that raced with the exit of the previous owner are still queued
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        releaseRemoteChain(i, takeRemoteChain(*queue, i));
+    }
+    queue->is_owned.store(true, std::memory_order_release);
+    return queue;
+}
+
+// The blocks still queued go back to the pools unless they belong to a heap destroy() already unmapped
+void releaseRemoteQueue(remote_queue_t* queue, bool is_current_epoch) noexcept
+{
+    queue->is_owned.store(false, std::memory_order_release);
+    if (is_current_epoch) {
+        for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+            releaseRemoteChain(i, takeRemoteChain(*queue, i));
+        }
+    }
+
+    std::lock_guard lock{g_remote_mutex};
+    queue->next_free     = g_free_remote_queues;
+    g_free_remote_queues = queue;
+}
+
+void releaseThreadCache(void* data) noexcept
+{
+    thread_cache_t* cache = static_cast<thread_cache_t*>(data);
+    const bool is_current = cache->epoch == g_epoch.load(std::memory_order_acquire);
+    if (cache->remote) {
+        releaseRemoteQueue(cache->remote, is_current);
+        cache->remote = nullptr;
+    }
+    if (!is_current) {
+        return;
+    }
+
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        flushBatchFSA(g_fsa_pools[i], cache->bins[i], 0);
+        if (cache->bins[i].allocations.load() != cache->bins[i].folded_allocations) {
+            auto lock = lockShared(g_fsa_pools[i].mutex);
+            foldBinCounters(g_fsa_pools[i], cache->bins[i]);
+        }
+    }
+    cache->epoch = 0;
+}
+
+// Blocks cached for a previous init() died together with its mapping, the counters survive it
+void resetThreadCache(thread_cache_t* cache, uint64_t epoch) noexcept
+{
+    // the bins are statistics too, the registry must see them
+    if (t_stats.epoch != epoch) {
+        attachThreadStats(t_stats, epoch);
+    }
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        tcache_bin_t& bin  = cache->bins[i];
+        size_t allocations = bin.allocations.load();
+        // the new pools only take what the bin serves from now on, the blocks it held count as traded away
+        size_t count = bin.count.load();
+        bin.head     = nullptr;
+        bin.count.store(0);
+        bin.traded.add(count);
+        bin.folded_allocations      = allocations;
+        bin.requested_bytes         = 0;
+        t_stats.published_blocks[i] = allocations - binFrees(bin);
+    }
+    cache->epoch       = epoch;
+    cache->arena_index = g_next_arena.fetch_add(1, std::memory_order_relaxed) % g_arenas_count;
+    // destroy() emptied the queue the thread kept from the previous heap
+    if (g_remote_frees && !cache->remote) {
+        cache->remote = acquireRemoteQueue();
+    } else if (!g_remote_frees && cache->remote) {
+        releaseRemoteQueue(cache->remote, false);
+        cache->remote = nullptr;
+    }
+
+    // the key destructor flushes the cache back to the pools when the thread exits
+    pthread_once(&g_tcache_key_once, [] { pthread_key_create(&g_tcache_key, releaseThreadCache); });
+    pthread_setspecific(g_tcache_key, cache);
+}
+
+[[nodiscard]] inline thread_cache_t* threadCache() noexcept
+{
+    thread_cache_t* cache = &t_cache;
+    uint64_t epoch        = g_epoch.load(std::memory_order_acquire);
+
+    if (cache->epoch != epoch) [[unlikely]] {
+        resetThreadCache(cache, epoch);
+    }
+    return cache;
+}
+
+[[nodiscard]] inline void* allocFSACounted(FSAPool& pool, size_t size) noexcept
+{
+    void* block = allocFSA(pool);
+    if (block) {
+        pool.requested_bytes += size;
+        if (++pool.allocations % STATS_PUBLISH_PERIOD == 0) [[unlikely]] {
+            // without thread caches the blocks out of the pool are exactly the live ones
+            publishClassLive(pool.size_class, pool.allocations, pool.allocations - pool.used_blocks, pool.published_blocks);
+        }
+    }
+    return block;
+}
+
+[[nodiscard]] void* allocFSACached(size_t size_class, size_t size) noexcept
+{
+    thread_cache_t* cache = threadCache();
+    tcache_bin_t& bin     = cache->bins[size_class];
+    // the blocks other threads gave back come first, a queue is drained on the next allocation of its class
+    if (remote_queue_t* remote = cache->remote; remote && remote->heads[size_class].load(std::memory_order_relaxed)) [[unlikely]] {
+        drainRemoteFrees(cache, size_class);
+    }
+    if (!bin.head && refillBatchFSA(g_fsa_pools[size_class], bin, cache->remote) == 0) {
+        return nullptr;
+    }
+
+    free_list_t* block = bin.head;
+    bin.head           = block->next;
+    bin.count.sub(1);
+    bin.requested_bytes += size;
+    bin.allocations.add(1);
+
+    return block;
+}
+
+void freeFSACached(void* ptr, size_t size_class) noexcept
+{
+    thread_cache_t* cache = threadCache();
+    tcache_bin_t& bin     = cache->bins[size_class];
+    free_list_t* block    = static_cast<free_list_t*>(ptr);
+
+    // a block of another live thread goes back to it instead of filling this cache
+    remote_queue_t* owner = getSlabFromPointer(ptr)->owner.load(std::memory_order_relaxed);
+    if (owner != cache->remote && owner && owner->is_owned.load(std::memory_order_relaxed)) {
+        bin.traded.add(1);
+        if (!pushRemoteFree(*owner, size_class, block)) {
+            FSAPool& pool = g_fsa_pools[size_class];
+            auto lock     = lockShared(pool.mutex);
+            freeFSA(block, pool);
+        }
+        return;
+    }
+
+    block->next = bin.head;
+    bin.head    = block;
+
+    if (const size_t capacity = getTCacheCapacity(size_class); bin.count.add(1) > capacity) {
+        flushBatchFSA(g_fsa_pools[size_class], bin, capacity / 2);
+    }
+}
+
+[[nodiscard]] void* allocateFromArenas(size_t size, size_t alignment = ALIGNMENT) noexcept
+{
+    size_t home = g_thread_safe ? threadCache()->arena_index : 0;
+
+    // the home arena grows first, the others are only borrowed from once it runs out of regions
+    for (size_t i = 0; i < g_arenas_count; ++i) {
+        arena_t& arena = g_arenas[(home + i) % g_arenas_count];
+        auto lock      = lockShared(arena.mutex);
+        void* result   = alignment > ALIGNMENT ? allocateAlignedFromCoalesce(arena, size, alignment) : allocateFromCoalesce(arena, size);
+        if (result) {
+            return result;
+        }
+    }
+    return nullptr;
+}
+
+size_t freeToArena(region_t* region, void* ptr) noexcept
+{
+    arena_t& arena = g_arenas[region->arena_index];
+    auto lock      = lockShared(arena.mutex);
+    return freeCoalesce(arena, region, ptr);
+}
+
+inline large_header_t* getLargeHeader(void* ptr) noexcept
+{
+    return static_cast<large_header_t*>(ptr) - 1;
+}
+
+inline size_t largeSlot(const void* ptr) noexcept
+{
+    return (reinterpret_cast<uintptr_t>(ptr) >> 6) * 0x9E3779B97F4A7C15ULL >> (64 - std::countr_zero(g_large_table_size));
+}
+
+// The caller holds the large lock
+void placeLargePointer(void* ptr) noexcept
+{
+    size_t slot = largeSlot(ptr);
+    while (g_large_table[slot]) {
+        slot = (slot + 1) & (g_large_table_size - 1);
+    }
+    g_large_table[slot] = ptr;
+    g_large_table_count++;
+}
+
+// The caller holds the large lock. false when the bigger table cannot be mapped
+[[nodiscard]] bool insertLargePointer(void* ptr) noexcept
+{
+    if ((g_large_table_count + 1) * 4 > g_large_table_size * 3) {
+        size_t size = g_large_table_size ? g_large_table_size * 2 : LARGE_TABLE_MIN_SIZE;
+        void* table = mmap(nullptr, size * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED) {
+            return false;
+        }
+
+        void** old_table    = g_large_table;
+        size_t old_size     = g_large_table_size;
+        g_large_table       = static_cast<void**>(table);
+        g_large_table_size  = size;
+        g_large_table_count = 0;
+        for (size_t i = 0; i < old_size; ++i) {
+            if (old_table[i]) {
+                placeLargePointer(old_table[i]);
+            }
+        }
+        if (old_table) {
+            munmap(old_table, old_size * sizeof(void*));
+        }
+    }
+    placeLargePointer(ptr);
+    return true;
+}
+
+// The caller holds the large lock
+void eraseLargePointer(const void* ptr) noexcept
+{
+    const size_t mask = g_large_table_size - 1;
+
+    size_t hole = largeSlot(ptr);
+    while (g_large_table[hole] != ptr) {
+        if (!g_large_table[hole]) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    // backward shift deletion: the probe chains stay unbroken without tombstones
+    for (size_t slot = (hole + 1) & mask; g_large_table[slot]; slot = (slot + 1) & mask) {
+        size_t home = largeSlot(g_large_table[slot]);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            g_large_table[hole] = g_large_table[slot];
+            hole                = slot;
+        }
+    }
+    g_large_table[hole] = nullptr;
+    g_large_table_count--;
+}
+
+// Anything outside the FSA arena and the regions may be a direct mapping of ours, or a pointer of another malloc
+inline bool isLargeAllocation(void* ptr) noexcept
+{
+    // the user pointer of a mapping is at least LARGE_HEADER_OFFSET aligned
+    if ((reinterpret_cast<uintptr_t>(ptr) & (LARGE_HEADER_OFFSET - 1)) != 0) {
+        return false;
+    }
+
+    auto lock = lockShared(g_large_mutex);
+    if (!g_large_table_count) {
+        return false;
+    }
+    for (size_t slot = largeSlot(ptr); g_large_table[slot]; slot = (slot + 1) & (g_large_table_size - 1)) {
+        if (g_large_table[slot] == ptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline size_t getLargeUsableSize(void* ptr) noexcept
+{
+    large_header_t* header = getLargeHeader(ptr);
+    return header->map_start + header->map_size - static_cast<char*>(ptr);
+}
+
+// The caller holds the large lock
+void evictLargeSpan(size_t index) noexcept
+{
+    large_span_t span = g_large_cache[index];
+    munmap(span.start, span.size);
+    g_large_cache_bytes -= span.size;
+    g_large_cache[index] = g_large_cache[--g_large_cache_count];
+
+    g_purged_bytes.fetch_add(span.size, std::memory_order_relaxed);
+    g_purge_calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The caller holds the large lock. Unmaps the spans idle for the decay time, or all of them
+size_t evictLargeSpans(bool only_decayed, uint32_t now) noexcept
+{
+    size_t evicted = 0;
+    for (size_t i = g_large_cache_count; i-- > 0;) {
+        if (!only_decayed || isDecayed(g_large_cache[i].cached_at, now)) {
+            evicted += g_large_cache[i].size;
+            evictLargeSpan(i);
+        }
+    }
+    return evicted;
+}
+
+// Takes the smallest cached span that fits, cutting off its tail when it is much bigger than needed.
+// map_size is updated to the size of the span handed out.
+[[nodiscard]] char* takeLargeSpan(size_t& map_size) noexcept
+{
+    auto lock = lockShared(g_large_mutex);
+    if (g_decay_ms > 0) {
+        evictLargeSpans(true, decayTick());
+    }
+
+    size_t best = g_large_cache_count;
+    for (size_t i = 0; i < g_large_cache_count; ++i) {
+        if (g_large_cache[i].size >= map_size && (best == g_large_cache_count || g_large_cache[i].size < g_large_cache[best].size)) {
+            best = i;
+        }
+    }
+    if (best == g_large_cache_count) {
+        return nullptr;
+    }
+
+    large_span_t span = g_large_cache[best];
+    g_large_cache_bytes -= span.size;
+    g_large_cache[best] = g_large_cache[--g_large_cache_count];
+
+    if (span.size - map_size > map_size / 4) {
+        munmap(span.start + map_size, span.size - map_size);
+    } else {
+        map_size = span.size;
+    }
+    return span.start;
+}
+
+// Keeps a freed mapping for reuse, the oldest one makes room when the cache is full
+[[nodiscard]] bool cacheLargeSpan(char* start, size_t size) noexcept
+{
+    // immediate purging leaves nothing to cache
+    if (g_decay_ms == 0 || size > LARGE_CACHE_MAX_BYTES) {
+        return false;
+    }
+
+    auto lock = lockShared(g_large_mutex);
+    while (g_large_cache_count == LARGE_CACHE_SLOTS || g_large_cache_bytes + size > LARGE_CACHE_MAX_BYTES) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < g_large_cache_count; ++i) {
+            if (static_cast<int32_t>(g_large_cache[i].cached_at - g_large_cache[oldest].cached_at) < 0) {
+                oldest = i;
+            }
+        }
+        evictLargeSpan(oldest);
+    }
+
+    g_large_cache[g_large_cache_count++] = large_span_t{.start = start, .size = size, .cached_at = g_decay_ms > 0 ? decayTick() : 0};
+    g_large_cache_bytes += size;
+    return true;
+}
+
+// Maps a block of its own for a large request, reusing a cached span whenever the alignment allows it
+[[nodiscard]] void* allocateLarge(size_t size, size_t alignment, bool* is_fresh = nullptr) noexcept
+{
+    size_t offset = std::max(LARGE_HEADER_OFFSET, alignment);
+    // a page-aligned mapping only guarantees page alignment, bigger ones need slack in front
+    bool over_aligned = alignment > PAGE_SIZE;
+    size_t map_size   = 0;
+    if (__builtin_add_overflow(offset, size, &map_size) || (over_aligned && __builtin_add_overflow(map_size, alignment, &map_size))
+        || map_size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+    map_size = alignToPage(map_size);
+
+    char* start = over_aligned ? nullptr : takeLargeSpan(map_size);
+    if (is_fresh) {
+        *is_fresh = start == nullptr;
+    }
+    if (!start) {
+        start = static_cast<char*>(mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (start == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+
+    char* ptr = over_aligned ? reinterpret_cast<char*>(alignTo(reinterpret_cast<uintptr_t>(start) + LARGE_HEADER_OFFSET, alignment)) : start + offset;
+    ::new (getLargeHeader(ptr)) large_header_t{.map_start = start, .map_size = map_size, .size = size, .is_sampled = false};
+
+    bool is_registered = false;
+    {
+        auto lock     = lockShared(g_large_mutex);
+        is_registered = insertLargePointer(ptr);
+    }
+    if (!is_registered) {
+        if (!cacheLargeSpan(start, map_size)) {
+            munmap(start, map_size);
+        }
+        return nullptr;
+    }
+    return ptr;
+}
+
+// Returns the aligned requested bytes of the freed block
+size_t freeLarge(void* ptr) noexcept
+{
+    large_header_t* header = getLargeHeader(ptr);
+    char* start            = header->map_start;
+    size_t map_size        = header->map_size;
+    size_t size            = header->size;
+    {
+        // a second free does not find the pointer any more
+        auto lock = lockShared(g_large_mutex);
+        eraseLargePointer(ptr);
+    }
+
+    if (!cacheLargeSpan(start, map_size)) {
+        munmap(start, map_size);
+    }
+    return size;
+}
+
+// Grows or shrinks the mapping in place when the address space allows it, otherwise the kernel moves its pages
+[[nodiscard]] void* resizeLarge(void* ptr, size_t size) noexcept
+{
+    large_header_t* header = getLargeHeader(ptr);
+    size_t offset          = static_cast<char*>(ptr) - header->map_start;
+    size_t map_size        = alignToPage(offset + size);
+
+    char* start = header->map_start;
+    if (map_size != header->map_size) {
+        start = static_cast<char*>(mremap(header->map_start, header->map_size, map_size, MREMAP_MAYMOVE));
+        if (start == MAP_FAILED) {
+            return nullptr;
+        }
+    }
+
+    char* moved       = start + offset;
+    header            = getLargeHeader(moved);
+    header->map_start = start;
+    header->map_size  = map_size;
+    header->size      = size;
+    if (moved != ptr) {
+        // the slot freed by the old pointer keeps the table below its load limit
+        auto lock = lockShared(g_large_mutex);
+        eraseLargePointer(ptr);
+        placeLargePointer(moved);
+    }
+    return moved;
+}
+
+inline bool isInFSAArena(void* ptr) noexcept
+{
+    assert(g_fsa_arena_start < g_fsa_arena_end && "fsa area start > sfa area end!!!");
+    return ptr >= g_fsa_arena_start && ptr < g_fsa_arena_end;
+}
+
+// Exponential gaps make the samples a Poisson process over the allocated bytes:
+// every byte has the same chance to be sampled, whatever the size of its block
+int64_t nextSampleGap(sampler_t& sampler) noexcept
+{
+    // xorshift64*
+    sampler.rng ^= sampler.rng >> 12;
+    sampler.rng ^= sampler.rng << 25;
+    sampler.rng ^= sampler.rng >> 27;
+    uint64_t bits = sampler.rng * 0x2545F4914F6CDD1DULL;
+    double unit   = (static_cast<double>(bits >> 11) + 1.0) / static_cast<double>(uint64_t{1} << 53); // (0, 1]
+    return static_cast<int64_t>(-std::log(unit) * static_cast<double>(g_sample_interval)) + 1;
+}
+
+bool shouldSampleSlow() noexcept
+{
+    sampler_t& sampler = t_sampler;
+    if (sampler.is_sampling) {
+        return false;
+    }
+
+    uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+    bool is_armed  = sampler.epoch == epoch;
+    if (!is_armed) {
+        // the first countdown of a thread or of an init() starts from a fresh gap instead of sampling right away
+        sampler.rng   = sampler.rng ? sampler.rng : (reinterpret_cast<uintptr_t>(&sampler) ^ std::chrono::steady_clock::now().time_since_epoch().count()) | 1;
+        sampler.epoch = epoch;
+    }
+    sampler.bytes_until_sample = nextSampleGap(sampler);
+    return is_armed;
+}
+
+// The whole cost of an unsampled allocation while profiling: a thread-local subtraction
+inline bool shouldSample(size_t size) noexcept
+{
+    t_sampler.bytes_until_sample -= static_cast<int64_t>(size);
+    return t_sampler.bytes_until_sample < 0 && shouldSampleSlow();
+}
+
+inline size_t sampleSlot(const void* ptr) noexcept
+{
+    return (reinterpret_cast<uintptr_t>(ptr) >> 4) * 0x9E3779B97F4A7C15ULL >> (64 - PROFILE_TABLE_BITS);
+}
+
+void addSample(void* ptr, size_t size, void* const* frames, size_t depth) noexcept
+{
+    std::lock_guard lock{g_profile_mutex};
+    // a full table drops the sample, the block is still looked up on free
+    if (g_samples_count == PROFILE_MAX_SAMPLES) {
+        return;
+    }
+
+    size_t slot = sampleSlot(ptr);
+    while (g_samples[slot].ptr) {
+        slot = (slot + 1) & (PROFILE_TABLE_SIZE - 1);
+    }
+    heap_sample_t& sample = g_samples[slot];
+    sample.ptr            = ptr;
+    sample.size           = size;
+    sample.depth          = depth;
+    std::copy_n(frames, depth, sample.frames);
+    g_samples_count++;
+}
+
+void removeSample(const void* ptr) noexcept
+{
+    std::lock_guard lock{g_profile_mutex};
+    constexpr size_t MASK = PROFILE_TABLE_SIZE - 1;
+
+    size_t hole = sampleSlot(ptr);
+    while (g_samples[hole].ptr != ptr) {
+        if (!g_samples[hole].ptr) {
+            return;
+        }
+        hole = (hole + 1) & MASK;
+    }
+
+    // backward shift deletion: the rest of the probe run moves up, so lookups never need tombstones
+    for (size_t slot = (hole + 1) & MASK; g_samples[slot].ptr; slot = (slot + 1) & MASK) {
+        size_t home = sampleSlot(g_samples[slot].ptr);
+        if (((slot - home) & MASK) >= ((slot - hole) & MASK)) {
+            g_samples[hole] = g_samples[slot];
+            hole            = slot;
+        }
+    }
+    g_samples[hole].ptr = nullptr;
+    g_samples_count--;
+}
+
+// Serves a sampled request outside the FSA arena: the header of the block marks it for free() and realloc()
+[[nodiscard]] void* allocateSampled(size_t size, size_t alignment) noexcept
+{
+    void* frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    t_sampler.is_sampling = true;
+    size_t depth          = static_cast<size_t>(backtrace(frames, static_cast<int>(std::size(frames))));
+    t_sampler.is_sampling = false;
+
+    size_t aligned_size = alignSize(size);
+    void* result        = nullptr;
+    if (aligned_size + alignment < LARGE_ALLOC_THRESHOLD) {
+        result = allocateFromArenas(aligned_size, alignment);
+        if (result) {
+            block_t* block    = getBlockFromPointer(result);
+            block->is_sampled = true;
+            recordAlloc(COALESCE_BUCKET, block->current_size - sizeof(block_t));
+        }
+    } else {
+        result = allocateLarge(aligned_size, alignment);
+        if (result) {
+            getLargeHeader(result)->is_sampled = true;
+            recordAlloc(LARGE_BUCKET, aligned_size);
+        }
+    }
+
+    if (result) {
+        size_t skipped = std::min(depth, PROFILE_SKIP_FRAMES);
+        addSample(result, size, frames + skipped, depth - skipped);
+    }
+    return result;
+}
+
+// Builds the profile in a stack buffer flushed with write(2): nothing is allocated, so a signal handler can use it
+struct profile_writer_t {
+    int fd;
+    size_t length{0};
+    bool failed{false};
+    char buffer[4096];
+
+    explicit profile_writer_t(int file) noexcept
+        : fd{file}
+    {
+    }
+
+    void flush() noexcept
+    {
+        for (size_t written = 0; written < length && !failed;) {
+            ssize_t result = ::write(fd, buffer + written, length - written);
+            if (result < 0 && errno != EINTR) {
+                failed = true;
+            } else if (result > 0) {
+                written += static_cast<size_t>(result);
+            }
+        }
+        length = 0;
+    }
+
+    void put(std::string_view text) noexcept
+    {
+        for (char c : text) {
+            if (length == sizeof(buffer)) {
+                flush();
+            }
+            buffer[length++] = c;
+        }
+    }
+
+    void putNumber(uint64_t value, unsigned base = 10) noexcept
+    {
+        char digits[20];
+        size_t count = 0;
+        do {
+            digits[count++] = "0123456789abcdef"[value % base];
+            value /= base;
+        } while (value);
+        while (count) {
+            put({&digits[--count], 1});
+        }
+    }
+};
+
+// heap_v2 lists the sampled objects and leaves the unsampling to pprof. Only live blocks are tracked,
+// so the cumulative columns repeat the in-use ones. pprof sums the records of equal stacks itself
+bool writeHeapProfile(int fd) noexcept
+{
+    profile_writer_t writer{fd};
+    size_t objects = 0;
+    size_t bytes   = 0;
+    for (size_t i = 0; i < PROFILE_TABLE_SIZE; ++i) {
+        if (g_samples[i].ptr) {
+            objects++;
+            bytes += g_samples[i].size;
+        }
+    }
+
+    auto putCounts = [&writer](size_t count, size_t size) {
+        writer.putNumber(count);
+        writer.put(": ");
+        writer.putNumber(size);
+        writer.put(" [");
+        writer.putNumber(count);
+        writer.put(": ");
+        writer.putNumber(size);
+        writer.put("] @");
+    };
+    writer.put("heap profile: ");
+    putCounts(objects, bytes);
+    writer.put(" heap_v2/");
+    writer.putNumber(g_sample_interval);
+    writer.put("\n");
+
+    for (size_t i = 0; i < PROFILE_TABLE_SIZE; ++i) {
+        const heap_sample_t& sample = g_samples[i];
+        if (!sample.ptr) {
+            continue;
+        }
+        putCounts(1, sample.size);
+        for (size_t frame = 0; frame < sample.depth; ++frame) {
+            writer.put(" 0x");
+            writer.putNumber(reinterpret_cast<uintptr_t>(sample.frames[frame]), 16);
+        }
+        writer.put("\n");
+    }
+
+    // pprof symbolizes the addresses with the mappings of the process
+    writer.put("\nMAPPED_LIBRARIES:\n");
+    writer.flush();
+    int maps = ::open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t count = 0;
+        while ((count = ::read(maps, writer.buffer, sizeof(writer.buffer))) > 0 || (count < 0 && errno == EINTR)) {
+            writer.length = static_cast<size_t>(std::max<ssize_t>(count, 0));
+            writer.flush();
+        }
+        ::close(maps);
+    }
+    return !writer.failed;
+}
+
+// Writes "<prefix>.<pid>.<n>.heap". Skipped when the signal interrupted the profiler itself, its lock is held then
+void dumpHeapProfileOnSignal(int) noexcept
+{
+    int saved_errno = errno;
+    std::unique_lock lock{g_profile_mutex, std::try_to_lock};
+    if (lock && g_samples) {
+        char path[PATH_MAX];
+        profile_writer_t name{-1};
+        name.put(g_profile_prefix);
+        name.put(".");
+        name.putNumber(static_cast<uint64_t>(getpid()));
+        name.put(".");
+        name.putNumber(g_profile_dumps.fetch_add(1, std::memory_order_relaxed));
+        name.put(".heap");
+        if (name.length < sizeof(path)) {
+            std::memcpy(path, name.buffer, name.length);
+            path[name.length] = '\0';
+            int fd            = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                writeHeapProfile(fd);
+                ::close(fd);
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+inline uint8_t* putVarint(uint8_t* out, uint64_t value) noexcept
+{
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+inline bool getVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) noexcept
+{
+    value = 0;
+    for (unsigned shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pointer deltas go both ways, zigzag keeps the small negative ones short
+inline constexpr uint64_t zigzag(uint64_t delta) noexcept
+{
+    return (delta << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+}
+
+inline constexpr uint64_t unzigzag(uint64_t value) noexcept
+{
+    return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+bool writeAll(int fd, const void* data, size_t size) noexcept
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written < 0 && errno != EINTR) {
+            return false;
+        }
+        if (written > 0) {
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+    return true;
+}
+
+// The caller holds g_trace_mutex. Every chunk starts its deltas over, so chunks decode independently
+void flushTraceBuffer(trace_buffer_t& buffer) noexcept
+{
+    if (buffer.header.bytes) {
+        writeAll(g_trace_fd, &buffer.header, sizeof(TraceChunkHeader) + buffer.header.bytes);
+    }
+    buffer.header.bytes  = 0;
+    buffer.last_sequence = 0;
+    buffer.last_time_ns  = 0;
+    buffer.last_ptr      = 0;
+}
+
+// The caller holds g_trace_mutex
+void unlinkTraceBuffer(trace_buffer_t* buffer) noexcept
+{
+    if (buffer->prev) {
+        buffer->prev->next = buffer->next;
+    } else {
+        g_trace_buffers = buffer->next;
+    }
+    if (buffer->next) {
+        buffer->next->prev = buffer->prev;
+    }
+    munmap(buffer, sizeof(trace_buffer_t));
+}
+
+// The key destructor: an exiting thread writes out the events it still buffers.
+// A buffer of an earlier init() was written and unmapped by destroy() already
+void releaseTraceBuffer(void* data) noexcept
+{
+    tracer_t* tracer = static_cast<tracer_t*>(data);
+    std::lock_guard lock{g_trace_mutex};
+    if (g_trace_fd >= 0 && tracer->buffer && tracer->epoch == g_epoch.load(std::memory_order_relaxed)) {
+        flushTraceBuffer(*tracer->buffer);
+        unlinkTraceBuffer(tracer->buffer);
+    }
+    tracer->buffer = nullptr;
+}
+
+trace_buffer_t* attachTraceBuffer(tracer_t& tracer, uint64_t epoch) noexcept
+{
+    void* memory = mmap(nullptr, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    // the mapping is zero-filled, only the links and the thread number are set
+    trace_buffer_t* buffer = static_cast<trace_buffer_t*>(memory);
+    buffer->header.thread  = g_trace_threads.fetch_add(1, std::memory_order_relaxed);
+
+    pthread_once(&g_trace_key_once, [] { pthread_key_create(&g_trace_key, releaseTraceBuffer); });
+    {
+        std::lock_guard lock{g_trace_mutex};
+        buffer->next = g_trace_buffers;
+        if (g_trace_buffers) {
+            g_trace_buffers->prev = buffer;
+        }
+        g_trace_buffers = buffer;
+    }
+    tracer.buffer = buffer;
+    tracer.epoch  = epoch;
+    pthread_setspecific(g_trace_key, &tracer);
+    return buffer;
+}
+
+// extra is the alignment of AllocAligned and the old pointer of Realloc
+void recordTrace(TraceOp op, uint64_t sequence, const void* ptr, size_t size, uint64_t extra) noexcept
+{
+    tracer_t& tracer       = t_tracer;
+    uint64_t epoch         = g_epoch.load(std::memory_order_relaxed);
+    trace_buffer_t* buffer = tracer.epoch == epoch ? tracer.buffer : nullptr;
+    if (!buffer) [[unlikely]] {
+        buffer = attachTraceBuffer(tracer, epoch);
+        if (!buffer) {
+            return;
+        }
+    }
+    if (buffer->header.bytes + TRACE_MAX_EVENT_BYTES > TRACE_BUFFER_SIZE) {
+        std::lock_guard lock{g_trace_mutex};
+        flushTraceBuffer(*buffer);
+    }
+
+    uint64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_trace_clock_base).count();
+    uint64_t address = reinterpret_cast<uintptr_t>(ptr);
+    uint8_t* out     = buffer->events + buffer->header.bytes;
+    *out++           = static_cast<uint8_t>(op);
+    out              = putVarint(out, sequence - buffer->last_sequence);
+    out              = putVarint(out, time_ns - buffer->last_time_ns);
+    out              = putVarint(out, zigzag(address - buffer->last_ptr));
+    if (op != TraceOp::Free) {
+        out = putVarint(out, size);
+    }
+    if (op == TraceOp::AllocAligned) {
+        out = putVarint(out, extra);
+    } else if (op == TraceOp::Realloc) {
+        out = putVarint(out, zigzag(extra - address));
+    }
+
+    buffer->last_sequence = sequence;
+    buffer->last_time_ns  = time_ns;
+    buffer->last_ptr      = address;
+    buffer->header.bytes  = static_cast<uint32_t>(out - buffer->events);
+}
+
+// An entry point called while tracing is one event, whatever it calls on the way is part of it
+struct trace_scope_t {
+    trace_scope_t() noexcept
+    {
+        t_tracer.is_inside = true;
+    }
+    ~trace_scope_t()
+    {
+        t_tracer.is_inside = false;
+    }
+    trace_scope_t(const trace_scope_t&)            = delete;
+    trace_scope_t& operator=(const trace_scope_t&) = delete;
+};
+
+inline bool isTracing() noexcept
+{
+    return g_trace_fd >= 0 && !t_tracer.is_inside;
+}
+
+// An allocation takes its sequence number once the block is handed out
+template <typename Call>
+void* traceAllocation(TraceOp op, size_t size, uint64_t extra, Call&& call)
+{
+    trace_scope_t scope;
+    void* result = call();
+    if (result) {
+        recordTrace(op, g_trace_sequence.fetch_add(1, std::memory_order_relaxed), result, size, extra);
+    }
+    return result;
+}
+
+// One bucket for every power of two a block size can start with
+using size_histogram_t = std::array<SizeBucketStats, std::numeric_limits<size_t>::digits>;
+
+void addToHistogram(size_histogram_t& histogram, size_t size, bool is_free) noexcept
+{
+    SizeBucketStats& bucket = histogram[std::bit_width(size) - 1];
+    if (is_free) {
+        bucket.free_blocks++;
+        bucket.free_bytes += size;
+    } else {
+        bucket.used_blocks++;
+        bucket.used_bytes += size;
+    }
+}
+
+std::vector<SizeBucketStats> compactHistogram(const size_histogram_t& histogram)
+{
+    std::vector<SizeBucketStats> result;
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        if (histogram[i].used_blocks || histogram[i].free_blocks) {
+            result.push_back(histogram[i]);
+            result.back().min_size = size_t{1} << i;
+        }
+    }
+    return result;
+}
+
+inline double externalFragmentation(size_t largest_free_block, size_t free_bytes) noexcept
+{
+    return free_bytes ? 1.0 - static_cast<double>(largest_free_block) / free_bytes : 0.0;
+}
+
+void addFreeListBlock(FreeListFragmentation& list, size_t size) noexcept
+{
+    list.blocks++;
+    list.bytes += size;
+    list.largest_block = std::max(list.largest_block, size);
+}
+
+// Just enough JSON for the reports: a comma goes in front of anything that does not start an object, an array or a value
+void appendJsonKey(std::string& out, const char* key)
+{
+    if (!out.empty() && out.back() != '{' && out.back() != '[') {
+        out += ',';
+    }
+    if (key) {
+        out += '"';
+        out += key;
+        out += "\":";
+    }
+}
+
+void appendJson(std::string& out, const char* key, size_t value)
+{
+    appendJsonKey(out, key);
+    char buffer[24];
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+}
+
+void appendJson(std::string& out, const char* key, double value)
+{
+    appendJsonKey(out, key);
+    char buffer[32];
+    out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, 4).ptr);
+}
+
+void appendJson(std::string& out, const char* key, const std::vector<SizeBucketStats>& histogram)
+{
+    appendJsonKey(out, key);
+    out += '[';
+    for (const SizeBucketStats& bucket : histogram) {
+        appendJsonKey(out, nullptr);
+        out += '{';
+        appendJson(out, "min_size", bucket.min_size);
+        appendJson(out, "used_blocks", bucket.used_blocks);
+        appendJson(out, "used_bytes", bucket.used_bytes);
+        appendJson(out, "free_blocks", bucket.free_blocks);
+        appendJson(out, "free_bytes", bucket.free_bytes);
+        out += '}';
+    }
+    out += ']';
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+    if (release_at_exit_) {
+        destroy();
+    } else if (g_trace_fd >= 0) {
+        // the heap outlives this destructor, but the trace is read once the process is gone:
+        // everything buffered so far goes out now, events of later destructors are lost
+        std::lock_guard lock{g_trace_mutex};
+        for (trace_buffer_t* buffer = g_trace_buffers; buffer; buffer = buffer->next) {
+            flushTraceBuffer(*buffer);
+        }
+    }
+}
+
+void MemoryAllocator::init(const AllocatorOptions& options)
+{
+    if (is_initialized_) {
+        return;
+    }
+
+    auto page_size = sysconf(_SC_PAGESIZE);
+    if (page_size == -1) {
+        perror("sysconf");
+        return;
+    }
+
+    if (page_size != PAGE_SIZE) {
+        std::cerr << "ERROR: inappropriate page size on the system! sys_size=" << page_size << ", allocator_page_size=" << PAGE_SIZE << std::endl;
+        return;
+    }
+
+    g_max_regions = DEFAULT_MAX_REGIONS;
+    if (options.heap_reserve) {
+        g_max_regions = std::max(alignTo(options.heap_reserve, REGION_SIZE) / REGION_SIZE, REGION_COUNT_BY_TYPE);
+    }
+    const size_t metadata_size = g_max_regions * sizeof(region_t) + METADATA_SIZE;
+    // The FSA arena and the regions start on huge page boundaries, the reservation is a whole number of huge pages
+    g_total_virtual_memory = (g_max_regions * REGION_SIZE + FSA_ARENA_SIZE + metadata_size + HUGE_PAGE_SIZE * 3) & ~(HUGE_PAGE_SIZE - 1);
+
+    g_virtual_memory = static_cast<char*>(MAP_FAILED);
+    g_huge_pages     = options.huge_pages;
+    if (g_huge_pages == HugePages::Explicit) {
+        // the whole reservation is taken from the preallocated pool up front, so a fault never finds it empty
+        g_virtual_memory = static_cast<char*>(mmap(nullptr, g_total_virtual_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+        if (g_virtual_memory == MAP_FAILED) {
+            g_huge_pages = HugePages::Transparent;
+        }
+    }
+    if (g_virtual_memory == MAP_FAILED) {
+        // only address space is reserved here: nothing is charged until a range is made accessible,
+        // so the reservation can be far larger than the memory the process will ever use
+        g_virtual_memory = static_cast<char*>(mmap(nullptr, g_total_virtual_memory, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    }
+
+    if (g_virtual_memory == MAP_FAILED) {
+        std::cerr << "Failed to allocate virtual memory" << std::endl;
+        perror("mmap");
+        return;
+    }
+
+    // the guard pages around the reservation stay PROT_NONE
+    char* usable_memory = g_virtual_memory + PAGE_SIZE;
+    size_t usable_size  = g_total_virtual_memory - PAGE_SIZE * 2;
+    size_t offset       = 0;
+
+    auto advanceAligned = [&](size_t size) -> char* {
+        offset       = alignSize(offset);
+        char* result = usable_memory + offset;
+        offset += size;
+        return result;
+    };
+
+    size_t fsa_arena_size = alignToPage(FSA_ARENA_SIZE);
+    g_slabs_count         = fsa_arena_size / FSA_SLAB_SIZE;
+    g_regions             = reinterpret_cast<region_t*>(advanceAligned(g_max_regions * sizeof(region_t)));
+    g_slabs               = reinterpret_cast<slab_t*>(advanceAligned(g_slabs_count * sizeof(slab_t)));
+
+    // slabs are aligned to their size, so blocks of every class keep their natural alignment,
+    // and the arena is aligned to huge pages, so it can be backed by them
+    offset            = alignTo(reinterpret_cast<uintptr_t>(usable_memory + offset), HUGE_PAGE_SIZE) - reinterpret_cast<uintptr_t>(usable_memory);
+    g_fsa_arena_start = usable_memory + offset;
+    g_fsa_arena_end   = g_fsa_arena_start + fsa_arena_size;
+    offset += fsa_arena_size;
+
+    offset         = alignTo(reinterpret_cast<uintptr_t>(usable_memory + offset), HUGE_PAGE_SIZE) - reinterpret_cast<uintptr_t>(usable_memory);
+    g_regions_base = usable_memory + offset;
+
+    if (offset + g_max_regions * REGION_SIZE > usable_size) [[unlikely]] {
+        std::cerr << "Not enough space for metadata and regions" << std::endl;
+        munmap(g_virtual_memory, g_total_virtual_memory);
+        g_virtual_memory = nullptr;
+        return;
+    }
+
+    // the metadata and the FSA arena are committed right away, the regions one by one as they are handed out
+    if (g_huge_pages != HugePages::Explicit && mprotect(usable_memory, g_regions_base - usable_memory, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect");
+        munmap(g_virtual_memory, g_total_virtual_memory);
+        g_virtual_memory = nullptr;
+        return;
+    }
+
+    for (size_t i = 0; i < g_max_regions; ++i) {
+        g_regions[i].start         = nullptr;
+        g_regions[i].end           = nullptr;
+        g_regions[i].top           = nullptr;
+        g_regions[i].dirty_top     = nullptr;
+        g_regions[i].top_prev_size = 0;
+        g_regions[i].is_used       = false;
+        g_regions[i].region_type   = RegionType::SMALL;
+        g_regions[i].arena_index   = 0;
+    }
+    g_regions_count.store(0, std::memory_order_relaxed);
+
+    // several arenas only pay off when threads can actually contend
+    size_t arenas_count = options.arenas_count;
+    if (arenas_count == 0) {
+        arenas_count = options.thread_safe ? std::clamp<size_t>(std::thread::hardware_concurrency(), 1, DEFAULT_MAX_ARENAS) : 1;
+    }
+    g_arenas_count = std::min(arenas_count, MAX_ARENAS);
+    for (size_t i = 0; i < MAX_ARENAS; ++i) {
+        g_arenas[i].index = i;
+        for (size_t j = 0; j < COALESCE_LISTS_COUNT; ++j) {
+            g_arenas[i].free_lists[j] = nullptr;
+        }
+        g_arenas[i].tlsf_fl_bitmap  = 0;
+        g_arenas[i].next_decay_tick = 0;
+        for (size_t j = 0; j < REGION_COUNT_BY_TYPE; ++j) {
+            g_arenas[i].top_regions[j] = nullptr;
+        }
+        for (size_t j = 0; j < TLSF_FL_COUNT; ++j) {
+            g_arenas[i].tlsf_sl_bitmap[j] = 0;
+        }
+        for (size_t j = 0; j < TLSF_FL_COUNT * TLSF_SL_COUNT; ++j) {
+            g_arenas[i].tlsf_bins[j] = nullptr;
+        }
+    }
+    g_engine         = options.engine;
+    g_lazy_carving   = options.lazy_carving;
+    g_min_alignment  = std::has_single_bit(options.min_alignment) ? std::max(options.min_alignment, ALIGNMENT) : ALIGNMENT;
+    release_at_exit_ = options.release_at_exit;
+
+    g_decay_ms              = options.purge_decay_ms;
+    g_lazy_purge            = options.lazy_purge;
+    g_decay_clock_base      = std::chrono::steady_clock::now();
+    g_slabs_next_decay_tick = 0;
+    g_purged_bytes.store(0, std::memory_order_relaxed);
+    g_purge_calls.store(0, std::memory_order_relaxed);
+    {
+        // the thread counters are never reset, a snapshot reports the difference to their totals at init()
+        std::lock_guard lock{g_stats_mutex};
+        collectStats(g_stats_base);
+        g_published_live_bytes.store(0, std::memory_order_relaxed);
+        g_peak_live_bytes.store(0, std::memory_order_relaxed);
+    }
+
+    g_slabs_carved = 0;
+    g_free_slabs   = nullptr;
+    for (size_t i = 0; i < g_slabs_count; ++i) {
+        ::new (&g_slabs[i]) slab_t{};
+    }
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        initFSA(g_fsa_pools[i], i);
+    }
+
+    g_thread_safe  = options.thread_safe;
+    g_remote_frees = options.remote_frees;
+
+    if (g_huge_pages == HugePages::Transparent) {
+        // only a hint: the kernel backs the ranges with huge pages on first touch when it has them to spare
+        madvise(g_fsa_arena_start, fsa_arena_size, MADV_HUGEPAGE);
+        madvise(g_regions_base, g_max_regions * REGION_SIZE, MADV_HUGEPAGE);
+    }
+
+    // the first arena is warmed up eagerly, the others grow their regions on first use
+    for (size_t i = 0; i < REGION_COUNT_BY_TYPE; ++i) {
+        region_t* region = allocateRegionByType(g_arenas[0], static_cast<RegionType>(i));
+        if (region) {
+            initializeRegion(g_arenas[0], region);
+        } else {
+            std::cerr << "ERROR: failed to allocate region of type=" << i << std::endl;
+            return;
+        }
+    }
+
+    if (options.profile_sample_bytes) {
+        // address space for the whole table, only the slots ever used get pages
+        void* samples = mmap(nullptr, PROFILE_TABLE_SIZE * sizeof(heap_sample_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (samples == MAP_FAILED) {
+            perror("mmap");
+        } else {
+            g_samples         = static_cast<heap_sample_t*>(samples);
+            g_samples_count   = 0;
+            g_sample_interval = options.profile_sample_bytes;
+            g_profile_prefix  = options.profile_prefix;
+            // backtrace() loads the unwinder on first use, and that allocates: better here than inside a sampled alloc()
+            void* frame = nullptr;
+            backtrace(&frame, 1);
+
+            if (options.profile_signal) {
+                struct sigaction action {};
+                action.sa_handler = dumpHeapProfileOnSignal;
+                action.sa_flags   = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                if (sigaction(options.profile_signal, &action, &g_previous_profile_action) == 0) {
+                    g_profile_signal = options.profile_signal;
+                }
+            }
+        }
+    }
+
+    if (options.trace_path) {
+        g_trace_fd = ::open(options.trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (g_trace_fd < 0) {
+            perror("open");
+        } else {
+            TraceFileHeader header{};
+            std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+            header.version = TRACE_VERSION;
+            writeAll(g_trace_fd, &header, sizeof(header));
+            g_trace_sequence.store(0, std::memory_order_relaxed);
+            g_trace_threads.store(0, std::memory_order_relaxed);
+            g_trace_clock_base = std::chrono::steady_clock::now();
+        }
+    }
+
+    g_epoch.fetch_add(1, std::memory_order_release);
+    is_initialized_ = true;
+}
+
+void MemoryAllocator::destroy()
+{
+    if (!is_initialized_ || !g_virtual_memory) {
+        return;
+    }
+
+#if ALLOCATOR_DEBUG
+    AllocatorStats snapshot = stats();
+    if (snapshot.allocations != snapshot.frees) {
+        std::cerr << "WARNING: memory leak has detected\n"
+                  << "fsa_allocs=" << snapshot.allocations - snapshot.coalesce.allocations - snapshot.large.allocations
+                  << "\ncoalesce_allocs=" << snapshot.coalesce.allocations << "\nlarge_allocs=" << snapshot.large.allocations
+                  << "\nWith total used memory=" << snapshot.live_bytes << std::endl;
+    }
+#endif
+
+    if (g_trace_fd >= 0) {
+        std::lock_guard lock{g_trace_mutex};
+        while (g_trace_buffers) {
+            flushTraceBuffer(*g_trace_buffers);
+            unlinkTraceBuffer(g_trace_buffers);
+        }
+        ::close(g_trace_fd);
+        g_trace_fd = -1;
+    }
+    if (g_profile_signal) {
+        sigaction(g_profile_signal, &g_previous_profile_action, nullptr);
+        g_profile_signal = 0;
+    }
+    if (g_samples) {
+        std::lock_guard lock{g_profile_mutex};
+        munmap(g_samples, PROFILE_TABLE_SIZE * sizeof(heap_sample_t));
+        g_samples         = nullptr;
+        g_samples_count   = 0;
+        g_sample_interval = 0;
+    }
+
+    munmap(g_virtual_memory, g_total_virtual_memory);
+    while (g_large_cache_count) {
+        evictLargeSpan(g_large_cache_count - 1);
+    }
+    if (g_large_table) {
+        munmap(g_large_table, g_large_table_size * sizeof(void*));
+        g_large_table       = nullptr;
+        g_large_table_size  = 0;
+        g_large_table_count = 0;
+    }
+
+    g_virtual_memory       = nullptr;
+    g_total_virtual_memory = 0;
+    g_regions              = nullptr;
+    g_max_regions          = DEFAULT_MAX_REGIONS;
+    g_regions_base         = nullptr;
+    g_arenas_count         = 1;
+    g_regions_count.store(0, std::memory_order_relaxed);
+
+    g_fsa_arena_start = nullptr;
+    g_fsa_arena_end   = nullptr;
+
+    g_slabs        = nullptr;
+    g_free_slabs   = nullptr;
+    g_slabs_count  = 0;
+    g_slabs_carved = 0;
+
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        initFSA(g_fsa_pools[i], i);
+    }
+
+    {
+        // the blocks still queued died with the mapping, the queues stay with their threads
+        std::lock_guard lock{g_remote_mutex};
+        for (remote_queue_t* queue = g_remote_queues; queue; queue = queue->next) {
+            for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+                queue->heads[i].store(nullptr, std::memory_order_relaxed);
+                queue->lengths[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    g_thread_safe   = false;
+    g_remote_frees  = true;
+    g_engine        = CoalesceEngine::SegregatedLists;
+    g_decay_ms      = -1;
+    g_lazy_purge    = false;
+    g_huge_pages    = HugePages::None;
+    g_lazy_carving  = false;
+    g_min_alignment = ALIGNMENT;
+    g_epoch.fetch_add(1, std::memory_order_release);
+    is_initialized_ = false;
+}
+
+void* MemoryAllocator::alloc(size_t size)
+{
+    assert(is_initialized_ && "allocator need to be initilized");
+
+    if (isTracing()) [[unlikely]] {
+        return traceAllocation(TraceOp::Alloc, size, 0, [&] { return alloc(size); });
+    }
+    if (size == 0 || size > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+    // objects no bigger than the default alignment cannot need more than it
+    if (g_min_alignment > ALIGNMENT && size > ALIGNMENT) {
+        return allocAligned(size, g_min_alignment);
+    }
+    if (g_sample_interval && shouldSample(size)) [[unlikely]] {
+        return allocateSampled(size, ALIGNMENT);
+    }
+
+    size_t aligned_size = alignSize(size);
+    void* result        = nullptr;
+
+    if (aligned_size < LARGE_ALLOC_THRESHOLD) [[likely]] {
+        size_t size_class = getFSASizeClass(aligned_size);
+        if (size_class < FSA_SIZES_COUNT) {
+            result = g_thread_safe ? allocFSACached(size_class, size) : allocFSACounted(g_fsa_pools[size_class], size);
+        }
+        if (!result) {
+            result = allocateFromArenas(aligned_size);
+            if (result) {
+                recordAlloc(COALESCE_BUCKET, getBlockFromPointer(result)->current_size - sizeof(block_t));
+            }
+        }
+    } else {
+        result = allocateLarge(aligned_size, ALIGNMENT);
+        if (result) {
+            recordAlloc(LARGE_BUCKET, aligned_size);
+        }
+    }
+
+    return result;
+}
+
+void MemoryAllocator::free(void* p)
+{
+    assert(is_initialized_ && "allocator need to be initilized");
+    if (!p) {
+        return;
+    }
+    // the block may be handed out again as soon as it is released, so the free takes its sequence number first
+    if (isTracing()) [[unlikely]] {
+        trace_scope_t scope;
+        recordTrace(TraceOp::Free, g_trace_sequence.fetch_add(1, std::memory_order_relaxed), p, 0, 0);
+        free(p);
+        return;
+    }
+
+    if (isInFSAArena(p)) {
+        size_t pool_index = getSlabFromPointer(p)->size_class;
+
+        if (pool_index < FSA_SIZES_COUNT) {
+            if (g_thread_safe) {
+                freeFSACached(p, pool_index);
+            } else {
+                freeFSA(p, g_fsa_pools[pool_index]);
+            }
+        } else {
+            throw std::runtime_error{"CRITICAL ERROR: pointer into an unassigned FSA slab"};
+        }
+        return;
+    }
+
+    if (region_t* region = findRegionForPointer(p)) {
+        if (block_t* block = getBlockFromPointer(p); block->is_sampled) [[unlikely]] {
+            block->is_sampled = false;
+            removeSample(p);
+        }
+        // a double free releases nothing and is not counted
+        if (size_t freed_bytes = freeToArena(region, p)) {
+            recordFree(COALESCE_BUCKET, freed_bytes);
+        }
+    } else if (isLargeAllocation(p)) {
+        if (getLargeHeader(p)->is_sampled) [[unlikely]] {
+            removeSample(p);
+        }
+        recordFree(LARGE_BUCKET, freeLarge(p));
+    } else {
+        throw std::runtime_error{"CRITICAL ERROR: pointer was not allocated by the allocator"};
+    }
+}
+
+bool MemoryAllocator::owns(const void* p) const noexcept
+{
+    if (!is_initialized_ || !p) {
+        return false;
+    }
+    void* ptr = const_cast<void*>(p);
+    return isInFSAArena(ptr) || findRegionForPointer(ptr) || isLargeAllocation(ptr);
+}
+
+size_t MemoryAllocator::usableSize(const void* p) const
+{
+    assert(is_initialized_ && "allocator need to be initilized");
+
+    void* ptr = const_cast<void*>(p);
+    if (isInFSAArena(ptr)) {
+        size_t size_class = getSlabFromPointer(ptr)->size_class;
+        if (size_class >= FSA_SIZES_COUNT) {
+            throw std::runtime_error{"CRITICAL ERROR: pointer into an unassigned FSA slab"};
+        }
+        return FSA_SIZES[size_class];
+    }
+    if (findRegionForPointer(ptr)) {
+        return getBlockFromPointer(ptr)->current_size - sizeof(block_t);
+    }
+    if (isLargeAllocation(ptr)) {
+        return getLargeUsableSize(ptr);
+    }
+    throw std::runtime_error{"CRITICAL ERROR: pointer was not allocated by the allocator"};
+}
+
+void* MemoryAllocator::allocSlab()
 {
-    pool.block_size  = block_size;
-    pool.memory_pool = memory;
-    pool.pool_size   = mem_size;
-    pool.used_blocks = 0;
-    pool.free_list   = nullptr;
-
-    assert((reinterpret_cast<uintptr_t>(memory) & (ALIGNMENT - 1)) == 0 && "a memory fot FSA is not aligned");
-
-    size_t block_count = mem_size / block_size;
-
-    for (size_t i = 0; i < block_count; ++i) {
-        free_list_t* block = reinterpret_cast<free_list_t*>(memory + i * block_size);
-
-        assert((reinterpret_cast<uintptr_t>(block) & (ALIGNMENT - 1)) == 0 && "a memory for FSA blocks is not aligned");
+    assert(is_initialized_ && "allocator need to be initilized");
 
-        block->next    = pool.free_list;
-        pool.free_list = block;
+    slab_t* slab = acquireSlab(WHOLE_SLAB_CLASS);
+    if (!slab) {
+        return nullptr;
     }
+    slab->used_blocks = 1;
+    return getSlabMemory(slab);
 }
 
-[[nodiscard]] void* allocFSA(FSAPool& pool) noexcept
+void MemoryAllocator::freeSlab(void* slab_memory)
 {
-    if (!pool.free_list) {
-        return nullptr;
+    if (!slab_memory) {
+        return;
     }
-
-    free_list_t* block = pool.free_list;
-    pool.free_list     = block->next;
-    pool.used_blocks++;
-
-    return block;
+    slab_t* slab = isInFSAArena(slab_memory) ? getSlabFromPointer(slab_memory) : nullptr;
+    if (!slab || slab->size_class != WHOLE_SLAB_CLASS || getSlabMemory(slab) != slab_memory) {
+        throw std::runtime_error{"CRITICAL ERROR: pointer is not a slab of allocSlab()"};
+    }
+    slab->used_blocks = 0;
+    releaseSlab(slab);
 }
 
-void freeFSA(void* ptr, FSAPool& pool) noexcept
+// Outer locks first: a region is taken under an arena lock and a slab under a pool lock, the others are never nested
+template <typename Fn>
+void forEachAllocatorLock(Fn&& fn) noexcept
 {
-    free_list_t* block = static_cast<free_list_t*>(ptr);
-    block->next        = pool.free_list;
-    pool.free_list     = block;
-    pool.used_blocks--;
+    fn(g_trace_mutex);
+    fn(g_profile_mutex);
+    fn(g_stats_mutex);
+    fn(g_remote_mutex);
+    for (arena_t& arena : g_arenas) {
+        fn(arena.mutex);
+    }
+    fn(g_regions_mutex);
+    for (FSAPool& pool : g_fsa_pools) {
+        fn(pool.mutex);
+    }
+    fn(g_slabs_mutex);
+    fn(g_large_mutex);
 }
 
-inline bool isInFSAArena(void* ptr) noexcept
+void MemoryAllocator::prepareFork() noexcept
 {
-    assert(g_fsa_arena_start < g_fsa_arena_end && "fsa area start > sfa area end!!!");
-    return ptr >= g_fsa_arena_start && ptr < g_fsa_arena_end;
+    forEachAllocatorLock([](std::mutex& mutex) { mutex.lock(); });
 }
 
-MemoryAllocator::~MemoryAllocator()
+void MemoryAllocator::afterForkParent() noexcept
 {
-    destroy();
+    forEachAllocatorLock([](std::mutex& mutex) { mutex.unlock(); });
 }
 
-void MemoryAllocator::init()
+void MemoryAllocator::afterForkChild() noexcept
 {
-    if (is_initialized_) {
+    forEachAllocatorLock([](std::mutex& mutex) { mutex.unlock(); });
+    if (!is_initialized_ || !g_remote_frees) {
         return;
     }
 
-    auto page_size = sysconf(_SC_PAGESIZE);
-    if (page_size == -1) {
-        perror("sysconf");
-        return;
+    // only the forking thread lives on, frees to the queues of the others would never be drained
+    for (remote_queue_t* queue = g_remote_queues; queue; queue = queue->next) {
+        if (queue != t_cache.remote && queue->is_owned.load(std::memory_order_relaxed)) {
+            releaseRemoteQueue(queue, true);
+        }
     }
+}
 
-    if (page_size != PAGE_SIZE) {
-        std::cerr << "ERROR: inappropriate page size on the system! sys_size=" << page_size << ", allocator_page_size=" << PAGE_SIZE << std::endl;
-        return;
+size_t MemoryAllocator::trim()
+{
+    if (!is_initialized_) {
+        return 0;
     }
 
-    g_virtual_memory = static_cast<char*>(mmap(nullptr, TOTAL_VIRTUAL_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    // blocks parked in the cache of the calling thread or queued for any thread would keep their slabs alive
+    if (g_thread_safe) {
+        thread_cache_t* cache = threadCache();
+        for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+            flushBatchFSA(g_fsa_pools[i], cache->bins[i], 0);
+        }
+        std::lock_guard lock{g_remote_mutex};
+        for (remote_queue_t* queue = g_remote_queues; queue; queue = queue->next) {
+            for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+                releaseRemoteChain(i, takeRemoteChain(*queue, i));
+            }
+        }
+    }
 
-    if (g_virtual_memory == MAP_FAILED) {
-        std::cerr << "Failed to allocate virtual memory" << std::endl;
-        perror("mmap");
-        return;
+    // a pool keeps its last empty slab to avoid ping-pong with the reserve, trimming takes it too
+    size_t purged = 0;
+    for (FSAPool& pool : g_fsa_pools) {
+        auto lock = lockShared(pool.mutex);
+        for (slab_t* slab = pool.partial_slabs; slab;) {
+            slab_t* next = slab->next;
+            if (slab->used_blocks == 0) {
+                unlinkPartialSlab(pool, slab);
+                pool.slabs_count--;
+                purged += releaseSlab(slab);
+            }
+            slab = next;
+        }
+    }
+    {
+        auto lock = lockShared(g_slabs_mutex);
+        purged += purgeSlabReserve(false, 0);
+    }
+    for (size_t i = 0; i < g_arenas_count; ++i) {
+        auto lock = lockShared(g_arenas[i].mutex);
+        purged += purgeArena(g_arenas[i], false, 0);
+        for (region_t* region : g_arenas[i].top_regions) {
+            if (region) {
+                purged += purgeWilderness(region);
+            }
+        }
+    }
+    {
+        auto lock = lockShared(g_large_mutex);
+        purged += evictLargeSpans(false, 0);
     }
+    return purged;
+}
 
-    mprotect(g_virtual_memory, PAGE_SIZE, PROT_NONE);
-    mprotect(g_virtual_memory + TOTAL_VIRTUAL_MEMORY - PAGE_SIZE, PAGE_SIZE, PROT_NONE);
+HugePageStats MemoryAllocator::hugePageStats() const
+{
+    HugePageStats stats;
+    if (!is_initialized_) {
+        return stats;
+    }
+    stats.mode = g_huge_pages;
+
+    // the reservation is split into several mappings by the guard pages and the madvise() hints
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(g_virtual_memory);
+    const uintptr_t end   = begin + g_total_virtual_memory;
+
+    std::ifstream smaps{"/proc/self/smaps"};
+    std::string line;
+    bool inside = false;
+    while (std::getline(smaps, line)) {
+        uintptr_t vma_begin = 0;
+        uintptr_t vma_end   = 0;
+        if (std::sscanf(line.c_str(), "%lx-%lx ", &vma_begin, &vma_end) == 2) {
+            inside = vma_begin >= begin && vma_end <= end;
+            continue;
+        }
+        if (!inside) {
+            continue;
+        }
 
-    char* usable_memory = g_virtual_memory + PAGE_SIZE;
-    size_t usable_size  = TOTAL_VIRTUAL_MEMORY - PAGE_SIZE * 2;
-    size_t offset       = 0;
+        size_t kilobytes = 0;
+        char field[64];
+        if (std::sscanf(line.c_str(), "%63[^:]: %zu kB", field, &kilobytes) != 2) {
+            continue;
+        }
+        std::string_view name{field};
+        if (name == "Rss") {
+            stats.resident_bytes += kilobytes * 1_KB;
+        } else if (name == "AnonHugePages") {
+            stats.huge_bytes += kilobytes * 1_KB;
+        } else if (name == "Private_Hugetlb" || name == "Shared_Hugetlb") {
+            stats.resident_bytes += kilobytes * 1_KB;
+            stats.huge_bytes += kilobytes * 1_KB;
+        }
+    }
+    return stats;
+}
 
-    auto advanceAligned = [&](size_t size) -> char* {
-        offset       = alignSize(offset);
-        char* result = usable_memory + offset;
-        offset += size;
-        return result;
+PurgeStats MemoryAllocator::purgeStats() const
+{
+    return PurgeStats{
+        .purged_bytes = g_purged_bytes.load(std::memory_order_relaxed),
+        .purge_calls  = g_purge_calls.load(std::memory_order_relaxed),
     };
+}
 
-    g_regions = reinterpret_cast<region_t*>(advanceAligned(MAX_REGIONS * sizeof(region_t)));
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
-        g_regions[i].start       = nullptr;
-        g_regions[i].end         = nullptr;
-        g_regions[i].is_used     = false;
-        g_regions[i].region_type = RegionType::SMALL;
+std::vector<SizeClassStats> MemoryAllocator::sizeClassStats() const
+{
+    std::vector<SizeClassStats> result;
+    if (!is_initialized_) {
+        return result;
     }
 
-    g_free_lists = reinterpret_cast<free_node_t**>(advanceAligned(COALESCE_LISTS_COUNT * sizeof(free_node_t*)));
-    for (size_t i = 0; i < COALESCE_LISTS_COUNT; ++i) {
-        g_free_lists[i] = nullptr;
-    }
+    result.reserve(FSA_SIZES_COUNT);
+    for (FSAPool& pool : g_fsa_pools) {
+        auto lock = lockShared(pool.mutex);
 
-    if (offset >= usable_size) [[unlikely]] {
-        std::cerr << "Not enough space for metadata" << std::endl;
-        munmap(g_virtual_memory, TOTAL_VIRTUAL_MEMORY);
-        return;
+        SizeClassStats stats;
+        stats.block_size      = pool.block_size;
+        stats.allocations     = pool.allocations;
+        stats.requested_bytes = pool.requested_bytes;
+        stats.allocated_bytes = pool.allocations * pool.block_size;
+        if (stats.allocated_bytes) {
+            stats.internal_fragmentation = 1.0 - static_cast<double>(stats.requested_bytes) / stats.allocated_bytes;
+        }
+        result.push_back(stats);
     }
+    return result;
+}
 
-    // TODO: I should experiment with a set pf parameters
-    size_t nodes_memory = usable_size / 10;
-    g_max_free_nodes    = nodes_memory / sizeof(free_node_t);
-    if (g_max_free_nodes < 10000) {
-        g_max_free_nodes = 10000;
+AllocatorStats MemoryAllocator::stats() const
+{
+    AllocatorStats result;
+    if (!is_initialized_) {
+        return result;
     }
 
-    g_free_nodes_pool = reinterpret_cast<free_node_t*>(advanceAligned(g_max_free_nodes * sizeof(free_node_t)));
-
-    for (size_t i = 0; i < g_max_free_nodes; ++i) {
-        ::new (&g_free_nodes_pool[i]) free_node_t{};
+    stat_totals_t totals[STATS_BUCKETS_COUNT];
+    {
+        std::lock_guard lock{g_stats_mutex};
+        collectStats(totals);
+        for (size_t i = 0; i < STATS_BUCKETS_COUNT; ++i) {
+            totals[i].allocations -= g_stats_base[i].allocations;
+            totals[i].frees -= g_stats_base[i].frees;
+            totals[i].allocated_bytes -= g_stats_base[i].allocated_bytes;
+            totals[i].freed_bytes -= g_stats_base[i].freed_bytes;
+        }
+        for (thread_stats_t* stats = g_stats_threads; stats; stats = stats->next) {
+            result.threads++;
+        }
     }
-    g_free_nodes_used = 0;
-
-    size_t fsa_arena_size = alignToPage(FSA_ARENA_SIZE);
-    offset                = alignSize(offset);
-
-    if (offset + fsa_arena_size > usable_size) [[unlikely]] {
-        std::cerr << "Not enough space for FSA arena" << std::endl;
-        munmap(g_virtual_memory, TOTAL_VIRTUAL_MEMORY);
-        g_virtual_memory = nullptr;
-        return;
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        // without thread caches the pools count themselves, and they start over at init()
+        if (!g_thread_safe) {
+            totals[i].allocations += g_fsa_pools[i].allocations;
+            totals[i].frees += g_fsa_pools[i].allocations - g_fsa_pools[i].used_blocks;
+        }
+        totals[i].allocated_bytes = totals[i].allocations * FSA_SIZES[i];
+        totals[i].freed_bytes     = totals[i].frees * FSA_SIZES[i];
+    }
+
+    auto toCounters = [&](size_t bucket, size_t block_size) {
+        AllocationCounters counters;
+        counters.block_size  = block_size;
+        counters.allocations = totals[bucket].allocations;
+        counters.frees       = totals[bucket].frees;
+        counters.live_bytes  = totals[bucket].allocated_bytes - totals[bucket].freed_bytes;
+        result.allocations += counters.allocations;
+        result.frees += counters.frees;
+        result.live_bytes += counters.live_bytes;
+        return counters;
+    };
+    result.size_classes.reserve(FSA_SIZES_COUNT);
+    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
+        result.size_classes.push_back(toCounters(i, FSA_SIZES[i]));
+    }
+    result.coalesce        = toCounters(COALESCE_BUCKET, 0);
+    result.large           = toCounters(LARGE_BUCKET, 0);
+    result.peak_live_bytes = std::max(g_peak_live_bytes.load(std::memory_order_relaxed), result.live_bytes);
+
+    result.regions_reserved = g_max_regions;
+    result.regions_used     = g_regions_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < result.regions_used; ++i) {
+        switch (g_regions[i].region_type) {
+            case RegionType::SMALL:
+                result.small_regions++;
+                break;
+            case RegionType::MEDIUM:
+                result.medium_regions++;
+                break;
+            case RegionType::LARGE:
+                result.large_regions++;
+                break;
+        }
     }
+    {
+        auto lock          = lockShared(g_slabs_mutex);
+        size_t empty_slabs = 0;
+        for (slab_t* slab = g_free_slabs; slab; slab = slab->next) {
+            empty_slabs++;
+        }
+        result.fsa_slabs_used  = g_slabs_carved - empty_slabs;
+        result.fsa_slabs_total = g_slabs_count;
+    }
+    {
+        auto lock                 = lockShared(g_large_mutex);
+        result.large_cached_bytes = g_large_cache_bytes;
+    }
+    result.purge = purgeStats();
+    return result;
+}
 
-    g_fsa_arena_start = usable_memory + offset;
-    g_fsa_arena_end   = g_fsa_arena_start + fsa_arena_size;
-    offset += fsa_arena_size;
-
-    size_t fsa_memory_per_pool = fsa_arena_size / FSA_SIZES_COUNT;
-    fsa_memory_per_pool        = alignSize(fsa_memory_per_pool);
-    assert((fsa_memory_per_pool & (fsa_memory_per_pool - 1)) == 0 && "fsa per pool size must be power of two");
+FragmentationReport MemoryAllocator::fragmentation() const
+{
+    FragmentationReport report;
+    if (!is_initialized_) {
+        return report;
+    }
 
-    char* current_pool_start = g_fsa_arena_start;
-    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
-        uintptr_t addr = reinterpret_cast<uintptr_t>(current_pool_start);
-        if (addr & (ALIGNMENT - 1)) {
-            addr               = alignSize(addr);
-            current_pool_start = reinterpret_cast<char*>(addr);
+    size_histogram_t heap_histogram{};
+    const size_t regions_count = g_regions_count.load(std::memory_order_acquire);
+    report.regions.reserve(regions_count);
+    for (size_t i = 0; i < regions_count; ++i) {
+        const region_t& region = g_regions[i];
+        if (!region.is_used) {
+            continue;
         }
 
-        size_t actual_pool_size = fsa_memory_per_pool;
-        if (current_pool_start + actual_pool_size > g_fsa_arena_end) {
-            actual_pool_size = g_fsa_arena_end - current_pool_start;
+        RegionFragmentation stats;
+        stats.index = i;
+        stats.arena = region.arena_index;
+        switch (region.region_type) {
+            case RegionType::SMALL:
+                stats.max_request = SMALL_REGION_MAX;
+                break;
+            case RegionType::MEDIUM:
+                stats.max_request = MEDIUM_REGION_MAX;
+                break;
+            case RegionType::LARGE:
+                stats.max_request = LARGE_ALLOC_THRESHOLD;
+                break;
         }
 
-        initFSA(g_fsa_pools[i], FSA_SIZES[i], current_pool_start, actual_pool_size);
-        current_pool_start += actual_pool_size;
+        size_histogram_t histogram{};
+        {
+            arena_t& arena = g_arenas[region.arena_index];
+            auto lock      = lockShared(arena.mutex);
+            forEachBlock(region, [&](const block_t* block) {
+                const size_t size = block->current_size;
+                addToHistogram(histogram, size, block->is_free);
+                addToHistogram(heap_histogram, size, block->is_free);
+                if (block->is_free) {
+                    stats.free_blocks++;
+                    stats.free_bytes += size;
+                    stats.largest_free_block = std::max(stats.largest_free_block, size);
+                } else {
+                    stats.used_blocks++;
+                    stats.used_bytes += size;
+                }
+            });
+            // the tail of a retired top region is too small to ever become a block
+            if (arena.top_regions[static_cast<size_t>(region.region_type)] == &region) {
+                stats.wilderness_bytes = region.end - region.top;
+            }
+        }
+        stats.largest_free_block     = std::max(stats.largest_free_block, stats.wilderness_bytes);
+        stats.external_fragmentation = externalFragmentation(stats.largest_free_block, stats.free_bytes + stats.wilderness_bytes);
+        stats.histogram              = compactHistogram(histogram);
+
+        report.used_bytes += stats.used_bytes;
+        report.free_bytes += stats.free_bytes;
+        report.wilderness_bytes += stats.wilderness_bytes;
+        report.largest_free_block = std::max(report.largest_free_block, stats.largest_free_block);
+        report.header_bytes += (stats.used_blocks + stats.free_blocks) * sizeof(block_t);
+        report.regions.push_back(std::move(stats));
+    }
+    report.external_fragmentation = externalFragmentation(report.largest_free_block, report.free_bytes + report.wilderness_bytes);
+    report.histogram              = compactHistogram(heap_histogram);
+
+    if (g_engine == CoalesceEngine::TLSF) {
+        std::array<FreeListFragmentation, TLSF_FL_COUNT> levels{};
+        for (size_t i = 0; i < g_arenas_count; ++i) {
+            auto lock = lockShared(g_arenas[i].mutex);
+            for (size_t bin = 0; bin < TLSF_FL_COUNT * TLSF_SL_COUNT; ++bin) {
+                for (free_node_t* node = g_arenas[i].tlsf_bins[bin]; node; node = node->next) {
+                    addFreeListBlock(levels[bin / TLSF_SL_COUNT], node->header->current_size);
+                }
+            }
+        }
+        for (size_t fl = 0; fl < TLSF_FL_COUNT; ++fl) {
+            if (levels[fl].blocks) {
+                levels[fl].min_size = size_t{1} << fl;
+                report.free_lists.push_back(levels[fl]);
+            }
+        }
+    } else {
+        // the lists are picked by the payload size, min_size counts the header like everywhere else
+        std::array<FreeListFragmentation, COALESCE_LISTS_COUNT> lists{};
+        lists[0].min_size = MIN_BLOCK_SIZE;
+        lists[1].min_size = SMALL_REGION_MAX + 1 + sizeof(block_t);
+        lists[2].min_size = MEDIUM_REGION_MAX + 1 + sizeof(block_t);
+        for (size_t i = 0; i < g_arenas_count; ++i) {
+            auto lock = lockShared(g_arenas[i].mutex);
+            for (size_t list = 0; list < COALESCE_LISTS_COUNT; ++list) {
+                for (free_node_t* node = g_arenas[i].free_lists[list]; node; node = node->next) {
+                    addFreeListBlock(lists[list], node->header->current_size);
+                }
+            }
+        }
+        report.free_lists.assign(lists.begin(), lists.end());
+    }
+    for (const FreeListFragmentation& list : report.free_lists) {
+        report.free_nodes += list.blocks;
     }
 
-    g_current_offset = alignSize(offset);
+    report.fsa_pools.reserve(FSA_SIZES_COUNT);
+    for (FSAPool& pool : g_fsa_pools) {
+        auto lock = lockShared(pool.mutex);
 
-    for (size_t i = 0; i < REGION_COUNT_BY_TYPE; ++i) {
-        region_t* region = allocateRegionByType(static_cast<RegionType>(i));
-        if (region) {
-            initializeRegion(region);
-        } else {
-            std::cerr << "ERROR: failed to allocate region of type=" << i << std::endl;
-            return;
+        FSAPoolFragmentation stats;
+        stats.block_size      = pool.block_size;
+        stats.slabs           = pool.slabs_count;
+        stats.capacity_blocks = pool.slabs_count * (FSA_SLAB_SIZE / pool.block_size);
+        stats.used_blocks     = pool.used_blocks;
+        if (stats.capacity_blocks) {
+            stats.occupancy = static_cast<double>(stats.used_blocks) / stats.capacity_blocks;
+        }
+        report.fsa_pools.push_back(stats);
+    }
+    {
+        auto lock          = lockShared(g_slabs_mutex);
+        size_t empty_slabs = 0;
+        for (slab_t* slab = g_free_slabs; slab; slab = slab->next) {
+            empty_slabs++;
         }
+        report.fsa_slabs_used  = g_slabs_carved - empty_slabs;
+        report.fsa_slabs_total = g_slabs_count;
     }
+    return report;
+}
 
-    is_initialized_ = true;
+std::string toJson(const FragmentationReport& report)
+{
+    std::string out{"{"};
+    appendJson(out, "used_bytes", report.used_bytes);
+    appendJson(out, "free_bytes", report.free_bytes);
+    appendJson(out, "wilderness_bytes", report.wilderness_bytes);
+    appendJson(out, "largest_free_block", report.largest_free_block);
+    appendJson(out, "external_fragmentation", report.external_fragmentation);
+    appendJson(out, "header_bytes", report.header_bytes);
+    appendJson(out, "free_nodes", report.free_nodes);
+    appendJson(out, "fsa_slabs_used", report.fsa_slabs_used);
+    appendJson(out, "fsa_slabs_total", report.fsa_slabs_total);
+    appendJson(out, "histogram", report.histogram);
+
+    appendJsonKey(out, "regions");
+    out += '[';
+    for (const RegionFragmentation& region : report.regions) {
+        appendJsonKey(out, nullptr);
+        out += '{';
+        appendJson(out, "index", region.index);
+        appendJson(out, "arena", region.arena);
+        appendJson(out, "max_request", region.max_request);
+        appendJson(out, "used_blocks", region.used_blocks);
+        appendJson(out, "used_bytes", region.used_bytes);
+        appendJson(out, "free_blocks", region.free_blocks);
+        appendJson(out, "free_bytes", region.free_bytes);
+        appendJson(out, "wilderness_bytes", region.wilderness_bytes);
+        appendJson(out, "largest_free_block", region.largest_free_block);
+        appendJson(out, "external_fragmentation", region.external_fragmentation);
+        appendJson(out, "histogram", region.histogram);
+        out += '}';
+    }
+    out += ']';
+
+    appendJsonKey(out, "free_lists");
+    out += '[';
+    for (const FreeListFragmentation& list : report.free_lists) {
+        appendJsonKey(out, nullptr);
+        out += '{';
+        appendJson(out, "min_size", list.min_size);
+        appendJson(out, "blocks", list.blocks);
+        appendJson(out, "bytes", list.bytes);
+        appendJson(out, "largest_block", list.largest_block);
+        out += '}';
+    }
+    out += ']';
+
+    appendJsonKey(out, "fsa_pools");
+    out += '[';
+    for (const FSAPoolFragmentation& pool : report.fsa_pools) {
+        appendJsonKey(out, nullptr);
+        out += '{';
+        appendJson(out, "block_size", pool.block_size);
+        appendJson(out, "slabs", pool.slabs);
+        appendJson(out, "capacity_blocks", pool.capacity_blocks);
+        appendJson(out, "used_blocks", pool.used_blocks);
+        appendJson(out, "occupancy", pool.occupancy);
+        out += '}';
+    }
+    out += "]}";
+    return out;
 }
 
-void MemoryAllocator::destroy()
+void* MemoryAllocator::calloc(size_t count, size_t size)
 {
-    if (!is_initialized_ || !g_virtual_memory) {
-        return;
-    }
+    assert(is_initialized_ && "allocator need to be initilized");
 
-#if ALLOCATOR_DEBUG
-    if (stats_.total_allocations != stats_.total_frees) {
-        std::cerr << "WARNING: memory leak has detected\n"
-                  << "fsa_allocs=" << stats_.fsa_alloc_count << "\ncoalesce_allocs=" << stats_.coalesce_alloc_count
-                  << "\nlarge_allocs=" << stats_.large_alloc_count << "\nWith total used memory=" << stats_.current_allocated << std::endl;
+    size_t bytes = 0;
+    // an array past MAX_ALLOC_SIZE would wrap alignSize() and come back as a tiny block
+    if (__builtin_mul_overflow(count, size, &bytes) || bytes == 0 || bytes > MAX_ALLOC_SIZE) {
+        return nullptr;
+    }
+    if (isTracing()) [[unlikely]] {
+        return traceAllocation(TraceOp::Calloc, bytes, 0, [&] { return calloc(count, size); });
     }
-    stats_ = Statistics{};
-#endif
-
-    munmap(g_virtual_memory, TOTAL_VIRTUAL_MEMORY);
-
-    g_virtual_memory  = nullptr;
-    g_regions         = nullptr;
-    g_free_nodes_pool = nullptr;
-    g_free_lists      = nullptr;
-    g_free_nodes_used = 0;
-    g_current_offset  = 0;
-    g_max_free_nodes  = 0;
 
-    g_fsa_arena_start = nullptr;
-    g_fsa_arena_end   = nullptr;
+    size_t aligned_size = alignSize(bytes);
+    if (aligned_size >= LARGE_ALLOC_THRESHOLD) {
+        if (g_sample_interval && shouldSample(bytes)) [[unlikely]] {
+            void* result = allocateSampled(bytes, g_min_alignment);
+            if (result) {
+                std::memset(result, 0, bytes);
+            }
+            return result;
+        }
+        // a fresh mapping is zero-filled by the kernel, only a recycled span has to be cleared
+        bool is_fresh = false;
+        void* result  = allocateLarge(aligned_size, g_min_alignment, &is_fresh);
+        if (result && !is_fresh) {
+            std::memset(result, 0, bytes);
+        }
+        if (result) {
+            recordAlloc(LARGE_BUCKET, aligned_size);
+        }
+        return result;
+    }
 
-    for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
-        g_fsa_pools[i].memory_pool = nullptr;
-        g_fsa_pools[i].free_list   = nullptr;
-        g_fsa_pools[i].used_blocks = 0;
+    void* result = alloc(bytes);
+    if (!result) {
+        return nullptr;
     }
 
-    is_initialized_ = false;
+    // a block carved from never written pages only carries its stale free-list node
+    if (!isInFSAArena(result) && getBlockFromPointer(result)->is_zeroed) {
+        std::memset(result, 0, std::min(bytes, sizeof(free_node_t)));
+    } else {
+        std::memset(result, 0, bytes);
+    }
+    return result;
 }
 
-void* MemoryAllocator::alloc(size_t size)
+void* MemoryAllocator::allocAligned(size_t size, size_t alignment)
 {
     assert(is_initialized_ && "allocator need to be initilized");
 
-    if (size == 0) {
+    if (!std::has_single_bit(alignment)) {
         return nullptr;
     }
+    if (isTracing()) [[unlikely]] {
+        return traceAllocation(TraceOp::AllocAligned, size, alignment, [&] { return allocAligned(size, alignment); });
+    }
+    if (alignment <= ALIGNMENT) {
+        return alloc(size);
+    }
+    // keeps aligned_size + alignment from wrapping below LARGE_ALLOC_THRESHOLD
+    if (size == 0 || size > MAX_ALLOC_SIZE || alignment > MAX_ALLOC_SIZE - size) {
+        return nullptr;
+    }
+    if (g_sample_interval && shouldSample(size)) [[unlikely]] {
+        return allocateSampled(size, alignment);
+    }
 
     size_t aligned_size = alignSize(size);
     void* result        = nullptr;
 
-    if (aligned_size < LARGE_ALLOC_THRESHOLD) [[likely]] {
-        size_t size_class = getFSASizeClass(aligned_size);
+    if (aligned_size + alignment < LARGE_ALLOC_THRESHOLD) [[likely]] {
+        size_t size_class = getFSAAlignedSizeClass(aligned_size, alignment);
         if (size_class < FSA_SIZES_COUNT) {
-            result = allocFSA(g_fsa_pools[size_class]);
-#if ALLOCATOR_DEBUG
-            stats_.fsa_alloc_count++;
-            stats_.total_allocations++;
-            stats_.current_allocated += g_fsa_pools[size_class].block_size;
-            stats_.peak_allocated = std::max(stats_.peak_allocated, stats_.current_allocated);
-#endif
+            result = g_thread_safe ? allocFSACached(size_class, size) : allocFSACounted(g_fsa_pools[size_class], size);
         }
         if (!result) {
-            result = allocateFromCoalesce(aligned_size);
-#if ALLOCATOR_DEBUG
+            result = allocateFromArenas(aligned_size, alignment);
             if (result) {
-                stats_.coalesce_alloc_count++;
-                stats_.total_allocations++;
-                stats_.current_allocated += size;
-                stats_.peak_allocated = std::max(stats_.peak_allocated, stats_.current_allocated);
+                recordAlloc(COALESCE_BUCKET, getBlockFromPointer(result)->current_size - sizeof(block_t));
             }
-#endif
         }
     } else {
-        result = ::malloc(aligned_size);
-#if ALLOCATOR_DEBUG
+        result = allocateLarge(aligned_size, alignment);
         if (result) {
-            stats_.large_alloc_count++;
-            stats_.total_allocations++;
-            stats_.current_allocated += aligned_size;
-            stats_.peak_allocated     = std::max(stats_.peak_allocated, stats_.current_allocated);
-            large_allocs_map_[result] = aligned_size;
+            recordAlloc(LARGE_BUCKET, aligned_size);
         }
-#endif
     }
 
+    assert((reinterpret_cast<uintptr_t>(result) & (alignment - 1)) == 0 && "allocAligned broke its alignment");
     return result;
 }
 
-void MemoryAllocator::free(void* p)
+void* MemoryAllocator::realloc(void* p, size_t size)
 {
     assert(is_initialized_ && "allocator need to be initilized");
+
     if (!p) {
-        return;
+        return alloc(size);
+    }
+    if (size == 0) {
+        free(p);
+        return nullptr;
+    }
+    if (isTracing()) [[unlikely]] {
+        return traceAllocation(TraceOp::Realloc, size, reinterpret_cast<uintptr_t>(p), [&] { return realloc(p, size); });
+    }
+    if (size > MAX_ALLOC_SIZE) {
+        return nullptr;
     }
 
-    if (isInFSAArena(p)) {
-        char* pools_start = g_fsa_pools[0].memory_pool;
-        size_t pool_size  = g_fsa_pools[0].pool_size;
-        size_t pool_index = static_cast<size_t>((static_cast<char*>(p) - pools_start)) >> std::countr_zero(pool_size);
+    size_t aligned_size = alignSize(size);
+    size_t old_size     = 0; // usable bytes of the old block, all a move has to copy
 
-        if (pool_index < FSA_SIZES_COUNT) {
-            freeFSA(p, g_fsa_pools[pool_index]);
-#if ALLOCATOR_DEBUG
-            stats_.total_frees++;
-            stats_.current_allocated -= g_fsa_pools[pool_index].block_size;
-#endif
-        } else {
-            throw std::runtime_error{"CRITICAL ERROR: problems with index estimation"};
+    if (isInFSAArena(p)) {
+        size_t size_class = getSlabFromPointer(p)->size_class;
+        if (size_class >= FSA_SIZES_COUNT) {
+            throw std::runtime_error{"CRITICAL ERROR: pointer into an unassigned FSA slab"};
         }
-    } else if (isPointerInCoalesceRegion(p)) {
-        [[maybe_unused]] size_t freed_meme = freeCoalesce(p);
-#if ALLOCATOR_DEBUG
-        stats_.total_frees += freed_meme != 0;
-        stats_.current_allocated -= freed_meme;
-#endif
-    } else {
-#if ALLOCATOR_DEBUG
-        if (auto it = large_allocs_map_.find(p); it != large_allocs_map_.end()) {
-            stats_.large_alloc_count--;
-            stats_.total_frees++;
-            stats_.current_allocated -= it->second;
-            large_allocs_map_.erase(it);
+        if (getFSAAlignedSizeClass(aligned_size, size > ALIGNMENT ? g_min_alignment : ALIGNMENT) == size_class) {
+            return p;
         }
-#endif
-        ::free(p);
+        old_size = FSA_SIZES[size_class];
+    } else if (region_t* region = findRegionForPointer(p)) {
+        block_t* block = getBlockFromPointer(p);
+        old_size       = block->current_size - sizeof(block_t);
+
+        // a sampled block always moves, its record keeps the size it was allocated with
+        if (aligned_size < LARGE_ALLOC_THRESHOLD && !block->is_sampled) {
+            arena_t& arena = g_arenas[region->arena_index];
+            auto lock      = lockShared(arena.mutex);
+            if (resizeCoalesce(arena, region, p, aligned_size)) {
+                recordResize(COALESCE_BUCKET, old_size, block->current_size - sizeof(block_t));
+                return p;
+            }
+        }
+    } else if (isLargeAllocation(p)) {
+        old_size = getLargeUsableSize(p);
+        if (aligned_size >= LARGE_ALLOC_THRESHOLD && !getLargeHeader(p)->is_sampled) {
+            size_t old_aligned_size = getLargeHeader(p)->size;
+            // mremap moves the pages instead of copying them
+            void* result = resizeLarge(p, aligned_size);
+            if (result) {
+                recordResize(LARGE_BUCKET, old_aligned_size, aligned_size);
+            }
+            return result;
+        }
+    } else {
+        throw std::runtime_error{"CRITICAL ERROR: pointer was not allocated by the allocator"};
     }
+
+    void* result = alloc(size);
+    if (result) {
+        std::memcpy(result, p, std::min(old_size, size));
+        free(p);
+    }
+    return result;
 }
 
-#if ALLOCATOR_DEBUG
 void MemoryAllocator::dumpStat() const
 {
     if (!is_initialized_) {
@@ -894,72 +3887,160 @@ void MemoryAllocator::dumpStat() const
         return;
     }
 
+    AllocatorStats snapshot = stats();
     std::cout << "=== Memory Allocator Statistics ===\n";
-    std::cout << "Total allocations: " << stats_.total_allocations << "\n";
-    std::cout << "Total frees: " << stats_.total_frees << "\n";
-    std::cout << "Current allocated: " << stats_.current_allocated << " bytes\n";
-    std::cout << "Peak allocated: " << stats_.peak_allocated << " bytes\n";
-    std::cout << "FSA allocations: " << stats_.fsa_alloc_count << "\n";
-    std::cout << "Coalesce allocations: " << stats_.coalesce_alloc_count << "\n";
-    std::cout << "Large allocations: " << stats_.large_alloc_count << "\n";
-
-    size_t used_regions   = 0;
-    size_t small_regions  = 0;
-    size_t medium_regions = 0;
-    size_t large_regions  = 0;
-
-    if (g_regions) {
-        for (size_t i = 0; i < MAX_REGIONS; ++i) {
-            if (g_regions[i].is_used) {
-                used_regions++;
-                switch (g_regions[i].region_type) {
-                    case RegionType::SMALL:
-                        small_regions++;
-                        break;
-                    case RegionType::MEDIUM:
-                        medium_regions++;
-                        break;
-                    case RegionType::LARGE:
-                        large_regions++;
-                        break;
-                }
-            }
-        }
-    }
+    std::cout << "Total allocations: " << snapshot.allocations << "\n";
+    std::cout << "Total frees: " << snapshot.frees << "\n";
+    std::cout << "Current allocated: " << snapshot.live_bytes << " bytes\n";
+    std::cout << "Peak allocated: " << snapshot.peak_live_bytes << " bytes\n";
+    std::cout << "FSA allocations: " << snapshot.allocations - snapshot.coalesce.allocations - snapshot.large.allocations << "\n";
+    std::cout << "Coalesce allocations: " << snapshot.coalesce.allocations << "\n";
+    std::cout << "Large allocations: " << snapshot.large.allocations << "\n";
+    std::cout << "Purged: " << snapshot.purge.purged_bytes << " bytes in " << snapshot.purge.purge_calls << " calls\n";
 
     std::cout << "\nRegion Usage:\n";
-    std::cout << "  Total used: " << used_regions << "/" << MAX_REGIONS << "\n";
-    std::cout << "  Small regions (<=10KB): " << small_regions << "\n";
-    std::cout << "  Medium regions (<=1MB): " << medium_regions << "\n";
-    std::cout << "  Large regions (<=10MB): " << large_regions << "\n";
+    std::cout << "  Total used: " << snapshot.regions_used << "/" << snapshot.regions_reserved << "\n";
+    std::cout << "  Small regions (<=10KB): " << snapshot.small_regions << "\n";
+    std::cout << "  Medium regions (<=1MB): " << snapshot.medium_regions << "\n";
+    std::cout << "  Large regions (<=10MB): " << snapshot.large_regions << "\n";
 
     std::cout << "\nFSA Pool Usage:\n";
     for (size_t i = 0; i < FSA_SIZES_COUNT; ++i) {
-        size_t total_blocks = g_fsa_pools[i].pool_size / g_fsa_pools[i].block_size;
-        double usage        = static_cast<double>(g_fsa_pools[i].used_blocks) / total_blocks * 100.0;
+        auto lock           = lockShared(g_fsa_pools[i].mutex);
+        size_t total_blocks = g_fsa_pools[i].slabs_count * (FSA_SLAB_SIZE / g_fsa_pools[i].block_size);
+        size_t served_bytes = g_fsa_pools[i].allocations * g_fsa_pools[i].block_size;
+        double usage        = total_blocks ? static_cast<double>(g_fsa_pools[i].used_blocks) / total_blocks * 100.0 : 0.0;
+        double waste        = served_bytes ? 100.0 - static_cast<double>(g_fsa_pools[i].requested_bytes) / served_bytes * 100.0 : 0.0;
         std::cout << "  Size " << g_fsa_pools[i].block_size << " bytes: " << g_fsa_pools[i].used_blocks << "/" << total_blocks << " blocks (" << usage
-                  << "%)\n";
-    }
-
-    std::cout << "\nCoalesce Free Lists:\n";
-    if (g_free_lists) {
+                  << "%) in " << g_fsa_pools[i].slabs_count << " slabs, " << waste << "% lost to rounding\n";
+    }
+    std::cout << "  Slab reserve: " << snapshot.fsa_slabs_used << "/" << snapshot.fsa_slabs_total << " slabs in use\n";
+
+    if (g_engine == CoalesceEngine::TLSF) {
+        size_t count     = 0;
+        size_t used_bins = 0;
+        for (size_t i = 0; i < g_arenas_count; ++i) {
+            auto lock = lockShared(g_arenas[i].mutex);
+            for (free_node_t* bin : g_arenas[i].tlsf_bins) {
+                used_bins += bin != nullptr;
+                for (free_node_t* current = bin; current; current = current->next) {
+                    count++;
+                }
+            }
+        }
+        std::cout << "\nTLSF bins (" << g_arenas_count << " arenas): " << count << " free blocks in " << used_bins << " bins\n";
+    } else {
+        std::cout << "\nCoalesce Free Lists (" << g_arenas_count << " arenas):\n";
         static const char* list_names[] = {"Small (<=10KB)", "Medium (<=1MB)", "Large (<=10MB)"};
         for (size_t i = 0; i < COALESCE_LISTS_COUNT; ++i) {
-            size_t count         = 0;
-            free_node_t* current = g_free_lists[i];
-            while (current) {
-                count++;
-                current = current->next;
+            size_t count = 0;
+            for (size_t j = 0; j < g_arenas_count; ++j) {
+                auto lock            = lockShared(g_arenas[j].mutex);
+                free_node_t* current = g_arenas[j].free_lists[i];
+                while (current) {
+                    count++;
+                    current = current->next;
+                }
             }
             std::cout << "  " << list_names[i] << ": " << count << " free blocks\n";
         }
     }
 
-    std::cout << "\nFree nodes: " << g_free_nodes_used << "/" << g_max_free_nodes << " used (" << (g_free_nodes_used * 100.0 / g_max_free_nodes) << "%)\n";
+    FragmentationReport report = fragmentation();
+    std::cout << "\nFragmentation: " << report.free_bytes + report.wilderness_bytes << " free bytes, largest free block " << report.largest_free_block
+              << " bytes, " << report.external_fragmentation * 100.0 << "% external\n";
 
     std::cout << std::endl;
 }
 
+bool MemoryAllocator::dumpHeapProfile(const char* path) const
+{
+    if (!is_initialized_ || !g_samples) {
+        return false;
+    }
+
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool is_written = false;
+    {
+        std::lock_guard lock{g_profile_mutex};
+        is_written = writeHeapProfile(fd);
+    }
+    return ::close(fd) == 0 && is_written;
+}
+
+bool readTrace(const char* path, std::vector<TraceEvent>& events)
+{
+    std::ifstream file{path, std::ios::binary};
+    std::vector<uint8_t> data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    if (file.bad()) {
+        return false;
+    }
+
+    TraceFileHeader header{};
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION) {
+        return false;
+    }
+
+    events.clear();
+    const uint8_t* in  = data.data() + sizeof(header);
+    const uint8_t* end = data.data() + data.size();
+    while (in < end) {
+        TraceChunkHeader chunk{};
+        if (static_cast<size_t>(end - in) < sizeof(chunk)) {
+            return false;
+        }
+        std::memcpy(&chunk, in, sizeof(chunk));
+        in += sizeof(chunk);
+        if (static_cast<size_t>(end - in) < chunk.bytes) {
+            return false;
+        }
+
+        const uint8_t* chunk_end = in + chunk.bytes;
+        TraceEvent last;
+        while (in < chunk_end) {
+            TraceEvent event;
+            event.op                = static_cast<TraceOp>(*in++);
+            event.thread            = chunk.thread;
+            uint64_t sequence_delta = 0;
+            uint64_t time_delta     = 0;
+            uint64_t ptr_delta      = 0;
+            if (event.op < TraceOp::Alloc || event.op > TraceOp::Free || !getVarint(in, chunk_end, sequence_delta) || !getVarint(in, chunk_end, time_delta)
+                || !getVarint(in, chunk_end, ptr_delta)) {
+                return false;
+            }
+            event.sequence = last.sequence + sequence_delta;
+            event.time_ns  = last.time_ns + time_delta;
+            event.ptr      = last.ptr + unzigzag(ptr_delta);
+            if (event.op != TraceOp::Free && !getVarint(in, chunk_end, event.size)) {
+                return false;
+            }
+            if (event.op == TraceOp::AllocAligned && !getVarint(in, chunk_end, event.alignment)) {
+                return false;
+            }
+            if (event.op == TraceOp::Realloc) {
+                uint64_t old_delta = 0;
+                if (!getVarint(in, chunk_end, old_delta)) {
+                    return false;
+                }
+                event.old_ptr = event.ptr + unzigzag(old_delta);
+            }
+            events.push_back(event);
+            last = event;
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.sequence < b.sequence; });
+    return true;
+}
+
+#if ALLOCATOR_DEBUG
 void MemoryAllocator::dumpBlocks() const
 {
     if (!is_initialized_) {
@@ -974,7 +4055,7 @@ void MemoryAllocator::dumpBlocks() const
         return;
     }
 
-    for (size_t i = 0; i < MAX_REGIONS; ++i) {
+    for (size_t i = 0; i < g_regions_count.load(std::memory_order_acquire); ++i) {
         if (g_regions[i].is_used) {
             const char* type_str = "";
             switch (g_regions[i].region_type) {
@@ -989,21 +4070,14 @@ void MemoryAllocator::dumpBlocks() const
                     break;
             }
 
-            std::cout << "Region " << i << " [" << type_str << "] (" << static_cast<void*>(g_regions[i].start) << " - " << static_cast<void*>(g_regions[i].end)
-                      << "):\n";
+            std::cout << "Region " << i << " [" << type_str << ", arena " << static_cast<int>(g_regions[i].arena_index) << "] ("
+                      << static_cast<void*>(g_regions[i].start) << " - " << static_cast<void*>(g_regions[i].end) << "):\n";
 
-            char* current    = g_regions[i].start;
             size_t block_num = 0;
-
-            while (current < g_regions[i].end) {
-                block_t* block = reinterpret_cast<block_t*>(current);
-                std::cout << "  Block " << block_num++ << ": addr=" << static_cast<void*>(block) << ", size=" << block->current_size
+            forEachBlock(g_regions[i], [&](const block_t* block) {
+                std::cout << "  Block " << block_num++ << ": addr=" << static_cast<const void*>(block) << ", size=" << block->current_size
                           << ", free=" << (block->is_free ? "yes" : "no") << ", prev_size=" << block->prev_size << "\n";
-
-                current += block->current_size;
-                if (block->current_size == 0)
-                    break;
-            }
+            });
         }
     }
 
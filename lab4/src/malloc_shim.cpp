@@ -0,0 +1,364 @@
+// Drop-in replacement of the C and C++ allocation functions backed by MemoryAllocator.
+// Built as liblab4malloc.so, so any binary can run on top of it:
+//     LD_PRELOAD=./liblab4malloc.so ./program
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "allocator.hpp"
+
+using jd::memory::MemoryAllocator;
+
+// glibc keeps its own allocator reachable under these names; everything the heap did not hand out goes there
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* p);
+}
+
+namespace
+{
+constexpr size_t MALLOC_ALIGNMENT = alignof(std::max_align_t);
+constexpr size_t HEAP_RESERVE     = size_t{64} << 30;
+
+pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+std::atomic<bool> g_ready{false};
+// init() may allocate itself (error messages, libc internals), those requests are served by glibc
+__attribute__((tls_model("initial-exec"))) thread_local bool t_initializing = false;
+
+// Numeric environment setting, 0 when it is not set; getenv() and strtoul() do not allocate
+size_t environmentValue(const char* name) noexcept
+{
+    const char* value = getenv(name);
+    return value ? strtoul(value, nullptr, 10) : 0;
+}
+
+void initializeAllocator() noexcept
+{
+    t_initializing = true;
+    // heap profiling is opt-in: LAB4MALLOC_PROFILE_SAMPLE=<bytes> LAB4MALLOC_PROFILE_SIGNAL=<signo>
+    const char* profile_prefix = getenv("LAB4MALLOC_PROFILE_PREFIX");
+    // LAB4MALLOC_TRACE=<path> records every call for bench/trace_replay
+    const char* trace_path = getenv("LAB4MALLOC_TRACE");
+    // A whole program does not fit the default 512MB heap, and its long-lived free blocks pile up,
+    // so the shim takes a big reservation and the O(1) engine. The heap outlives every static destructor,
+    // the OS takes it back with the process
+    MemoryAllocator::allocator().init({
+        .thread_safe          = true,
+        .engine               = jd::memory::CoalesceEngine::TLSF,
+        .lazy_carving         = true,
+        .heap_reserve         = HEAP_RESERVE,
+        .min_alignment        = MALLOC_ALIGNMENT,
+        .release_at_exit      = false,
+        .profile_sample_bytes = environmentValue("LAB4MALLOC_PROFILE_SAMPLE"),
+        .profile_signal       = static_cast<int>(environmentValue("LAB4MALLOC_PROFILE_SIGNAL")),
+        .profile_prefix       = profile_prefix ? profile_prefix : "lab4malloc",
+        .trace_path           = trace_path,
+    });
+    // a fork() from a threaded program must not leave the child a lock held by a thread it does not have
+    pthread_atfork([] { MemoryAllocator::allocator().prepareFork(); }, [] { MemoryAllocator::allocator().afterForkParent(); },
+                   [] { MemoryAllocator::allocator().afterForkChild(); });
+    t_initializing = false;
+    g_ready.store(true, std::memory_order_release);
+}
+
+// The heap is set up by the first allocation of the process, whichever thread makes it
+inline bool ensureInitialized() noexcept
+{
+    if (g_ready.load(std::memory_order_acquire)) [[likely]] {
+        return true;
+    }
+    if (t_initializing) {
+        return false;
+    }
+    pthread_once(&g_init_once, initializeAllocator);
+    return g_ready.load(std::memory_order_acquire);
+}
+
+inline bool isForeign(void* p) noexcept
+{
+    return !g_ready.load(std::memory_order_acquire) || !MemoryAllocator::allocator().owns(p);
+}
+
+size_t foreignUsableSize(void* p) noexcept
+{
+    using usable_size_t          = size_t (*)(void*);
+    static usable_size_t next_fn = reinterpret_cast<usable_size_t>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+    return next_fn ? next_fn(p) : 0;
+}
+
+void* allocateAligned(size_t alignment, size_t size) noexcept
+{
+    if (!ensureInitialized()) {
+        return __libc_memalign(alignment, size);
+    }
+    // a zero-sized request still gets a unique pointer
+    return MemoryAllocator::allocator().allocAligned(size ? size : 1, alignment);
+}
+
+void* newImpl(size_t size)
+{
+    for (;;) {
+        if (void* p = malloc(size)) {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc{};
+        }
+        handler();
+    }
+}
+
+void* newAlignedImpl(size_t size, std::align_val_t alignment)
+{
+    for (;;) {
+        if (void* p = allocateAligned(std::max(static_cast<size_t>(alignment), sizeof(void*)), size)) {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc{};
+        }
+        handler();
+    }
+}
+} // namespace
+
+extern "C" {
+void* malloc(size_t size) noexcept
+{
+    if (!ensureInitialized()) [[unlikely]] {
+        return __libc_malloc(size);
+    }
+    void* p = MemoryAllocator::allocator().alloc(size ? size : 1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* p) noexcept
+{
+    if (!p) {
+        return;
+    }
+    if (isForeign(p)) [[unlikely]] {
+        __libc_free(p);
+        return;
+    }
+    MemoryAllocator::allocator().free(p);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+    if (!ensureInitialized()) [[unlikely]] {
+        return __libc_calloc(count, size);
+    }
+    if (count == 0 || size == 0) {
+        return malloc(1);
+    }
+    void* p = MemoryAllocator::allocator().calloc(count, size);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+    if (!p) {
+        return malloc(size);
+    }
+    if (isForeign(p)) [[unlikely]] {
+        return __libc_realloc(p, size);
+    }
+    if (size == 0) {
+        MemoryAllocator::allocator().free(p);
+        return nullptr;
+    }
+    void* result = MemoryAllocator::allocator().realloc(p, size);
+    if (!result) {
+        errno = ENOMEM;
+    }
+    return result;
+}
+
+void* reallocarray(void* p, size_t count, size_t size) noexcept
+{
+    size_t bytes = 0;
+    if (__builtin_mul_overflow(count, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(p, bytes);
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) noexcept
+{
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* p = allocateAligned(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *result = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    void* p = allocateAligned(alignment, size);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) noexcept
+{
+    return aligned_alloc(static_cast<size_t>(sysconf(_SC_PAGESIZE)), size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    if (size > SIZE_MAX - page_size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void* p) noexcept
+{
+    if (!p) {
+        return 0;
+    }
+    if (isForeign(p)) [[unlikely]] {
+        return foreignUsableSize(p);
+    }
+    return MemoryAllocator::allocator().usableSize(p);
+}
+} // extern "C"
+
+void* operator new(size_t size)
+{
+    return newImpl(size);
+}
+
+void* operator new[](size_t size)
+{
+    return newImpl(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return malloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return newAlignedImpl(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return newAlignedImpl(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateAligned(std::max(static_cast<size_t>(alignment), sizeof(void*)), size);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateAligned(std::max(static_cast<size_t>(alignment), sizeof(void*)), size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
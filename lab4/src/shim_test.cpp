@@ -0,0 +1,249 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <new>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "allocator.hpp"
+
+// glibc's own entry points, the shim hands foreign pointers back to them
+extern "C" void* __libc_malloc(size_t size);
+
+// The process is linked against liblab4malloc.so, so these calls reach the shim like they would under LD_PRELOAD
+namespace test
+{
+using jd::memory::MemoryAllocator;
+
+// volatile keeps the compiler from folding the calls or warning about the sizes
+volatile size_t g_huge_sizes[] = {SIZE_MAX, SIZE_MAX - 3, size_t{PTRDIFF_MAX} + 1};
+
+TEST(MallocShimTest, AllocationsComeFromTheHeap)
+{
+    void* small = malloc(24);
+    void* large = malloc(12 << 20);
+    ASSERT_NE(small, nullptr);
+    ASSERT_NE(large, nullptr);
+    EXPECT_TRUE(MemoryAllocator::allocator().owns(small));
+    EXPECT_TRUE(MemoryAllocator::allocator().owns(large));
+    EXPECT_GE(malloc_usable_size(small), 24u);
+    free(small);
+    free(large);
+}
+
+TEST(MallocShimTest, CallocReturnsZeroedMemory)
+{
+    for (size_t size : {24, 5000, 300 << 10, 12 << 20}) {
+        // dirty a block first, so that a reused one would show
+        void* dirty = malloc(size);
+        ASSERT_NE(dirty, nullptr);
+        memset(dirty, 0xA5, size);
+        free(dirty);
+
+        unsigned char* block = static_cast<unsigned char*>(calloc(1, size));
+        ASSERT_NE(block, nullptr);
+        for (size_t i = 0; i < size; ++i) {
+            ASSERT_EQ(block[i], 0) << "size " << size << " at " << i;
+        }
+        free(block);
+    }
+}
+
+TEST(MallocShimTest, AlignedAllocationsAreAligned)
+{
+    for (size_t alignment = sizeof(void*); alignment <= (64 << 10); alignment <<= 1) {
+        for (size_t size : {1, 5000, 300 << 10}) {
+            void* result = nullptr;
+            ASSERT_EQ(posix_memalign(&result, alignment, size), 0) << alignment << " " << size;
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(result) % alignment, 0u) << alignment << " " << size;
+            EXPECT_GE(malloc_usable_size(result), size);
+            memset(result, 0x3C, size);
+
+            void* block = aligned_alloc(alignment, size);
+            ASSERT_NE(block, nullptr) << alignment << " " << size;
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % alignment, 0u) << alignment << " " << size;
+            EXPECT_GE(malloc_usable_size(block), size);
+            memset(block, 0x3C, size);
+
+            free(result);
+            free(block);
+        }
+    }
+}
+
+TEST(MallocShimTest, UsableSizeCoversTheRequest)
+{
+    for (size_t size = 1; size < (20 << 20); size = size * 3 + 1) {
+        void* block = malloc(size);
+        ASSERT_NE(block, nullptr) << size;
+        size_t usable = malloc_usable_size(block);
+        EXPECT_GE(usable, size);
+        // the whole usable size is the caller's to write
+        memset(block, 0x5A, usable);
+        free(block);
+    }
+    EXPECT_EQ(malloc_usable_size(nullptr), 0u);
+}
+
+TEST(MallocShimTest, GlibcPointersGoBackToGlibc)
+{
+    char* block = static_cast<char*>(__libc_malloc(100));
+    ASSERT_NE(block, nullptr);
+    EXPECT_FALSE(MemoryAllocator::allocator().owns(block));
+    EXPECT_GE(malloc_usable_size(block), 100u);
+    memset(block, 0x71, 100);
+
+    char* grown = static_cast<char*>(realloc(block, 5000));
+    ASSERT_NE(grown, nullptr);
+    EXPECT_FALSE(MemoryAllocator::allocator().owns(grown));
+    for (size_t i = 0; i < 100; ++i) {
+        ASSERT_EQ(grown[i], 0x71) << i;
+    }
+    free(grown);
+
+    free(__libc_malloc(12 << 20));
+}
+
+TEST(MallocShimTest, NewAndDeleteRoundTrip)
+{
+    struct alignas(256) Wide
+    {
+        char bytes[300];
+    };
+
+    int* numbers = new int[1000];
+    EXPECT_TRUE(MemoryAllocator::allocator().owns(numbers));
+    for (int i = 0; i < 1000; ++i) {
+        numbers[i] = i;
+    }
+    EXPECT_EQ(numbers[999], 999);
+    delete[] numbers;
+
+    std::string* strings = new std::string[100];
+    for (size_t i = 0; i < 100; ++i) {
+        strings[i].assign(64 + i, static_cast<char>('a' + i % 26));
+    }
+    EXPECT_EQ(strings[99], std::string(163, static_cast<char>('a' + 99 % 26)));
+    delete[] strings;
+
+    Wide* wide = new Wide;
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(wide) % alignof(Wide), 0u);
+    delete wide;
+
+    Wide* wides = new Wide[7];
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(wides) % alignof(Wide), 0u);
+    delete[] wides;
+}
+
+TEST(MallocShimTest, ImpossibleSizesFailWithENOMEM)
+{
+    for (size_t size : g_huge_sizes) {
+        errno = 0;
+        EXPECT_EQ(malloc(size), nullptr) << size;
+        EXPECT_EQ(errno, ENOMEM) << size;
+
+        errno = 0;
+        EXPECT_EQ(calloc(1, size), nullptr) << size;
+        EXPECT_EQ(errno, ENOMEM) << size;
+
+        errno = 0;
+        EXPECT_EQ(aligned_alloc(64, size), nullptr) << size;
+        EXPECT_EQ(errno, ENOMEM) << size;
+
+        errno = 0;
+        EXPECT_EQ(pvalloc(size), nullptr) << size;
+        EXPECT_EQ(errno, ENOMEM) << size;
+
+        void* result = &result;
+        EXPECT_EQ(posix_memalign(&result, 4096, size), ENOMEM) << size;
+        EXPECT_EQ(result, &result) << size;
+
+        EXPECT_THROW((void)::operator new(size), std::bad_alloc) << size;
+        EXPECT_THROW((void)::operator new(size, std::align_val_t{64}), std::bad_alloc) << size;
+    }
+}
+
+// GCC takes every realloc for a free, the point here is that a failed one is not
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuse-after-free"
+TEST(MallocShimTest, ImpossibleReallocKeepsTheBlock)
+{
+    for (size_t old_size : {40, 100 << 10, 12 << 20}) {
+        unsigned char* block = static_cast<unsigned char*>(malloc(old_size));
+        ASSERT_NE(block, nullptr);
+        memset(block, 0x6B, old_size);
+
+        for (size_t size : g_huge_sizes) {
+            errno = 0;
+            EXPECT_EQ(realloc(block, size), nullptr) << old_size << " to " << size;
+            EXPECT_EQ(errno, ENOMEM) << old_size << " to " << size;
+        }
+        errno = 0;
+        EXPECT_EQ(reallocarray(block, 2, g_huge_sizes[0] / 2 + 1), nullptr);
+        EXPECT_EQ(errno, ENOMEM);
+
+        for (size_t i = 0; i < old_size; i += 64) {
+            ASSERT_EQ(block[i], 0x6B) << "size " << old_size << " at " << i;
+        }
+        free(block);
+    }
+}
+#pragma GCC diagnostic pop
+
+TEST(MallocShimTest, ForkWhileOtherThreadsAllocate)
+{
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> workers;
+    for (unsigned seed = 0; seed < 4; ++seed) {
+        workers.emplace_back([&, seed] {
+            std::mt19937 gen(seed);
+            std::vector<void*> blocks(64);
+            while (!stop.load(std::memory_order_relaxed)) {
+                void*& block = blocks[gen() % blocks.size()];
+                free(block);
+                block = malloc(1 + gen() % (200 << 10));
+            }
+            for (void* block : blocks) {
+                free(block);
+            }
+        });
+    }
+
+    for (int i = 0; i < 100; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // a lock inherited from a worker would hang the child, the alarm turns that into a failure
+            alarm(10);
+            for (size_t size : {24, 5000, 300 << 10, 12 << 20}) {
+                void* block = malloc(size);
+                if (!block) {
+                    _exit(1);
+                }
+                memset(block, 0x2A, size);
+                free(block);
+            }
+            _exit(0);
+        }
+        ASSERT_GT(pid, 0);
+
+        int status = 0;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid);
+        ASSERT_TRUE(WIFEXITED(status)) << "fork " << i << ", signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        ASSERT_EQ(WEXITSTATUS(status), 0) << "fork " << i;
+    }
+
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+} // namespace test